@@ -0,0 +1,168 @@
+/*
+ * File: affinity.c
+ * Description:
+ * 	Builds a CPU placement order from the sysfs NUMA topology and pins
+ *	threads along it.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "affinity.h"
+
+typedef struct placed_cpu_s {
+	int cpu;
+	int node;
+} placed_cpu;
+
+static int placement[CPU_SETSIZE];
+static int num_placed = 0;
+static unsigned int next_slot = 0;
+
+
+// the sysfs directory of each CPU holds a nodeN link for the NUMA node it belongs to
+static int cpu_node(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	int node = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char)entry->d_name[4])) {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+static int compare_placed(const void *a, const void *b)
+{
+	const placed_cpu *x = a;
+	const placed_cpu *y = b;
+	if (x->node != y->node)
+		return x->node - y->node;
+	return x->cpu - y->cpu;
+}
+
+static int place_by_topology(int scatter)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		return AFFINITY_FAILURE;
+
+	placed_cpu cpus[CPU_SETSIZE];
+	int count = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed)) {
+			cpus[count].cpu = cpu;
+			cpus[count].node = cpu_node(cpu);
+			count++;
+		}
+	}
+	if (count == 0)
+		return AFFINITY_FAILURE;
+
+	// compact order is simply node by node
+	qsort(cpus, count, sizeof(placed_cpu), compare_placed);
+	if (!scatter) {
+		for (int i = 0; i < count; i++)
+			placement[i] = cpus[i].cpu;
+		num_placed = count;
+		return AFFINITY_SUCCESS;
+	}
+
+	// scatter takes the next unused CPU of each node in turn
+	int starts[CPU_SETSIZE];
+	int ends[CPU_SETSIZE];
+	int num_nodes = 0;
+	for (int i = 0; i < count; i++) {
+		if (i == 0 || cpus[i].node != cpus[i-1].node) {
+			starts[num_nodes] = i;
+			num_nodes++;
+		}
+		ends[num_nodes-1] = i + 1;
+	}
+
+	num_placed = 0;
+	while (num_placed < count) {
+		for (int n = 0; n < num_nodes; n++) {
+			if (starts[n] < ends[n])
+				placement[num_placed++] = cpus[starts[n]++].cpu;
+		}
+	}
+	return AFFINITY_SUCCESS;
+}
+
+// parses a list such as 0,2,4-7
+static int place_by_list(const char *list)
+{
+	const char *p = list;
+	num_placed = 0;
+	while (*p) {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= CPU_SETSIZE)
+			return AFFINITY_FAILURE;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last >= CPU_SETSIZE)
+				return AFFINITY_FAILURE;
+			p = end;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (num_placed == CPU_SETSIZE)
+				return AFFINITY_FAILURE;
+			placement[num_placed++] = cpu;
+		}
+		if (*p == ',')
+			p++;
+		else if (*p != '\0')
+			return AFFINITY_FAILURE;
+	}
+	return num_placed > 0 ? AFFINITY_SUCCESS : AFFINITY_FAILURE;
+}
+
+int affinity_init(const char *policy)
+{
+	int ret;
+	if (strcmp(policy, "compact") == 0)
+		ret = place_by_topology(0);
+	else if (strcmp(policy, "scatter") == 0)
+		ret = place_by_topology(1);
+	else
+		ret = place_by_list(policy);
+
+	if (ret == AFFINITY_FAILURE)
+		num_placed = 0;
+	return ret;
+}
+
+void affinity_pin_self()
+{
+	if (num_placed == 0)
+		return;
+
+	int cpu = placement[__atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % num_placed];
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	// memory this thread touches first is then allocated on the CPU's own node
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0)
+		fprintf(stderr, "Failed to pin thread to CPU %d: %s.\n", cpu, strerror(err));
+}
@@ -0,0 +1,32 @@
+/*
+ * File: affinity.h
+ * Description:
+ * 	CPU placement for multi-lookup threads. With --cpus <policy>, each
+ *	requester, resolver and writer thread pins itself to the next CPU in
+ *	a placement order when it starts:
+ *	  compact   fill one NUMA node's CPUs before moving to the next, so
+ *	            threads sharing the queue stay on one socket
+ *	  scatter   alternate between NUMA nodes, spreading threads evenly
+ *	  <list>    an explicit list such as 0,2,4-7, used in the given order
+ *	Only CPUs in the process's starting affinity mask are used by compact
+ *	and scatter. When there are more threads than CPUs the order wraps.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define AFFINITY_FAILURE -1
+#define AFFINITY_SUCCESS 0
+
+/* Function to choose the placement order from policy
+ * Must be called before any thread calls affinity_pin_self
+ * Returns AFFINITY_SUCCESS or AFFINITY_FAILURE if policy is not understood
+ */
+int affinity_init(const char *policy);
+
+/* Function to pin the calling thread to the next CPU in the placement order
+ * Does nothing if affinity_init was never called
+ */
+void affinity_pin_self();
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * File: bounded-queue.hpp
+ * Description:
+ * 	Header-only fixed-capacity FIFO queue, BoundedQueue<T, Capacity, Policy>.
+ *
+ *	Capacity is a compile-time power of two, so a slot is found with a
+ *	mask instead of the modulo the C queue in queue.h needs, and the slots
+ *	live inside the queue object rather than behind a pointer. Elements
+ *	are constructed in place with try_emplace and moved out by try_pop,
+ *	so payloads need not be pointers.
+ *
+ *	Policy selects the synchronization, both lock-free:
+ *	  spsc  one producer thread and one consumer thread
+ *	  mpmc  any number of each; every slot carries a sequence number that
+ *	        tells producers and consumers whose turn it is
+ *	Neither blocks: try_emplace fails when full and try_pop when empty.
+ */
+
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace bounded_queue {
+
+struct spsc {};
+struct mpmc {};
+
+// keeps the producer and consumer indices from sharing a cache line
+static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+template <typename T, std::size_t Capacity, typename Policy = mpmc>
+class BoundedQueue;
+
+template <typename T, std::size_t Capacity>
+class BoundedQueue<T, Capacity, spsc> {
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static constexpr std::size_t MASK = Capacity - 1;
+
+public:
+	BoundedQueue() = default;
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+	// destroys whatever is left; no other thread may be using the queue
+	~BoundedQueue()
+	{
+		std::size_t tail = tail_index.load(std::memory_order_relaxed);
+		for (std::size_t i = head_index.load(std::memory_order_relaxed); i != tail; i++)
+			std::launder(reinterpret_cast<T *>(slot(i)))->~T();
+	}
+
+	// producer only
+	template <typename... Args>
+	bool try_emplace(Args &&...args)
+	{
+		std::size_t tail = tail_index.load(std::memory_order_relaxed);
+		if (tail - head_index.load(std::memory_order_acquire) == Capacity)
+			return false;
+		new (slot(tail)) T(std::forward<Args>(args)...);
+		tail_index.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_push(T value) { return try_emplace(std::move(value)); }
+
+	// consumer only
+	bool try_pop(T &out)
+	{
+		std::size_t head = head_index.load(std::memory_order_relaxed);
+		if (head == tail_index.load(std::memory_order_acquire))
+			return false;
+		T *element = std::launder(reinterpret_cast<T *>(slot(head)));
+		out = std::move(*element);
+		element->~T();
+		head_index.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	static constexpr std::size_t capacity() { return Capacity; }
+
+private:
+	void *slot(std::size_t index) { return &slots[(index & MASK) * sizeof(T)]; }
+
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> head_index{0};
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> tail_index{0};
+	alignas(CACHE_LINE_SIZE) alignas(T) unsigned char slots[Capacity * sizeof(T)];
+};
+
+template <typename T, std::size_t Capacity>
+class BoundedQueue<T, Capacity, mpmc> {
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static constexpr std::size_t MASK = Capacity - 1;
+
+	struct cell {
+		// equals the index of the push that may fill the cell, or that index + 1 once it is full
+		std::atomic<std::size_t> sequence;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+public:
+	BoundedQueue()
+	{
+		for (std::size_t i = 0; i < Capacity; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+	// destroys whatever is left; no other thread may be using the queue
+	~BoundedQueue()
+	{
+		std::size_t tail = tail_index.load(std::memory_order_relaxed);
+		for (std::size_t i = head_index.load(std::memory_order_relaxed); i != tail; i++)
+			std::launder(reinterpret_cast<T *>(cells[i & MASK].storage))->~T();
+	}
+
+	template <typename... Args>
+	bool try_emplace(Args &&...args)
+	{
+		std::size_t tail = tail_index.load(std::memory_order_relaxed);
+		cell *c;
+		while (true) {
+			c = &cells[tail & MASK];
+			std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+			std::intptr_t diff = (std::intptr_t)sequence - (std::intptr_t)tail;
+			if (diff == 0) {
+				if (tail_index.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				tail = tail_index.load(std::memory_order_relaxed);
+		}
+		new (c->storage) T(std::forward<Args>(args)...);
+		c->sequence.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_push(T value) { return try_emplace(std::move(value)); }
+
+	bool try_pop(T &out)
+	{
+		std::size_t head = head_index.load(std::memory_order_relaxed);
+		cell *c;
+		while (true) {
+			c = &cells[head & MASK];
+			std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+			std::intptr_t diff = (std::intptr_t)sequence - (std::intptr_t)(head + 1);
+			if (diff == 0) {
+				if (head_index.compare_exchange_weak(head, head + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				head = head_index.load(std::memory_order_relaxed);
+		}
+		T *element = std::launder(reinterpret_cast<T *>(c->storage));
+		out = std::move(*element);
+		element->~T();
+		// the cell is free for the push one lap later
+		c->sequence.store(head + Capacity, std::memory_order_release);
+		return true;
+	}
+
+	static constexpr std::size_t capacity() { return Capacity; }
+
+private:
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> head_index{0};
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> tail_index{0};
+	alignas(CACHE_LINE_SIZE) cell cells[Capacity];
+};
+
+}
+
+#endif
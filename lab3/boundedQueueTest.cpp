@@ -0,0 +1,156 @@
+/*
+ * File: boundedQueueTest.cpp
+ * Description:
+ * 	This file contains test code for BoundedQueue in bounded-queue.hpp:
+ *	the same fill/drain checks as queueTest.c for both policies, a
+ *	move-only payload, and producer/consumer threads for each policy.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bounded-queue.hpp"
+
+using bounded_queue::BoundedQueue;
+
+#define TEST_SIZE 16
+#define THREAD_ITEMS 200000
+#define NUM_PRODUCERS 4
+#define NUM_CONSUMERS 4
+
+static int errors = 0;
+
+static void fail(const char *message)
+{
+	fprintf(stderr, "error: %s\n", message);
+	errors++;
+}
+
+template <typename Policy>
+static void test_fill_and_drain(const char *empty_message)
+{
+	BoundedQueue<int, TEST_SIZE, Policy> q;
+	int out;
+
+	/* Test that pop fails when empty */
+	if (q.try_pop(out))
+		fail(empty_message);
+
+	/* Test push until full, and that push fails when full */
+	for (int i = 0; i < TEST_SIZE; i++) {
+		if (!q.try_push(i))
+			fail("push failed before the queue was full");
+	}
+	if (q.try_push(TEST_SIZE))
+		fail("push did not fail when full");
+
+	/* Test pop in FIFO order, twice around the ring */
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < TEST_SIZE; i++) {
+			if (!q.try_pop(out) || out != i)
+				fail("push/pop mismatch");
+			if (round == 0 && !q.try_push(i))
+				fail("push failed after a pop");
+		}
+	}
+
+	/* Test that pop fails when empty again */
+	if (q.try_pop(out))
+		fail("pop did not fail when empty");
+}
+
+template <typename Policy>
+static void test_move_only()
+{
+	BoundedQueue<std::unique_ptr<int>, 4, Policy> q;
+	if (!q.try_emplace(new int(7)) || !q.try_push(std::make_unique<int>(8)))
+		fail("emplace of a move-only payload failed");
+
+	std::unique_ptr<int> out;
+	if (!q.try_pop(out) || !out || *out != 7)
+		fail("move-only payload was not moved out");
+	// the remaining element is freed by the destructor; a leak checker would notice otherwise
+}
+
+static void test_spsc_threads()
+{
+	static BoundedQueue<long, 64, bounded_queue::spsc> q;
+	long sum = 0;
+	long next_expected = 0;
+
+	std::thread consumer([&] {
+		long value;
+		for (long received = 0; received < THREAD_ITEMS; ) {
+			if (!q.try_pop(value))
+				std::this_thread::yield();
+			else {
+				if (value != next_expected)
+					fail("spsc order lost between threads");
+				next_expected = value + 1;
+				sum += value;
+				received++;
+			}
+		}
+	});
+	for (long i = 0; i < THREAD_ITEMS; i++) {
+		while (!q.try_push(i))
+			std::this_thread::yield();
+	}
+	consumer.join();
+
+	if (sum != (long)THREAD_ITEMS * (THREAD_ITEMS - 1) / 2)
+		fail("spsc items lost between threads");
+}
+
+static void test_mpmc_threads()
+{
+	static BoundedQueue<long, 64, bounded_queue::mpmc> q;
+	std::vector<std::thread> threads;
+	std::vector<long> sums(NUM_CONSUMERS, 0);
+	std::atomic<long> remaining(NUM_PRODUCERS * (long)THREAD_ITEMS);
+
+	for (int c = 0; c < NUM_CONSUMERS; c++) {
+		threads.emplace_back([&, c] {
+			long value;
+			while (remaining.load() > 0) {
+				if (!q.try_pop(value))
+					std::this_thread::yield();
+				else {
+					sums[c] += value;
+					remaining--;
+				}
+			}
+		});
+	}
+	for (int p = 0; p < NUM_PRODUCERS; p++) {
+		threads.emplace_back([&] {
+			for (long i = 0; i < THREAD_ITEMS; i++) {
+				while (!q.try_push(i))
+					std::this_thread::yield();
+			}
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+
+	long sum = 0;
+	for (long s : sums)
+		sum += s;
+	if (sum != NUM_PRODUCERS * ((long)THREAD_ITEMS * (THREAD_ITEMS - 1) / 2))
+		fail("mpmc items lost or duplicated between threads");
+}
+
+int main()
+{
+	test_fill_and_drain<bounded_queue::spsc>("spsc pop did not fail when empty");
+	test_fill_and_drain<bounded_queue::mpmc>("mpmc pop did not fail when empty");
+	test_move_only<bounded_queue::spsc>();
+	test_move_only<bounded_queue::mpmc>();
+	test_spsc_threads();
+	test_mpmc_threads();
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * File: bqueue.cpp
+ * Description:
+ * 	The C shim for bounded-queue.hpp. It is built without exceptions or
+ *	RTTI and allocates with malloc, so C programs link it without the C++
+ *	runtime library.
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "bounded-queue.hpp"
+#include "bqueue.h"
+
+typedef bounded_queue::BoundedQueue<void *, BQUEUE_CAPACITY, bounded_queue::mpmc> job_queue;
+
+struct bqueue_s {
+	job_queue queue;
+};
+
+bqueue *bqueue_create()
+{
+	void *memory = aligned_alloc(alignof(bqueue), sizeof(bqueue));
+	if (!memory)
+		return NULL;
+	return new (memory) bqueue;
+}
+
+int bqueue_push(bqueue *q, void *payload)
+{
+	return q->queue.try_push(payload) ? BQUEUE_SUCCESS : BQUEUE_FAILURE;
+}
+
+void *bqueue_pop(bqueue *q)
+{
+	void *payload;
+	return q->queue.try_pop(payload) ? payload : NULL;
+}
+
+void bqueue_destroy(bqueue *q)
+{
+	q->~bqueue();
+	free(q);
+}
@@ -0,0 +1,49 @@
+/*
+ * File: bqueue.h
+ * Description:
+ * 	C interface to BoundedQueue<void *, BQUEUE_CAPACITY, mpmc> from
+ *	bounded-queue.hpp, for the multi-lookup job queue. Push and pop never
+ *	block or take a lock; callers that need to wait for space or work do
+ *	so themselves.
+ */
+
+#ifndef BQUEUE_H
+#define BQUEUE_H
+
+// must be a power of two
+#define BQUEUE_CAPACITY 64
+
+#define BQUEUE_FAILURE -1
+#define BQUEUE_SUCCESS 0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bqueue_s bqueue;
+
+/* Function to create an empty queue
+ * Returns NULL on failure
+ */
+bqueue *bqueue_create();
+
+/* Function to add payload to the end of the queue
+ * Returns BQUEUE_SUCCESS, or BQUEUE_FAILURE if the queue is full
+ * Thread-safe
+ */
+int bqueue_push(bqueue *q, void *payload);
+
+/* Function to remove the payload at the front of the queue
+ * Returns NULL if the queue is empty
+ * Thread-safe
+ */
+void *bqueue_pop(bqueue *q);
+
+/* Function to free the queue; payloads still queued are not freed */
+void bqueue_destroy(bqueue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * File: cache.c
+ * Description:
+ * 	Direct-mapped hostname cache. Each slot is guarded by one of a
+ *	small number of striped mutexes so resolvers rarely contend.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "cache.h"
+#include "intern.h"
+
+#define CACHE_LOCKS 64
+
+typedef struct cache_entry_s {
+	const char *hostname;
+	// CLOCK_MONOTONIC second at which the entry stops being used
+	time_t expires;
+	char ip_str[INET6_ADDRSTRLEN];
+} cache_entry;
+
+static cache_entry entries[CACHE_SIZE];
+static pthread_mutex_t locks[CACHE_LOCKS] = {
+	[0 ... CACHE_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned int hash_hostname(const char *hostname)
+{
+	// 32-bit FNV-1a
+	unsigned int hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)hostname; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static time_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+int cache_lookup(const char *hostname, char *ip_str, size_t size)
+{
+	unsigned int slot = hash_hostname(hostname) % CACHE_SIZE;
+	pthread_mutex_t *lock = &locks[slot % CACHE_LOCKS];
+	int ret = CACHE_MISS;
+
+	pthread_mutex_lock(lock);
+	cache_entry *entry = &entries[slot];
+	if (entry->hostname == hostname && now() < entry->expires) {
+		strncpy(ip_str, entry->ip_str, size);
+		ip_str[size-1] = '\0';
+		ret = CACHE_HIT;
+	}
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+void cache_insert(const char *hostname, const char *ip_str)
+{
+	unsigned int slot = hash_hostname(hostname) % CACHE_SIZE;
+	pthread_mutex_t *lock = &locks[slot % CACHE_LOCKS];
+
+	// the entry holds its own reference, so the name outlives the job that resolved it
+	const char *held = intern_acquire(hostname);
+	const char *replaced = NULL;
+
+	pthread_mutex_lock(lock);
+	cache_entry *entry = &entries[slot];
+	if (entry->hostname == hostname)
+		replaced = held;
+	else {
+		replaced = entry->hostname;
+		entry->hostname = held;
+	}
+	entry->expires = now() + (ip_str[0] ? CACHE_TTL_SEC : CACHE_NEGATIVE_TTL_SEC);
+	strncpy(entry->ip_str, ip_str, sizeof(entry->ip_str));
+	entry->ip_str[sizeof(entry->ip_str)-1] = '\0';
+	pthread_mutex_unlock(lock);
+
+	if (replaced)
+		intern_release(replaced);
+}
+
+void cache_cleanup()
+{
+	for (int i = 0; i < CACHE_SIZE; i++) {
+		if (entries[i].hostname)
+			intern_release(entries[i].hostname);
+		entries[i].hostname = NULL;
+	}
+}
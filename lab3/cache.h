@@ -0,0 +1,49 @@
+/*
+ * File: cache.h
+ * Description:
+ * 	A small, bounded, thread-safe cache of hostname lookups shared by all
+ *	resolver threads. Entries live for CACHE_TTL_SEC, so long-running
+ *	modes (e.g. the daemon) keep their cache warm across requests but
+ *	still see records change. Failed lookups are cached too (as an empty
+ *	address string), for the shorter CACHE_NEGATIVE_TTL_SEC, so repeated
+ *	bad names do not pay for a resolver timeout each time while a
+ *	transient failure is retried soon.
+ *	Hostnames must be interned (see intern.h): entries keep the caller's
+ *	pointer rather than a copy, and keys are compared by address. Each
+ *	entry holds a reference to its name, dropped when the entry is
+ *	replaced, so counted names stay valid while they are cached.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#define CACHE_SIZE 4096
+
+#ifndef CACHE_TTL_SEC
+#define CACHE_TTL_SEC 300
+#endif
+#ifndef CACHE_NEGATIVE_TTL_SEC
+#define CACHE_NEGATIVE_TTL_SEC 30
+#endif
+
+#define CACHE_HIT 1
+#define CACHE_MISS 0
+
+/* Function to look up hostname in the cache
+ * On a hit on an entry that has not expired, copies the cached address (possibly "") into ip_str
+ * and returns CACHE_HIT, otherwise returns CACHE_MISS
+ */
+int cache_lookup(const char *hostname, char *ip_str, size_t size);
+
+/* Function to record the address resolved for hostname
+ * ip_str should be "" if the lookup failed
+ * Replaces whatever entry previously occupied the same slot
+ */
+void cache_insert(const char *hostname, const char *ip_str);
+
+/* Function to empty the cache; no other thread may use the cache */
+void cache_cleanup();
+
+#endif
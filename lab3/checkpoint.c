@@ -0,0 +1,201 @@
+/*
+ * File: checkpoint.c
+ * Description:
+ * 	Checkpointer thread and the requester/resolver hooks it relies on.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "checkpoint.h"
+#include "journal.h"
+
+typedef struct checkpoint_slot_s {
+	// journal key: the input's position on the command line and its name
+	char *key;
+	long offset;
+} checkpoint_slot;
+
+static journal checkpoints;
+static checkpoint_slot *slots = NULL;
+static int num_slots = 0;
+
+static long (*sync_checkpoint_output)();
+
+// names submitted but not yet written; updated without a lock on every name
+static int in_flight = 0;
+// set while the checkpointer wants requesters to pause; read without a lock on every name
+static int pending = 0;
+
+// the remaining state is protected by lock_checkpoint
+static int active_requesters = 0;
+static int paused_requesters = 0;
+static int stopping = 0;
+static pthread_t checkpointer_thread;
+static pthread_mutex_t lock_checkpoint = PTHREAD_MUTEX_INITIALIZER;
+// signaled when a requester pauses or finishes, in_flight reaches zero, or stopping is set
+static pthread_cond_t checkpointer_wakeup;
+// broadcast when a checkpoint has been written and requesters may continue
+static pthread_cond_t checkpoint_taken;
+
+
+int checkpoint_open(const char *journal_path, int resume)
+{
+	if (!resume && unlink(journal_path) == -1 && errno != ENOENT) {
+		perror("Error discarding old checkpoints");
+		return CHECKPOINT_FAILURE;
+	}
+
+	if (journal_open(&checkpoints, journal_path) == JOURNAL_FAILURE)
+		return CHECKPOINT_FAILURE;
+	return CHECKPOINT_SUCCESS;
+}
+
+long checkpoint_output_length()
+{
+	// every record written by one checkpoint carries the same output length
+	return checkpoints.num_entries > 0 ? checkpoints.entries[0].output_length : 0;
+}
+
+int checkpoint_add_requester(int index, const char *input_filename, long *resume_offset)
+{
+	checkpoint_slot *grown = realloc(slots, (num_slots + 1) * sizeof(checkpoint_slot));
+	if (!grown)
+		return CHECKPOINT_FAILURE;
+	slots = grown;
+
+	checkpoint_slot *slot = &slots[num_slots];
+	slot->key = malloc(strlen(input_filename) + 16);
+	if (!slot->key)
+		return CHECKPOINT_FAILURE;
+	sprintf(slot->key, "%d %s", index, input_filename);
+
+	long output_length;
+	if (!journal_find(&checkpoints, slot->key, &slot->offset, &output_length))
+		slot->offset = 0;
+	*resume_offset = slot->offset;
+
+	active_requesters++;
+	return num_slots++;
+}
+
+static void write_checkpoint()
+{
+	long output_length = sync_checkpoint_output();
+	if (output_length == -1) {
+		fprintf(stderr, "Failed to flush results for checkpoint.\n");
+		return;
+	}
+
+	for (int i = 0; i < num_slots; i++)
+		journal_record(&checkpoints, slots[i].key, slots[i].offset, output_length);
+	if (journal_commit(&checkpoints) == JOURNAL_FAILURE)
+		fprintf(stderr, "Failed to write checkpoint.\n");
+}
+
+static void *checkpointer_entry_point()
+{
+	pthread_mutex_lock(&lock_checkpoint);
+	while (!stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += CHECKPOINT_INTERVAL_SEC;
+		while (!stopping && pthread_cond_timedwait(&checkpointer_wakeup, &lock_checkpoint, &deadline) != ETIMEDOUT)
+			;
+		if (stopping)
+			break;
+
+		// hold requesters at their next name boundary and let the resolvers drain the queue
+		__atomic_store_n(&pending, 1, __ATOMIC_SEQ_CST);
+		while (paused_requesters < active_requesters || __atomic_load_n(&in_flight, __ATOMIC_SEQ_CST) > 0)
+			pthread_cond_wait(&checkpointer_wakeup, &lock_checkpoint);
+
+		write_checkpoint();
+
+		__atomic_store_n(&pending, 0, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&checkpoint_taken);
+	}
+	pthread_mutex_unlock(&lock_checkpoint);
+	return NULL;
+}
+
+void checkpoint_start(long (*sync_output)())
+{
+	sync_checkpoint_output = sync_output;
+
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&checkpointer_wakeup, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_cond_init(&checkpoint_taken, NULL);
+
+	pthread_create(&checkpointer_thread, NULL, checkpointer_entry_point, NULL);
+}
+
+void checkpoint_submitted()
+{
+	__atomic_add_fetch(&in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+void checkpoint_written()
+{
+	if (__atomic_sub_fetch(&in_flight, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&pending, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&lock_checkpoint);
+		pthread_cond_signal(&checkpointer_wakeup);
+		pthread_mutex_unlock(&lock_checkpoint);
+	}
+}
+
+void checkpoint_safe_point(int slot, FILE *input_fp)
+{
+	if (!__atomic_load_n(&pending, __ATOMIC_SEQ_CST))
+		return;
+
+	// ftell costs a system call, so it is only taken when a checkpoint needs it
+	long offset = ftell(input_fp);
+
+	pthread_mutex_lock(&lock_checkpoint);
+	slots[slot].offset = offset;
+	paused_requesters++;
+	pthread_cond_signal(&checkpointer_wakeup);
+	while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&checkpoint_taken, &lock_checkpoint);
+	paused_requesters--;
+	pthread_mutex_unlock(&lock_checkpoint);
+}
+
+void checkpoint_requester_done(int slot, FILE *input_fp)
+{
+	long offset = input_fp ? ftell(input_fp) : slots[slot].offset;
+
+	pthread_mutex_lock(&lock_checkpoint);
+	slots[slot].offset = offset;
+	active_requesters--;
+	pthread_cond_signal(&checkpointer_wakeup);
+	pthread_mutex_unlock(&lock_checkpoint);
+}
+
+void checkpoint_finish()
+{
+	pthread_mutex_lock(&lock_checkpoint);
+	stopping = 1;
+	pthread_cond_signal(&checkpointer_wakeup);
+	pthread_mutex_unlock(&lock_checkpoint);
+	pthread_join(checkpointer_thread, NULL);
+
+	write_checkpoint();
+	journal_close(&checkpoints);
+
+	for (int i = 0; i < num_slots; i++)
+		free(slots[i].key);
+	free(slots);
+	pthread_cond_destroy(&checkpointer_wakeup);
+	pthread_cond_destroy(&checkpoint_taken);
+}
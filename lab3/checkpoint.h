@@ -0,0 +1,65 @@
+/*
+ * File: checkpoint.h
+ * Description:
+ * 	Periodic checkpoints for ordinary multi-lookup runs, so a crashed run
+ *	can be finished with --resume instead of started over.
+ *
+ *	Every CHECKPOINT_INTERVAL_SEC seconds the requesters pause at their next
+ *	name boundary, the resolvers finish whatever is already queued, and the
+ *	offset of every input file is recorded in the journal (see journal.h)
+ *	together with the output file length at that moment. Between
+ *	checkpoints the only cost is one atomic increment and decrement per
+ *	name and one flag test per name in each requester.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+
+#ifndef CHECKPOINT_INTERVAL_SEC
+#define CHECKPOINT_INTERVAL_SEC 30
+#endif
+
+#define CHECKPOINT_FAILURE -1
+#define CHECKPOINT_SUCCESS 0
+
+/* Function to open the checkpoint journal at journal_path
+ * If resume is 0, any earlier checkpoints are discarded
+ * Returns CHECKPOINT_SUCCESS or CHECKPOINT_FAILURE
+ */
+int checkpoint_open(const char *journal_path, int resume);
+
+/* Function to return the output length recorded by the last checkpoint, or 0 */
+long checkpoint_output_length();
+
+/* Function to register input file number index (as given on the command line)
+ * Must be called for every input before checkpoint_start
+ * Returns the slot used to identify this requester, and sets resume_offset
+ * to the input offset recorded by the last checkpoint, or 0
+ */
+int checkpoint_add_requester(int index, const char *input_filename, long *resume_offset);
+
+/* Function to start taking periodic checkpoints
+ * sync_output must flush all results written so far and return the output length
+ */
+void checkpoint_start(long (*sync_output)());
+
+/* Functions to account for a name entering and leaving the pipeline */
+void checkpoint_submitted();
+void checkpoint_written();
+
+/* Function called by a requester after submitting each name
+ * Blocks while a checkpoint is being taken
+ */
+void checkpoint_safe_point(int slot, FILE *input_fp);
+
+/* Function called by a requester once it has submitted its last name */
+void checkpoint_requester_done(int slot, FILE *input_fp);
+
+/* Function to stop checkpointing and record the final state
+ * All requesters must be done and all names written
+ */
+void checkpoint_finish();
+
+#endif
@@ -0,0 +1,607 @@
+/*
+ * File: coro.hpp
+ * Description:
+ * 	A small C++20 coroutine runtime for multi-lookup-coro.
+ *
+ *	Task       a detached coroutine; it starts when spawned and frees its
+ *	           own frame when it finishes
+ *	Scheduler  runs ready coroutines on N worker threads; idle workers
+ *	           block in epoll_wait on an eventfd (new work) and any fds
+ *	           awaited with readable()
+ *	AsyncQueue a bounded queue whose push and pop suspend instead of block
+ *	Semaphore  limits how many lookups are outstanding at once
+ *	Resolver   awaitable DNS lookups over a few non-blocking UDP sockets
+ *	           connected to one recursive resolver. Queries are encoded
+ *	           with dnswire and matched to replies by transaction ID, as
+ *	           in dnstcp; one task per socket awaits readable() and drains
+ *	           its replies, and one task retries queries left unanswered
+ *	           for RESOLVER_TIMEOUT_MS. No thread ever blocks on a lookup,
+ *	           so up to RESOLVER_MAX_IN_FLIGHT can be outstanding at once
+ */
+
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+extern "C" {
+#include "dnswire.h"
+}
+
+namespace coro {
+
+class Scheduler;
+
+static const int RESOLVER_SOCKETS = 8;
+// queries outstanding on one socket; the low bits of each transaction ID pick its slot
+static const int RESOLVER_SLOT_BITS = 12;
+static const int RESOLVER_SLOTS = 1 << RESOLVER_SLOT_BITS;
+static const long RESOLVER_MAX_IN_FLIGHT = RESOLVER_SOCKETS * RESOLVER_SLOTS;
+static const long RESOLVER_TIMEOUT_MS = 2000;
+static const int RESOLVER_MAX_ATTEMPTS = 3;
+// how often unanswered queries are checked
+static const long RESOLVER_TICK_MS = 100;
+static const int RESOLVER_MAX_RECORDS = 32;
+// a resolver sends at most 512 bytes to a query without EDNS; this leaves room for one that sends more
+static const size_t RESOLVER_MAX_MESSAGE = 4096;
+// asked for, but capped by net.core.rmem_max; replies dropped for lack of room are retried
+static const int RESOLVER_RECEIVE_BUFFER = 4 << 20;
+
+struct Task {
+	struct promise_type {
+		Scheduler *scheduler = nullptr;
+
+		Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		auto final_suspend() noexcept;
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+class Scheduler {
+public:
+	explicit Scheduler(int num_workers) : num_workers(num_workers)
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (epoll_fd == -1 || wake_fd == -1) {
+			perror("Failed to set up scheduler");
+			std::exit(EXIT_FAILURE);
+		}
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = &wake_marker;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+	}
+
+	~Scheduler()
+	{
+		close(wake_fd);
+		close(epoll_fd);
+	}
+
+	void spawn(Task task)
+	{
+		task.handle.promise().scheduler = this;
+		live_tasks.fetch_add(1);
+		schedule(task.handle);
+	}
+
+	// thread-safe; may be called from any thread
+	void schedule(std::coroutine_handle<> handle)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			ready.push_back(handle);
+		}
+		// pairs with the recheck in worker(): either the worker sees the handle, or we see it sleeping
+		if (sleeping_workers.load() > 0)
+			wake();
+	}
+
+	// suspends until fd is readable; fd should be non-blocking
+	auto readable(int fd)
+	{
+		struct awaiter {
+			Scheduler &scheduler;
+			int fd;
+			bool await_ready() { return false; }
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				struct epoll_event event;
+				event.events = EPOLLIN | EPOLLONESHOT;
+				event.data.ptr = handle.address();
+				if (epoll_ctl(scheduler.epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+				    epoll_ctl(scheduler.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+					return false;
+				return true;
+			}
+			void await_resume() {}
+		};
+		return awaiter{*this, fd};
+	}
+
+	// runs the workers until every spawned task has finished
+	void run()
+	{
+		std::vector<std::thread> threads;
+		for (int i = 1; i < num_workers; i++)
+			threads.emplace_back([this] { worker(); });
+		worker();
+		for (auto &thread : threads)
+			thread.join();
+	}
+
+	void task_done()
+	{
+		if (live_tasks.fetch_sub(1) == 1) {
+			stopping.store(true);
+			// the eventfd is left readable once stopping, so every sleeping worker wakes and exits
+			wake();
+		}
+	}
+
+private:
+	void wake()
+	{
+		uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			perror("Failed to wake scheduler");
+	}
+
+	std::coroutine_handle<> next_ready()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (ready.empty())
+			return nullptr;
+		std::coroutine_handle<> handle = ready.front();
+		ready.pop_front();
+		return handle;
+	}
+
+	void worker()
+	{
+		while (true) {
+			std::coroutine_handle<> handle = next_ready();
+			if (handle) {
+				handle.resume();
+				continue;
+			}
+			if (stopping.load())
+				return;
+
+			sleeping_workers.fetch_add(1);
+			handle = next_ready();
+			if (handle || stopping.load()) {
+				sleeping_workers.fetch_sub(1);
+				if (handle)
+					handle.resume();
+				continue;
+			}
+
+			struct epoll_event events[16];
+			int n = epoll_wait(epoll_fd, events, 16, -1);
+			sleeping_workers.fetch_sub(1);
+			for (int i = 0; i < n; i++) {
+				void *ptr = events[i].data.ptr;
+				if (ptr == &wake_marker) {
+					uint64_t count;
+					if (!stopping.load() && read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+						perror("Failed to read scheduler wakeup");
+				}
+				else
+					schedule(std::coroutine_handle<>::from_address(ptr));
+			}
+		}
+	}
+
+	int num_workers;
+	int epoll_fd;
+	int wake_fd;
+	char wake_marker = 0;
+
+	std::mutex lock;
+	std::deque<std::coroutine_handle<>> ready;
+	std::atomic<long> live_tasks{0};
+	std::atomic<int> sleeping_workers{0};
+	std::atomic<bool> stopping{false};
+};
+
+inline auto Task::promise_type::final_suspend() noexcept
+{
+	struct awaiter {
+		bool await_ready() noexcept { return false; }
+		void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+		{
+			Scheduler *scheduler = handle.promise().scheduler;
+			handle.destroy();
+			scheduler->task_done();
+		}
+		void await_resume() noexcept {}
+	};
+	return awaiter{};
+}
+
+template <typename T>
+class AsyncQueue {
+public:
+	AsyncQueue(Scheduler &scheduler, size_t capacity) : scheduler(scheduler), capacity(capacity) {}
+
+	struct push_awaiter {
+		AsyncQueue &queue;
+		T value;
+		std::coroutine_handle<> handle;
+
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (!queue.poppers.empty()) {
+				// hand the value straight to a waiting consumer
+				auto *popper = queue.poppers.front();
+				queue.poppers.pop_front();
+				popper->result = std::move(value);
+				queue.scheduler.schedule(popper->handle);
+				return false;
+			}
+			if (queue.items.size() < queue.capacity) {
+				queue.items.push_back(std::move(value));
+				return false;
+			}
+			handle = h;
+			queue.pushers.push_back(this);
+			return true;
+		}
+		void await_resume() {}
+	};
+
+	struct pop_awaiter {
+		AsyncQueue &queue;
+		std::optional<T> result;
+		std::coroutine_handle<> handle;
+
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (!queue.items.empty()) {
+				result = std::move(queue.items.front());
+				queue.items.pop_front();
+				// the freed slot goes to the longest waiting producer
+				if (!queue.pushers.empty()) {
+					auto *pusher = queue.pushers.front();
+					queue.pushers.pop_front();
+					queue.items.push_back(std::move(pusher->value));
+					queue.scheduler.schedule(pusher->handle);
+				}
+				return false;
+			}
+			if (queue.closed)
+				return false;
+			handle = h;
+			queue.poppers.push_back(this);
+			return true;
+		}
+		// empty once the queue is closed and drained
+		std::optional<T> await_resume() { return std::move(result); }
+	};
+
+	push_awaiter push(T value) { return push_awaiter{*this, std::move(value), nullptr}; }
+	pop_awaiter pop() { return pop_awaiter{*this, std::nullopt, nullptr}; }
+
+	// wakes every waiting consumer; pushing after close is not allowed
+	void close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		for (auto *popper : poppers)
+			scheduler.schedule(popper->handle);
+		poppers.clear();
+	}
+
+private:
+	Scheduler &scheduler;
+	size_t capacity;
+	bool closed = false;
+	std::mutex lock;
+	std::deque<T> items;
+	std::deque<push_awaiter *> pushers;
+	std::deque<pop_awaiter *> poppers;
+};
+
+class Semaphore {
+public:
+	Semaphore(Scheduler &scheduler, long permits) : scheduler(scheduler), permits(permits) {}
+
+	struct acquire_awaiter {
+		Semaphore &semaphore;
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			std::lock_guard<std::mutex> guard(semaphore.lock);
+			if (semaphore.permits > 0) {
+				semaphore.permits--;
+				return false;
+			}
+			semaphore.waiters.push_back(handle);
+			return true;
+		}
+		void await_resume() {}
+	};
+
+	acquire_awaiter acquire() { return acquire_awaiter{*this}; }
+
+	void release()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		// the permit passes directly to a waiter, if there is one
+		if (!waiters.empty()) {
+			scheduler.schedule(waiters.front());
+			waiters.pop_front();
+		}
+		else
+			permits++;
+	}
+
+private:
+	Scheduler &scheduler;
+	long permits;
+	std::mutex lock;
+	std::deque<std::coroutine_handle<>> waiters;
+};
+
+class Resolver {
+public:
+	struct awaiter {
+		Resolver &resolver;
+		const char *hostname;
+		char *ip_str;
+		size_t size;
+		std::coroutine_handle<> handle;
+
+		bool await_ready() { return false; }
+		// resumes at once, with "", if the name cannot be queried
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			return resolver.submit(this);
+		}
+		void await_resume() {}
+	};
+
+	explicit Resolver(Scheduler &scheduler) : scheduler(scheduler) {}
+
+	~Resolver()
+	{
+		for (auto &s : sockets) {
+			if (s.fd != -1)
+				::close(s.fd);
+		}
+		if (timer_fd != -1)
+			::close(timer_fd);
+	}
+
+	// connects the sockets to server, whose replies are the only ones they receive, and spawns
+	// the tasks that receive and retry; returns false if the sockets cannot be set up
+	bool start(const struct sockaddr *server, socklen_t server_len)
+	{
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd == -1)
+			return false;
+		std::random_device seed;
+		for (auto &s : sockets) {
+			s.fd = socket(server->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (s.fd == -1 || connect(s.fd, server, server_len) == -1)
+				return false;
+			setsockopt(s.fd, SOL_SOCKET, SO_RCVBUF, &RESOLVER_RECEIVE_BUFFER, sizeof(RESOLVER_RECEIVE_BUFFER));
+			s.slots.resize(RESOLVER_SLOTS);
+			// lowest slots first, so a lightly loaded socket keeps to a few cache lines
+			for (int slot = RESOLVER_SLOTS - 1; slot >= 0; slot--)
+				s.free_slots.push_back(slot);
+			s.random = seed() | 1;
+		}
+
+		struct itimerspec interval;
+		interval.it_interval.tv_sec = RESOLVER_TICK_MS / 1000;
+		interval.it_interval.tv_nsec = RESOLVER_TICK_MS % 1000 * 1000000;
+		interval.it_value = interval.it_interval;
+		timerfd_settime(timer_fd, 0, &interval, nullptr);
+
+		for (auto &s : sockets)
+			scheduler.spawn(receive(s));
+		scheduler.spawn(retry());
+		return true;
+	}
+
+	// resumes once ip_str holds the first IPv4 address for hostname, or "" if there is none
+	// hostname must stay valid until then
+	awaiter resolve(const char *hostname, char *ip_str, size_t size) { return awaiter{*this, hostname, ip_str, size, nullptr}; }
+
+	// must only be called once no lookup is outstanding; the receive and retry tasks end soon after
+	void close()
+	{
+		finished.store(true);
+		// a socket shut down for reading reads as readable, which wakes its receive task
+		for (auto &s : sockets)
+			shutdown(s.fd, SHUT_RD);
+	}
+
+private:
+	struct query_slot {
+		awaiter *waiter = nullptr;
+		uint16_t id = 0;
+		int attempts = 0;
+		long sent_ms = 0;
+	};
+
+	struct udp_socket {
+		int fd = -1;
+		std::mutex lock;
+		std::vector<query_slot> slots;
+		std::vector<int> free_slots;
+		uint32_t random = 1;
+	};
+
+	static long now_ms()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	}
+
+	// a new ID for every attempt, so a late reply to an earlier one is not taken for this one
+	// must be called with s.lock held
+	static uint16_t next_id(udp_socket &s, int slot)
+	{
+		s.random ^= s.random << 13;
+		s.random ^= s.random >> 17;
+		s.random ^= s.random << 5;
+		return (uint16_t)(s.random << RESOLVER_SLOT_BITS | slot);
+	}
+
+	// must be called with s.lock held
+	void finish(udp_socket &s, int slot)
+	{
+		awaiter *waiter = s.slots[slot].waiter;
+		s.slots[slot].waiter = nullptr;
+		s.free_slots.push_back(slot);
+		scheduler.schedule(waiter->handle);
+	}
+
+	bool submit(awaiter *waiter)
+	{
+		waiter->ip_str[0] = '\0';
+		uint8_t query[DNSWIRE_MAX_QUERY];
+		unsigned int first = next_socket.fetch_add(1);
+		// every socket is only full when more than RESOLVER_MAX_IN_FLIGHT lookups are outstanding
+		for (int i = 0; i < RESOLVER_SOCKETS; i++) {
+			udp_socket &s = sockets[(first + i) % RESOLVER_SOCKETS];
+			std::unique_lock<std::mutex> guard(s.lock);
+			if (s.free_slots.empty())
+				continue;
+			int slot = s.free_slots.back();
+			uint16_t id = next_id(s, slot);
+			int length = dnswire_encode_query(id, waiter->hostname, DNSWIRE_TYPE_A, query, sizeof(query));
+			if (length == DNSWIRE_FAILURE)
+				return false;
+			s.free_slots.pop_back();
+			s.slots[slot].waiter = waiter;
+			s.slots[slot].id = id;
+			s.slots[slot].attempts = 1;
+			s.slots[slot].sent_ms = now_ms();
+			int fd = s.fd;
+			guard.unlock();
+
+			// waiter may already have been resumed, and be gone, by the time send returns
+			// a query that is not sent is sent again once it times out
+			send(fd, query, length, 0);
+			return true;
+		}
+		return false;
+	}
+
+	void handle_reply(udp_socket &s, const uint8_t *message, size_t length)
+	{
+		dnswire_response response;
+		dnswire_record records[RESOLVER_MAX_RECORDS];
+		// without a well-formed message the ID cannot be trusted either; the query is sent again once it times out
+		if (dnswire_parse(message, length, &response, records, RESOLVER_MAX_RECORDS) == DNSWIRE_FAILURE ||
+		    !response.question_offset)
+			return;
+
+		int slot = response.id & (RESOLVER_SLOTS - 1);
+		std::lock_guard<std::mutex> guard(s.lock);
+		query_slot &query = s.slots[slot];
+		// a reply to an earlier attempt, or not to this query at all
+		if (!query.waiter || query.id != response.id || response.question_type != DNSWIRE_TYPE_A ||
+		    !dnswire_name_equal(message, length, response.question_offset, query.waiter->hostname))
+			return;
+		// a truncated reply still carries the first address, if it had room for any
+		dnswire_first_address(message, &response, records, query.waiter->ip_str, query.waiter->size);
+		finish(s, slot);
+	}
+
+	Task receive(udp_socket &s)
+	{
+		uint8_t message[RESOLVER_MAX_MESSAGE];
+		while (!finished.load()) {
+			co_await scheduler.readable(s.fd);
+			while (true) {
+				ssize_t n = recv(s.fd, message, sizeof(message), 0);
+				if (n > 0)
+					handle_reply(s, message, n);
+				// an ICMP error from the resolver is reported once; its queries time out instead
+				else if (n == -1 && (errno == ECONNREFUSED || errno == EINTR))
+					continue;
+				else
+					break;
+			}
+		}
+	}
+
+	// sends again every query unanswered for RESOLVER_TIMEOUT_MS, and gives up on those already tried RESOLVER_MAX_ATTEMPTS times
+	void check_timeouts(udp_socket &s)
+	{
+		uint8_t query[DNSWIRE_MAX_QUERY];
+		long now = now_ms();
+		std::lock_guard<std::mutex> guard(s.lock);
+		for (int slot = 0; slot < RESOLVER_SLOTS; slot++) {
+			query_slot &q = s.slots[slot];
+			if (!q.waiter || now - q.sent_ms < RESOLVER_TIMEOUT_MS)
+				continue;
+			if (q.attempts == RESOLVER_MAX_ATTEMPTS) {
+				finish(s, slot);
+				continue;
+			}
+			q.id = next_id(s, slot);
+			q.attempts++;
+			q.sent_ms = now;
+			int length = dnswire_encode_query(q.id, q.waiter->hostname, DNSWIRE_TYPE_A, query, sizeof(query));
+			send(s.fd, query, length, 0);
+		}
+	}
+
+	Task retry()
+	{
+		while (!finished.load()) {
+			co_await scheduler.readable(timer_fd);
+			uint64_t ticks;
+			if (read(timer_fd, &ticks, sizeof(ticks)) == -1 && errno != EAGAIN)
+				perror("Failed to read resolver timer");
+			for (auto &s : sockets)
+				check_timeouts(s);
+		}
+	}
+
+	Scheduler &scheduler;
+	int timer_fd = -1;
+	udp_socket sockets[RESOLVER_SOCKETS];
+	std::atomic<unsigned int> next_socket{0};
+	std::atomic<bool> finished{false};
+};
+
+}
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * File: daemon.c
+ * Description:
+ * 	Unix domain socket front end for the resolver pool. Each connection
+ *	gets a reader thread, which splits request frames into jobs, and a
+ *	writer thread, which sends back each batch once all of its jobs have
+ *	been resolved.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "multi-lookup.h"
+
+static const int LISTEN_BACKLOG = 64;
+
+typedef struct batch_s batch;
+typedef struct connection_s connection;
+
+typedef struct batch_slot_s {
+	batch *owner;
+	char *hostname;
+	char ip_str[INET6_ADDRSTRLEN];
+} batch_slot;
+
+struct batch_s {
+	connection *conn;
+	// request frame body; hostnames are terminated in place
+	char *payload;
+	batch_slot *slots;
+	int count;
+	// number of slots still waiting on a resolver, protected by conn->lock
+	int remaining;
+	batch *next;
+};
+
+struct connection_s {
+	int fd;
+	pthread_mutex_t lock;
+	// signaled when a batch completes or the reader stops accepting frames
+	pthread_cond_t batch_done;
+	batch *head;
+	batch *tail;
+	int reader_done;
+};
+
+
+// returns 1 on success, 0 on a clean end of stream before any bytes, -1 on error
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = read(fd, (char *)buf + done, len - done);
+		if (n == 0)
+			return done == 0 ? 0 : -1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static void free_batch(batch *b)
+{
+	free(b->payload);
+	free(b->slots);
+	free(b);
+}
+
+static void complete_slot(batch_slot *slot, const char *ip_str)
+{
+	batch *b = slot->owner;
+
+	strncpy(slot->ip_str, ip_str, sizeof(slot->ip_str));
+	slot->ip_str[sizeof(slot->ip_str)-1] = '\0';
+
+	pthread_mutex_lock(&b->conn->lock);
+	if (--b->remaining == 0)
+		pthread_cond_signal(&b->conn->batch_done);
+	pthread_mutex_unlock(&b->conn->lock);
+}
+
+static void batch_slot_resolved(lookup_job *job, const char *ip_str)
+{
+	complete_slot((batch_slot *)job->context, ip_str);
+}
+
+// splits payload in place into whitespace separated hostnames
+static batch *create_batch(connection *conn, char *payload, uint32_t length)
+{
+	batch *b = calloc(1, sizeof(batch));
+	if (!b)
+		return NULL;
+	b->conn = conn;
+	b->payload = payload;
+
+	int capacity = 0;
+	for (uint32_t i = 0; i < length; i++) {
+		if (!isspace((unsigned char)payload[i]) && (i == 0 || isspace((unsigned char)payload[i-1])))
+			capacity++;
+	}
+
+	b->slots = calloc(capacity > 0 ? capacity : 1, sizeof(batch_slot));
+	if (!b->slots) {
+		free(b);
+		return NULL;
+	}
+
+	uint32_t i = 0;
+	while (i < length) {
+		while (i < length && isspace((unsigned char)payload[i]))
+			i++;
+		if (i == length)
+			break;
+
+		uint32_t start = i;
+		while (i < length && !isspace((unsigned char)payload[i]))
+			i++;
+		payload[i] = '\0';
+		// same limit as names read from input files
+		if (i - start > MAX_NAME_LENGTH - 1)
+			payload[start + MAX_NAME_LENGTH - 1] = '\0';
+
+		batch_slot *slot = &b->slots[b->count++];
+		slot->owner = b;
+		slot->hostname = &payload[start];
+		i++;
+	}
+
+	b->remaining = b->count;
+	return b;
+}
+
+static int send_batch(int fd, batch *b)
+{
+	size_t length = 0;
+	for (int i = 0; i < b->count; i++)
+		length += strlen(b->slots[i].hostname) + strlen(b->slots[i].ip_str) + 2;
+
+	// sprintf terminates each line, so leave room for one trailing NUL
+	char *response = malloc(sizeof(uint32_t) + length + 1);
+	if (!response)
+		return -1;
+
+	uint32_t header = htonl((uint32_t)length);
+	memcpy(response, &header, sizeof(header));
+	char *p = response + sizeof(header);
+	for (int i = 0; i < b->count; i++)
+		p += sprintf(p, "%s,%s\n", b->slots[i].hostname, b->slots[i].ip_str);
+
+	int ret = write_full(fd, response, sizeof(uint32_t) + length);
+	free(response);
+	return ret;
+}
+
+static void *writer_entry_point(void *void_ptr)
+{
+	connection *conn = (connection *)void_ptr;
+	int broken = 0;
+
+	while (1) {
+		pthread_mutex_lock(&conn->lock);
+		while ((conn->head == NULL && !conn->reader_done) ||
+		       (conn->head != NULL && conn->head->remaining > 0)) {
+			pthread_cond_wait(&conn->batch_done, &conn->lock);
+		}
+		batch *b = conn->head;
+		if (b == NULL) {
+			// reader has finished and every batch has been answered
+			pthread_mutex_unlock(&conn->lock);
+			return NULL;
+		}
+		conn->head = b->next;
+		if (conn->head == NULL)
+			conn->tail = NULL;
+		pthread_mutex_unlock(&conn->lock);
+
+		// once the client has gone away, keep draining so outstanding jobs still have a batch to report to
+		if (!broken && send_batch(conn->fd, b) == -1)
+			broken = 1;
+		free_batch(b);
+	}
+}
+
+static void *connection_entry_point(void *void_ptr)
+{
+	connection *conn = (connection *)void_ptr;
+
+	pthread_t writer_thread;
+	if (pthread_create(&writer_thread, NULL, writer_entry_point, conn) != 0) {
+		fprintf(stderr, "Failed to start writer thread for connection.\n");
+		close(conn->fd);
+		free(conn);
+		return NULL;
+	}
+
+	while (1) {
+		uint32_t header;
+		if (read_full(conn->fd, &header, sizeof(header)) != 1)
+			break;
+
+		uint32_t length = ntohl(header);
+		if (length > MAX_FRAME_LENGTH) {
+			fprintf(stderr, "Request frame of %u bytes exceeds limit, closing connection.\n", length);
+			break;
+		}
+
+		// one extra byte so the final hostname can always be terminated in place
+		char *payload = malloc(length + 1);
+		if (!payload)
+			break;
+		if (length > 0 && read_full(conn->fd, payload, length) != 1) {
+			free(payload);
+			break;
+		}
+
+		batch *b = create_batch(conn, payload, length);
+		if (!b) {
+			free(payload);
+			break;
+		}
+
+		// queue the batch before its jobs so responses go out in request order
+		pthread_mutex_lock(&conn->lock);
+		if (conn->tail)
+			conn->tail->next = b;
+		else
+			conn->head = b;
+		conn->tail = b;
+		if (b->count == 0)
+			pthread_cond_signal(&conn->batch_done);
+		pthread_mutex_unlock(&conn->lock);
+
+		for (int i = 0; i < b->count; i++) {
+			lookup_job *job = create_job(b->slots[i].hostname, batch_slot_resolved, &b->slots[i]);
+			if (!job) {
+				complete_slot(&b->slots[i], "");
+				continue;
+			}
+			submit_job(job);
+		}
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	conn->reader_done = 1;
+	pthread_cond_signal(&conn->batch_done);
+	pthread_mutex_unlock(&conn->lock);
+
+	pthread_join(writer_thread, NULL);
+
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->lock);
+	pthread_cond_destroy(&conn->batch_done);
+	free(conn);
+	return NULL;
+}
+
+int run_daemon(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		perror("Error creating socket");
+		return EXIT_FAILURE;
+	}
+
+	// a socket left behind by a previous daemon would make bind fail
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(listen_fd, LISTEN_BACKLOG) == -1) {
+		perror("Error listening on socket");
+		close(listen_fd);
+		return EXIT_FAILURE;
+	}
+
+	// connection threads clean up after themselves, so they never need to be joined
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (1) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Error accepting connection");
+			break;
+		}
+
+		connection *conn = calloc(1, sizeof(connection));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		pthread_mutex_init(&conn->lock, NULL);
+		pthread_cond_init(&conn->batch_done, NULL);
+
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, connection_entry_point, conn) != 0) {
+			fprintf(stderr, "Failed to start thread for connection.\n");
+			close(fd);
+			free(conn);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(listen_fd);
+	return EXIT_FAILURE;
+}
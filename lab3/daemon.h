@@ -0,0 +1,29 @@
+/*
+ * File: daemon.h
+ * Description:
+ * 	Long-running resolver mode. multi-lookup --daemon <socket-path> listens
+ *	on a Unix domain stream socket and resolves batches of hostnames using
+ *	the same queue, resolver threads and cache as a normal run, all of which
+ *	stay alive between batches.
+ *
+ *	Protocol: every message in either direction is a frame consisting of a
+ *	4-byte big-endian length followed by that many bytes.
+ *	  request  frame: hostnames separated by whitespace (usually newlines)
+ *	  response frame: one "hostname,ip\n" line per hostname, in request order
+ *	A client may send any number of request frames without waiting; exactly
+ *	one response frame is sent per request frame, in the order received.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#define MAX_FRAME_LENGTH (16 * 1024 * 1024)
+
+/* Function to accept and serve connections on socket_path forever
+ * Resolver threads must already be running
+ * Only returns (with EXIT_FAILURE) if the socket cannot be set up
+ * or accepting connections fails
+ */
+int run_daemon(const char *socket_path);
+
+#endif
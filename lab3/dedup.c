@@ -0,0 +1,213 @@
+/*
+ * File: dedup.c
+ * Description:
+ * 	Sharded hash set of normalized names for --dedup. Keys are interned,
+ *	so entries are found by comparing pointers, and each shard has its
+ *	own lock so requesters reading different names rarely contend.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "intern.h"
+#include "dedup.h"
+
+#define DEDUP_INITIAL_CAPACITY 1024
+#define MAX_DEDUP_NAME_LENGTH 1025
+
+typedef struct dedup_ref_s dedup_ref;
+
+// one occurrence waiting for the result
+struct dedup_ref_s {
+	const char *hostname;
+	dedup_ref *next;
+};
+
+struct dedup_entry_s {
+	const char *key;
+	dedup_entry *next_in_bucket;
+	int resolved;
+	char ip_str[INET6_ADDRSTRLEN];
+	dedup_ref *refs_head;
+	dedup_ref *refs_tail;
+};
+
+typedef struct dedup_shard_s {
+	pthread_mutex_t lock;
+	dedup_entry **buckets;
+	// always a power of two; the table doubles when it holds more entries than buckets
+	size_t capacity;
+	size_t count;
+} __attribute__((aligned(64))) dedup_shard;
+
+static dedup_shard shards[DEDUP_SHARDS] = {
+	[0 ... DEDUP_SHARDS-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+
+static size_t hash_key(const char *key)
+{
+	// interned keys are unique, so their addresses are hashed rather than their characters
+	uint64_t x = (uintptr_t)key;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	return x;
+}
+
+static dedup_shard *shard_of(size_t hash)
+{
+	return &shards[(hash >> 32) % DEDUP_SHARDS];
+}
+
+// returns hostname itself when it is already in normal form, which is the usual case
+static const char *normalize(const char *hostname)
+{
+	size_t length = strlen(hostname);
+	int changed = length > 1 && hostname[length - 1] == '.';
+	if (changed)
+		length--;
+	for (size_t i = 0; i < length && !changed; i++)
+		changed = isupper((unsigned char)hostname[i]);
+	if (!changed)
+		return hostname;
+
+	char normalized[MAX_DEDUP_NAME_LENGTH];
+	if (length >= sizeof(normalized))
+		length = sizeof(normalized) - 1;
+	for (size_t i = 0; i < length; i++)
+		normalized[i] = tolower((unsigned char)hostname[i]);
+	normalized[length] = '\0';
+	return intern(normalized);
+}
+
+// must be called with the shard locked
+static int grow(dedup_shard *shard)
+{
+	size_t capacity = shard->capacity ? shard->capacity * 2 : DEDUP_INITIAL_CAPACITY;
+	dedup_entry **buckets = calloc(capacity, sizeof(dedup_entry *));
+	if (!buckets)
+		return -1;
+	for (size_t i = 0; i < shard->capacity; i++) {
+		dedup_entry *e = shard->buckets[i];
+		while (e) {
+			dedup_entry *next = e->next_in_bucket;
+			size_t b = hash_key(e->key) & (capacity - 1);
+			e->next_in_bucket = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->capacity = capacity;
+	return 0;
+}
+
+int dedup_add(const char *hostname, dedup_entry **entry, char *ip_str, size_t size)
+{
+	const char *key = normalize(hostname);
+	if (!key)
+		return DEDUP_FAILURE;
+	size_t hash = hash_key(key);
+	dedup_shard *shard = shard_of(hash);
+
+	// allocated before locking; most occurrences of a duplicated name do not need it
+	dedup_ref *ref = malloc(sizeof(dedup_ref));
+	if (!ref)
+		return DEDUP_FAILURE;
+	ref->hostname = hostname;
+	ref->next = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	dedup_entry *e = NULL;
+	if (shard->capacity) {
+		for (e = shard->buckets[hash & (shard->capacity - 1)]; e; e = e->next_in_bucket) {
+			if (e->key == key)
+				break;
+		}
+	}
+
+	int ret;
+	if (e && e->resolved) {
+		snprintf(ip_str, size, "%s", e->ip_str);
+		ret = DEDUP_RESOLVED;
+	}
+	else if (e) {
+		e->refs_tail->next = ref;
+		e->refs_tail = ref;
+		ref = NULL;
+		ret = DEDUP_PENDING;
+	}
+	else if ((shard->count >= shard->capacity && grow(shard) == -1) || !(e = calloc(1, sizeof(dedup_entry))))
+		ret = DEDUP_FAILURE;
+	else {
+		e->key = key;
+		e->refs_head = e->refs_tail = ref;
+		ref = NULL;
+		size_t b = hash & (shard->capacity - 1);
+		e->next_in_bucket = shard->buckets[b];
+		shard->buckets[b] = e;
+		shard->count++;
+		ret = DEDUP_NEW;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	free(ref);
+	*entry = e;
+	return ret;
+}
+
+const char *dedup_key(const dedup_entry *entry)
+{
+	return entry->key;
+}
+
+void dedup_resolve(dedup_entry *entry, const char *ip_str, void (*write_result)(const char *hostname, const char *ip_str))
+{
+	dedup_shard *shard = shard_of(hash_key(entry->key));
+
+	// once resolved is set no more references are added, so the list can be walked unlocked
+	pthread_mutex_lock(&shard->lock);
+	snprintf(entry->ip_str, sizeof(entry->ip_str), "%s", ip_str);
+	entry->resolved = 1;
+	dedup_ref *ref = entry->refs_head;
+	entry->refs_head = entry->refs_tail = NULL;
+	pthread_mutex_unlock(&shard->lock);
+
+	while (ref) {
+		dedup_ref *next = ref->next;
+		write_result(ref->hostname, entry->ip_str);
+		free(ref);
+		ref = next;
+	}
+}
+
+void dedup_cleanup()
+{
+	for (int s = 0; s < DEDUP_SHARDS; s++) {
+		dedup_shard *shard = &shards[s];
+		for (size_t i = 0; i < shard->capacity; i++) {
+			dedup_entry *e = shard->buckets[i];
+			while (e) {
+				dedup_entry *next = e->next_in_bucket;
+				while (e->refs_head) {
+					dedup_ref *ref = e->refs_head;
+					e->refs_head = ref->next;
+					free(ref);
+				}
+				free(e);
+				e = next;
+			}
+		}
+		free(shard->buckets);
+		shard->buckets = NULL;
+		shard->capacity = 0;
+		shard->count = 0;
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * File: dedup.h
+ * Description:
+ * 	Ingest-time duplicate elimination for multi-lookup --dedup.
+ *
+ *	Requesters register every name they read. Names are normalized
+ *	(lowercased, trailing '.' dropped) and only the first occurrence of a
+ *	normalized name is queued for resolution. Occurrences that arrive
+ *	while that lookup is outstanding are kept as back-references to the
+ *	name as written, and the result is fanned out to all of them once it
+ *	is known. Occurrences that arrive afterwards are answered at once
+ *	from the stored result.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+
+#define DEDUP_SHARDS 16
+
+#define DEDUP_FAILURE -1
+// the first occurrence: the caller must queue a lookup for dedup_key(entry)
+#define DEDUP_NEW 0
+// a lookup is already outstanding; the result will be fanned out to this occurrence
+#define DEDUP_PENDING 1
+// already resolved; the result has been copied for the caller to write
+#define DEDUP_RESOLVED 2
+
+typedef struct dedup_entry_s dedup_entry;
+
+/* Function to register one occurrence of hostname, which must be interned
+ * Sets entry to the name's entry, and for DEDUP_RESOLVED copies the result to ip_str
+ * Returns DEDUP_NEW, DEDUP_PENDING, DEDUP_RESOLVED or DEDUP_FAILURE
+ * Thread-safe
+ */
+int dedup_add(const char *hostname, dedup_entry **entry, char *ip_str, size_t size);
+
+/* Function to return the interned, normalized name of an entry */
+const char *dedup_key(const dedup_entry *entry);
+
+/* Function to record the result for entry and pass it to write_result for
+ * every occurrence registered so far, with the name as it was written
+ * Thread-safe
+ */
+void dedup_resolve(dedup_entry *entry, const char *ip_str, void (*write_result)(const char *hostname, const char *ip_str));
+
+/* Function to free every entry */
+void dedup_cleanup();
+
+#endif
@@ -0,0 +1,489 @@
+/*
+ * File: dnstcp.c
+ * Description:
+ * 	Pipelined DNS over TCP (RFC 7766) to a single resolver. Each
+ *	connection has a table of DNSTCP_MAX_IN_FLIGHT query slots; a query's
+ *	transaction ID is its slot number plus a per-slot sequence number, so
+ *	a response finds its query directly and a late response to an earlier
+ *	use of the slot is recognized and dropped.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "dnswire.h"
+#include "dnstcp.h"
+
+// large enough for the longest possible message and its length prefix
+#define READ_BUFFER_SIZE (2 + 65535)
+#define SLOT_MASK (DNSTCP_MAX_IN_FLIGHT - 1)
+#define POLL_INTERVAL_MS 1000
+#define MIN_BACKOFF_MS 100
+#define MAX_BACKOFF_MS 1000
+// records kept from one response; only the first address in the answer section is used
+#define MAX_RECORDS 32
+
+typedef struct query_s {
+	// NULL while the slot is free
+	const char *hostname;
+	dnstcp_callback callback;
+	void *context;
+	uint16_t id;
+	uint16_t sequence;
+	int attempts;
+	long sent_ms;
+} query;
+
+typedef struct connection_s {
+	// lock guards the slots, lock_write serializes writes to fd
+	// lock_write is taken first when both are needed, and lock is never held while writing,
+	// so a writer blocked on a full socket cannot keep the reader from draining responses
+	pthread_mutex_t lock;
+	pthread_mutex_t lock_write;
+	pthread_cond_t slot_free;
+	// -1 while reconnecting; only the reader changes it
+	int fd;
+	query slots[DNSTCP_MAX_IN_FLIGHT];
+	int free_slots[DNSTCP_MAX_IN_FLIGHT];
+	int num_free;
+	pthread_t reader;
+	// set once the current connection has answered something, so losing it is not held against the queries
+	int answered;
+	long last_timeout_check_ms;
+	size_t filled;
+	uint8_t buffer[READ_BUFFER_SIZE];
+} connection;
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static connection *connections = NULL;
+static unsigned int next_connection = 0;
+static int stopping = 0;
+
+static pthread_mutex_t lock_drain = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static long in_flight = 0;
+
+
+static long now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void query_started()
+{
+	pthread_mutex_lock(&lock_drain);
+	in_flight++;
+	pthread_mutex_unlock(&lock_drain);
+}
+
+static void query_finished()
+{
+	pthread_mutex_lock(&lock_drain);
+	if (--in_flight == 0)
+		pthread_cond_broadcast(&drained);
+	pthread_mutex_unlock(&lock_drain);
+}
+
+static int send_all(int fd, const uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if (sent == -1 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return -1;
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+// encodes hostname with the given ID, length prefix included
+static int encode_frame(const char *hostname, uint16_t id, uint8_t *frame, size_t size)
+{
+	int length = dnswire_encode_query(id, hostname, DNSWIRE_TYPE_A, frame + 2, size - 2);
+	if (length == DNSWIRE_FAILURE)
+		return -1;
+	frame[0] = length >> 8;
+	frame[1] = length & 0xff;
+	return length + 2;
+}
+
+// must be called with c->lock held
+static void release_slot(connection *c, int slot)
+{
+	c->slots[slot].hostname = NULL;
+	c->free_slots[c->num_free++] = slot;
+	pthread_cond_signal(&c->slot_free);
+}
+
+static int open_socket()
+{
+	int fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	// queries are written whole, so there is nothing to gain from waiting to coalesce them
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&server_addr, server_addr_len) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// opens a new connection and sends every query still waiting for an answer on it
+static int reconnect(connection *c)
+{
+	int fd = open_socket();
+	if (fd == -1)
+		return DNSTCP_FAILURE;
+
+	struct {
+		const char *hostname;
+		uint16_t id;
+	} waiting[DNSTCP_MAX_IN_FLIGHT];
+	int num_waiting = 0;
+
+	pthread_mutex_lock(&c->lock_write);
+	c->fd = fd;
+	c->filled = 0;
+	c->answered = 0;
+	pthread_mutex_lock(&c->lock);
+	long now = now_ms();
+	for (int slot = 0; slot < DNSTCP_MAX_IN_FLIGHT; slot++) {
+		query *qu = &c->slots[slot];
+		if (qu->hostname) {
+			waiting[num_waiting].hostname = qu->hostname;
+			waiting[num_waiting].id = qu->id;
+			num_waiting++;
+			qu->sent_ms = now;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	// only the reader completes queries, so the hostnames stay valid while they are sent
+	int ret = DNSTCP_SUCCESS;
+	for (int i = 0; i < num_waiting && ret == DNSTCP_SUCCESS; i++) {
+		uint8_t frame[2 + DNSWIRE_MAX_QUERY];
+		int length = encode_frame(waiting[i].hostname, waiting[i].id, frame, sizeof(frame));
+		if (send_all(fd, frame, length) == -1)
+			ret = DNSTCP_FAILURE;
+	}
+	if (ret == DNSTCP_FAILURE) {
+		close(fd);
+		c->fd = -1;
+	}
+	pthread_mutex_unlock(&c->lock_write);
+	return ret;
+}
+
+// counts a failed attempt against every outstanding query sent at or before sent_by_ms,
+// and gives up on those out of attempts; returns the number of queries counted against
+static int charge_attempts(connection *c, long sent_by_ms)
+{
+	query failed[DNSTCP_MAX_IN_FLIGHT];
+	int num_failed = 0;
+	int charged = 0;
+
+	pthread_mutex_lock(&c->lock);
+	for (int slot = 0; slot < DNSTCP_MAX_IN_FLIGHT; slot++) {
+		query *qu = &c->slots[slot];
+		if (!qu->hostname || qu->sent_ms > sent_by_ms)
+			continue;
+		charged++;
+		if (++qu->attempts >= DNSTCP_MAX_ATTEMPTS) {
+			failed[num_failed++] = *qu;
+			release_slot(c, slot);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	for (int i = 0; i < num_failed; i++) {
+		failed[i].callback(failed[i].context, "");
+		query_finished();
+	}
+	return charged;
+}
+
+static void connection_lost(connection *c)
+{
+	charge_attempts(c, LONG_MAX);
+}
+
+// closes the connection, and counts a failed attempt against its outstanding queries if penalize is set
+static void drop_connection(connection *c, int penalize)
+{
+	// a writer may be blocked sending on this connection with lock_write held; this wakes it
+	shutdown(c->fd, SHUT_RDWR);
+	pthread_mutex_lock(&c->lock_write);
+	close(c->fd);
+	c->fd = -1;
+	pthread_mutex_unlock(&c->lock_write);
+	if (penalize)
+		connection_lost(c);
+}
+
+// counts an attempt against only the queries that have waited DNSTCP_TIMEOUT_MS,
+// and returns whether there were any
+static int has_timed_out(connection *c)
+{
+	long now = now_ms();
+	if (now - c->last_timeout_check_ms < POLL_INTERVAL_MS)
+		return 0;
+	c->last_timeout_check_ms = now;
+	return charge_attempts(c, now - DNSTCP_TIMEOUT_MS) > 0;
+}
+
+static void handle_response(connection *c, const uint8_t *message, size_t length)
+{
+	dnswire_response response;
+	dnswire_record records[MAX_RECORDS];
+	// without a well-formed message the ID cannot be trusted either; the query is sent again once it times out
+	if (dnswire_parse(message, length, &response, records, MAX_RECORDS) == DNSWIRE_FAILURE || !response.question_offset)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	query *qu = &c->slots[response.id & SLOT_MASK];
+	// an answer to a query that was already answered on an earlier connection, or not to this query at all
+	if (!qu->hostname || qu->id != response.id || response.question_type != DNSWIRE_TYPE_A ||
+	    !dnswire_name_equal(message, length, response.question_offset, qu->hostname)) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	dnstcp_callback callback = qu->callback;
+	void *context = qu->context;
+	c->answered = 1;
+	release_slot(c, response.id & SLOT_MASK);
+	pthread_mutex_unlock(&c->lock);
+
+	char ip_str[INET6_ADDRSTRLEN];
+	dnswire_first_address(message, &response, records, ip_str, sizeof(ip_str));
+	callback(context, ip_str);
+	query_finished();
+}
+
+// handles every complete message in the read buffer, and keeps the partial one at the end
+static void handle_responses(connection *c)
+{
+	size_t start = 0;
+	while (c->filled - start >= 2) {
+		size_t length = c->buffer[start] << 8 | c->buffer[start + 1];
+		if (c->filled - start < 2 + length)
+			break;
+		handle_response(c, c->buffer + start + 2, length);
+		start += 2 + length;
+	}
+	memmove(c->buffer, c->buffer + start, c->filled - start);
+	c->filled -= start;
+}
+
+static void *reader_entry_point(void *void_ptr)
+{
+	connection *c = (connection *)void_ptr;
+	int backoff_ms = 0;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (c->fd == -1) {
+			if (reconnect(c) == DNSTCP_FAILURE) {
+				connection_lost(c);
+				backoff_ms = backoff_ms ? backoff_ms * 2 : MIN_BACKOFF_MS;
+				if (backoff_ms > MAX_BACKOFF_MS)
+					backoff_ms = MAX_BACKOFF_MS;
+				struct timespec pause = { backoff_ms / 1000, (backoff_ms % 1000) * 1000000L };
+				nanosleep(&pause, NULL);
+				continue;
+			}
+			backoff_ms = 0;
+		}
+
+		struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+		int ready = poll(&pfd, 1, POLL_INTERVAL_MS);
+		// a resolver may close a connection after some number of queries, so losing one that
+		// has been answering is not held against the queries left on it; they are just sent again
+		if (ready == -1 && errno != EINTR) {
+			drop_connection(c, !c->answered);
+			continue;
+		}
+		if (ready > 0) {
+			ssize_t n = read(c->fd, c->buffer + c->filled, sizeof(c->buffer) - c->filled);
+			if (n == -1 && errno == EINTR)
+				continue;
+			// closed by the resolver, or shut down by a writer that could not send
+			if (n <= 0) {
+				drop_connection(c, !c->answered);
+				continue;
+			}
+			c->filled += n;
+			handle_responses(c);
+		}
+		// the queries sent more recently are sent again on the new connection without losing an attempt
+		if (has_timed_out(c))
+			drop_connection(c, 0);
+	}
+	return NULL;
+}
+
+int dnstcp_parse_server(const char *server, struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+	char address[INET6_ADDRSTRLEN + 2];
+	const char *port_str = NULL;
+	if (server[0] == '[') {
+		const char *end = strchr(server, ']');
+		if (!end || (size_t)(end - server - 1) >= sizeof(address))
+			return DNSTCP_FAILURE;
+		memcpy(address, server + 1, end - server - 1);
+		address[end - server - 1] = '\0';
+		if (end[1] == ':')
+			port_str = end + 2;
+		else if (end[1] != '\0')
+			return DNSTCP_FAILURE;
+	}
+	else {
+		// a single colon separates a port; more than one means an IPv6 address without one
+		const char *colon = strchr(server, ':');
+		size_t length = colon && !strchr(colon + 1, ':') ? (size_t)(colon - server) : strlen(server);
+		if (length >= sizeof(address))
+			return DNSTCP_FAILURE;
+		memcpy(address, server, length);
+		address[length] = '\0';
+		if (length < strlen(server))
+			port_str = server + length + 1;
+	}
+
+	long port = DNSTCP_DEFAULT_PORT;
+	if (port_str) {
+		char *end;
+		port = strtol(port_str, &end, 10);
+		if (*port_str == '\0' || *end != '\0' || port < 1 || port > 65535)
+			return DNSTCP_FAILURE;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	struct sockaddr_in *v4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)addr;
+	if (inet_pton(AF_INET, address, &v4->sin_addr) == 1) {
+		v4->sin_family = AF_INET;
+		v4->sin_port = htons(port);
+		*addr_len = sizeof(*v4);
+	}
+	else if (inet_pton(AF_INET6, address, &v6->sin6_addr) == 1) {
+		v6->sin6_family = AF_INET6;
+		v6->sin6_port = htons(port);
+		*addr_len = sizeof(*v6);
+	}
+	else
+		return DNSTCP_FAILURE;
+	return DNSTCP_SUCCESS;
+}
+
+int dnstcp_init(const char *server)
+{
+	if (dnstcp_parse_server(server, &server_addr, &server_addr_len) == DNSTCP_FAILURE)
+		return DNSTCP_FAILURE;
+
+	connections = calloc(DNSTCP_CONNECTIONS, sizeof(connection));
+	if (!connections)
+		return DNSTCP_FAILURE;
+	for (int i = 0; i < DNSTCP_CONNECTIONS; i++) {
+		connection *c = &connections[i];
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_mutex_init(&c->lock_write, NULL);
+		pthread_cond_init(&c->slot_free, NULL);
+		// lowest slots first, so a lightly loaded connection keeps to a few cache lines
+		for (int slot = DNSTCP_MAX_IN_FLIGHT - 1; slot >= 0; slot--)
+			c->free_slots[c->num_free++] = slot;
+		// the first connection is made here, so a wrong address is reported before any lookups
+		c->fd = open_socket();
+		if (c->fd == -1) {
+			for (int j = 0; j < i; j++)
+				close(connections[j].fd);
+			free(connections);
+			connections = NULL;
+			return DNSTCP_FAILURE;
+		}
+	}
+	for (int i = 0; i < DNSTCP_CONNECTIONS; i++)
+		pthread_create(&connections[i].reader, NULL, reader_entry_point, &connections[i]);
+	return DNSTCP_SUCCESS;
+}
+
+void dnstcp_submit(const char *hostname, dnstcp_callback callback, void *context)
+{
+	// encoded before a slot is taken, and given its ID once it has one
+	uint8_t frame[2 + DNSWIRE_MAX_QUERY];
+	int length = encode_frame(hostname, 0, frame, sizeof(frame));
+	if (length == -1) {
+		callback(context, "");
+		return;
+	}
+
+	connection *c = &connections[__atomic_fetch_add(&next_connection, 1, __ATOMIC_RELAXED) % DNSTCP_CONNECTIONS];
+	query_started();
+
+	pthread_mutex_lock(&c->lock);
+	while (c->num_free == 0)
+		pthread_cond_wait(&c->slot_free, &c->lock);
+	int slot = c->free_slots[--c->num_free];
+	query *qu = &c->slots[slot];
+	qu->hostname = hostname;
+	qu->callback = callback;
+	qu->context = context;
+	qu->attempts = 0;
+	qu->sent_ms = now_ms();
+	qu->sequence++;
+	uint16_t id = qu->sequence << DNSTCP_SLOT_BITS | slot;
+	qu->id = id;
+	pthread_mutex_unlock(&c->lock);
+
+	frame[2] = id >> 8;
+	frame[3] = id & 0xff;
+	pthread_mutex_lock(&c->lock_write);
+	// while the connection is down, the reader sends this along with the rest once it is back
+	if (c->fd != -1 && send_all(c->fd, frame, length) == -1)
+		shutdown(c->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&c->lock_write);
+}
+
+void dnstcp_drain()
+{
+	pthread_mutex_lock(&lock_drain);
+	while (in_flight > 0)
+		pthread_cond_wait(&drained, &lock_drain);
+	pthread_mutex_unlock(&lock_drain);
+}
+
+void dnstcp_cleanup()
+{
+	if (!connections)
+		return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	// wakes each reader from poll, rather than leaving it to notice at the next interval
+	for (int i = 0; i < DNSTCP_CONNECTIONS; i++) {
+		pthread_mutex_lock(&connections[i].lock_write);
+		if (connections[i].fd != -1)
+			shutdown(connections[i].fd, SHUT_RDWR);
+		pthread_mutex_unlock(&connections[i].lock_write);
+	}
+	for (int i = 0; i < DNSTCP_CONNECTIONS; i++) {
+		pthread_join(connections[i].reader, NULL);
+		if (connections[i].fd != -1)
+			close(connections[i].fd);
+	}
+	free(connections);
+	connections = NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ * File: dnstcp.h
+ * Description:
+ * 	DNS-over-TCP backend for multi-lookup --dns-tcp. Instead of one
+ *	getaddrinfo call (and, behind it, UDP with retries) per name, a few
+ *	persistent TCP connections are kept open to one recursive resolver.
+ *	Many length-prefixed queries are written back to back on each
+ *	connection, and a reader thread per connection matches the responses,
+ *	in whatever order they come, to their queries by transaction ID.
+ *
+ *	A connection that is closed, fails or stops answering for
+ *	DNSTCP_TIMEOUT_MS is reopened and its outstanding queries are sent
+ *	again. A query loses an attempt when it goes unanswered for
+ *	DNSTCP_TIMEOUT_MS, or when its connection fails before answering
+ *	anything, and is given up on, with an empty result, after
+ *	DNSTCP_MAX_ATTEMPTS.
+ */
+
+#ifndef DNSTCP_H
+#define DNSTCP_H
+
+#include <sys/socket.h>
+
+#define DNSTCP_FAILURE -1
+#define DNSTCP_SUCCESS 0
+
+#define DNSTCP_DEFAULT_PORT 53
+#define DNSTCP_CONNECTIONS 4
+// queries outstanding on one connection; the low bits of each transaction ID pick its slot
+#define DNSTCP_SLOT_BITS 10
+#define DNSTCP_MAX_IN_FLIGHT (1 << DNSTCP_SLOT_BITS)
+#define DNSTCP_TIMEOUT_MS 5000
+#define DNSTCP_MAX_ATTEMPTS 3
+
+// called with the first IPv4 address for the name, or "" if there is none
+// called from a connection's reader thread, or from dnstcp_submit if the name cannot be queried
+typedef void (*dnstcp_callback)(void *context, const char *ip_str);
+
+/* Function to parse server, given as address, address:port or [address]:port, into addr
+ * The port defaults to DNSTCP_DEFAULT_PORT
+ * Returns DNSTCP_SUCCESS, or DNSTCP_FAILURE if the address is invalid
+ */
+int dnstcp_parse_server(const char *server, struct sockaddr_storage *addr, socklen_t *addr_len);
+
+/* Function to connect to the resolver at server, given as address, address:port or [address]:port
+ * Returns DNSTCP_SUCCESS, or DNSTCP_FAILURE if the address is invalid or cannot be reached
+ */
+int dnstcp_init(const char *server);
+
+/* Function to query for hostname, which must stay valid until callback has been called
+ * Blocks only while every slot of the chosen connection is in use
+ * Thread-safe
+ */
+void dnstcp_submit(const char *hostname, dnstcp_callback callback, void *context);
+
+/* Function to wait until every submitted query has been answered or given up on */
+void dnstcp_drain();
+
+/* Function to close the connections and stop their reader threads */
+void dnstcp_cleanup();
+
+#endif
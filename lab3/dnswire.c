@@ -0,0 +1,283 @@
+/*
+ * File: dnswire.c
+ * Description:
+ * 	DNS message encoding and parsing without allocation. Parsing only
+ *	steps over names; reading one goes through next_label, which is where
+ *	compression pointers are followed and every bound is checked.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "dnswire.h"
+
+#define FLAG_QR 0x8000
+#define FLAG_TC 0x0200
+#define FLAG_RD 0x0100
+#define POINTER 0xc0
+#define MAX_LABEL 63
+#define RECORD_FIXED_SIZE 10
+
+// reads the labels of one name in order, following compression pointers
+typedef struct name_reader_s {
+	const uint8_t *message;
+	size_t length;
+	// the next label to read
+	size_t offset;
+	// where the part of the name being read starts; a pointer must point before it
+	size_t segment_start;
+	size_t wire_length;
+} name_reader;
+
+
+static uint16_t read16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void start_name(name_reader *r, const uint8_t *message, size_t length, size_t offset)
+{
+	r->message = message;
+	r->length = length;
+	r->offset = offset;
+	r->segment_start = offset;
+	r->wire_length = 0;
+}
+
+// returns the length of the next label and points label at it, 0 for the root label
+// that ends the name, or DNSWIRE_FAILURE if the name is malformed
+static int next_label(name_reader *r, const uint8_t **label)
+{
+	while (r->offset < r->length) {
+		uint8_t byte = r->message[r->offset];
+		if ((byte & POINTER) == POINTER) {
+			if (r->offset + 2 > r->length)
+				return DNSWIRE_FAILURE;
+			size_t target = (byte & ~POINTER) << 8 | r->message[r->offset + 1];
+			// only pointers backwards are followed, so every name is read in a bounded number of steps
+			if (target >= r->segment_start)
+				return DNSWIRE_FAILURE;
+			r->offset = r->segment_start = target;
+			continue;
+		}
+		// the other two label types were never put to use
+		if (byte > MAX_LABEL || r->offset + 1 + byte > r->length)
+			return DNSWIRE_FAILURE;
+		r->wire_length += 1 + byte;
+		if (r->wire_length > DNSWIRE_MAX_NAME)
+			return DNSWIRE_FAILURE;
+		*label = r->message + r->offset + 1;
+		r->offset += 1 + byte;
+		return byte;
+	}
+	return DNSWIRE_FAILURE;
+}
+
+// returns the offset just past the name at offset, or DNSWIRE_FAILURE
+// a pointer only has to point backwards here; where it leads is checked when the name is read,
+// so parsing a response costs nothing per pointer
+static long skip_name(const uint8_t *message, size_t length, size_t offset)
+{
+	size_t start = offset;
+	size_t wire_length = 0;
+	while (offset < length) {
+		uint8_t byte = message[offset];
+		if ((byte & POINTER) == POINTER) {
+			if (offset + 2 > length || (size_t)((byte & ~POINTER) << 8 | message[offset + 1]) >= start)
+				return DNSWIRE_FAILURE;
+			return offset + 2;
+		}
+		wire_length += 1 + byte;
+		if (byte > MAX_LABEL || wire_length > DNSWIRE_MAX_NAME)
+			return DNSWIRE_FAILURE;
+		offset += 1 + byte;
+		if (byte == 0)
+			return offset;
+	}
+	return DNSWIRE_FAILURE;
+}
+
+static char ascii_lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+int dnswire_encode_query(uint16_t id, const char *name, uint16_t type, uint8_t *buffer, size_t size)
+{
+	size_t name_length = strlen(name);
+	if (name_length > 0 && name[name_length - 1] == '.')
+		name_length--;
+	// each '.' becomes a length octet, plus one for the first label and one for the root
+	if (name_length == 0 || name_length + 2 > DNSWIRE_MAX_NAME ||
+	    size < DNSWIRE_HEADER_SIZE + name_length + 2 + 4)
+		return DNSWIRE_FAILURE;
+
+	memset(buffer, 0, DNSWIRE_HEADER_SIZE);
+	buffer[0] = id >> 8;
+	buffer[1] = id & 0xff;
+	buffer[2] = FLAG_RD >> 8;
+	// one question
+	buffer[5] = 1;
+
+	uint8_t *out = buffer + DNSWIRE_HEADER_SIZE;
+	const char *label = name;
+	const char *name_end = name + name_length;
+	while (label <= name_end) {
+		const char *dot = memchr(label, '.', name_end - label);
+		size_t label_length = (dot ? dot : name_end) - label;
+		if (label_length == 0 || label_length > MAX_LABEL)
+			return DNSWIRE_FAILURE;
+		*out++ = label_length;
+		memcpy(out, label, label_length);
+		out += label_length;
+		label += label_length + 1;
+	}
+	*out++ = 0;
+	*out++ = type >> 8;
+	*out++ = type & 0xff;
+	*out++ = 0;
+	*out++ = DNSWIRE_CLASS_IN;
+	return out - buffer;
+}
+
+int dnswire_parse(const uint8_t *message, size_t length, dnswire_response *response, dnswire_record *records, int capacity)
+{
+	// offsets are kept in 16 bits, which is as long as any DNS message gets
+	if (length < DNSWIRE_HEADER_SIZE || length > 65535)
+		return DNSWIRE_FAILURE;
+	response->id = read16(message);
+	response->flags = read16(message + 2);
+	if (!(response->flags & FLAG_QR))
+		return DNSWIRE_FAILURE;
+	response->rcode = response->flags & 0x0f;
+	response->truncated = (response->flags & FLAG_TC) != 0;
+	int questions = read16(message + 4);
+	int section_counts[3] = { read16(message + 6), read16(message + 8), read16(message + 10) };
+
+	response->question_offset = 0;
+	response->question_type = 0;
+	response->question_class = 0;
+	long offset = DNSWIRE_HEADER_SIZE;
+	for (int i = 0; i < questions; i++) {
+		long name_offset = offset;
+		offset = skip_name(message, length, offset);
+		if (offset == DNSWIRE_FAILURE || (size_t)offset + 4 > length)
+			return DNSWIRE_FAILURE;
+		if (i == 0) {
+			response->question_offset = name_offset;
+			response->question_type = read16(message + offset);
+			response->question_class = read16(message + offset + 2);
+		}
+		offset += 4;
+	}
+
+	response->record_count = 0;
+	response->total_count = 0;
+	for (int section = DNSWIRE_SECTION_ANSWER; section <= DNSWIRE_SECTION_ADDITIONAL; section++) {
+		for (int i = 0; i < section_counts[section]; i++) {
+			long name_offset = offset;
+			offset = skip_name(message, length, offset);
+			if (offset == DNSWIRE_FAILURE || (size_t)offset + RECORD_FIXED_SIZE > length)
+				return DNSWIRE_FAILURE;
+			const uint8_t *fixed = message + offset;
+			uint16_t data_length = read16(fixed + 8);
+			offset += RECORD_FIXED_SIZE;
+			if ((size_t)offset + data_length > length)
+				return DNSWIRE_FAILURE;
+
+			if (response->record_count < capacity) {
+				dnswire_record *record = &records[response->record_count++];
+				record->name_offset = name_offset;
+				record->type = read16(fixed);
+				record->rclass = read16(fixed + 2);
+				record->section = section;
+				record->ttl = read32(fixed + 4);
+				record->data_offset = offset;
+				record->data_length = data_length;
+			}
+			response->total_count++;
+			offset += data_length;
+		}
+	}
+	return DNSWIRE_SUCCESS;
+}
+
+int dnswire_name(const uint8_t *message, size_t length, size_t offset, char *name, size_t size)
+{
+	if (size == 0)
+		return DNSWIRE_FAILURE;
+	name_reader r;
+	start_name(&r, message, length, offset);
+	size_t written = 0;
+	const uint8_t *label;
+	int label_length;
+	while ((label_length = next_label(&r, &label)) > 0) {
+		// the separating '.' and the terminator both need room
+		if (written + (written > 0) + label_length + 1 > size)
+			return DNSWIRE_FAILURE;
+		if (written > 0)
+			name[written++] = '.';
+		memcpy(name + written, label, label_length);
+		written += label_length;
+	}
+	if (label_length == DNSWIRE_FAILURE)
+		return DNSWIRE_FAILURE;
+	name[written] = '\0';
+	return DNSWIRE_SUCCESS;
+}
+
+int dnswire_name_equal(const uint8_t *message, size_t length, size_t offset, const char *name)
+{
+	name_reader r;
+	start_name(&r, message, length, offset);
+	const char *remaining = name;
+	const uint8_t *label;
+	int label_length;
+	while ((label_length = next_label(&r, &label)) > 0) {
+		if (remaining != name) {
+			if (*remaining != '.')
+				return 0;
+			remaining++;
+		}
+		for (int i = 0; i < label_length; i++, remaining++) {
+			if (*remaining == '\0' || ascii_lower(*remaining) != ascii_lower(label[i]))
+				return 0;
+		}
+	}
+	if (label_length == DNSWIRE_FAILURE)
+		return 0;
+	return *remaining == '\0' || (remaining != name && remaining[0] == '.' && remaining[1] == '\0');
+}
+
+int dnswire_address(const uint8_t *message, const dnswire_record *record, char *ip_str, size_t size)
+{
+	int family;
+	if (record->type == DNSWIRE_TYPE_A && record->data_length == 4)
+		family = AF_INET;
+	else if (record->type == DNSWIRE_TYPE_AAAA && record->data_length == 16)
+		family = AF_INET6;
+	else
+		return DNSWIRE_FAILURE;
+	if (record->rclass != DNSWIRE_CLASS_IN || !inet_ntop(family, message + record->data_offset, ip_str, size))
+		return DNSWIRE_FAILURE;
+	return DNSWIRE_SUCCESS;
+}
+
+void dnswire_first_address(const uint8_t *message, const dnswire_response *response, const dnswire_record *records,
+			   char *ip_str, size_t size)
+{
+	ip_str[0] = '\0';
+	if (response->rcode != DNSWIRE_RCODE_NOERROR)
+		return;
+	for (int i = 0; i < response->record_count; i++) {
+		if (records[i].section == DNSWIRE_SECTION_ANSWER && records[i].type == DNSWIRE_TYPE_A &&
+		    dnswire_address(message, &records[i], ip_str, size) == DNSWIRE_SUCCESS)
+			return;
+	}
+	ip_str[0] = '\0';
+}
@@ -0,0 +1,107 @@
+/*
+ * File: dnswire.h
+ * Description:
+ * 	DNS wire-format codec (RFC 1035) for the resolver backends. Queries
+ *	are encoded into a caller's buffer, and responses are parsed into a
+ *	caller's array of flat records that point back into the message, so
+ *	neither direction allocates. Names in a response, compressed or not,
+ *	are only expanded when asked for, and can be compared against a
+ *	hostname without being expanded at all.
+ *
+ *	Every read is checked against the message length, compression
+ *	pointers must point backwards (so they cannot loop), and names are
+ *	limited to DNSWIRE_MAX_NAME octets, so any input, however malformed,
+ *	is either parsed or rejected with DNSWIRE_FAILURE. Parsing checks the
+ *	layout of the message; a compressed name that leads somewhere invalid
+ *	is only rejected when it is read.
+ */
+
+#ifndef DNSWIRE_H
+#define DNSWIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNSWIRE_FAILURE -1
+#define DNSWIRE_SUCCESS 0
+
+#define DNSWIRE_HEADER_SIZE 12
+// longest name in wire form, root label included
+#define DNSWIRE_MAX_NAME 255
+// longest name in text form, without a trailing '.', plus its terminator
+#define DNSWIRE_MAX_NAME_TEXT 254
+#define DNSWIRE_MAX_QUERY (DNSWIRE_HEADER_SIZE + DNSWIRE_MAX_NAME + 4)
+
+#define DNSWIRE_TYPE_A 1
+#define DNSWIRE_TYPE_CNAME 5
+#define DNSWIRE_TYPE_AAAA 28
+#define DNSWIRE_CLASS_IN 1
+
+#define DNSWIRE_RCODE_NOERROR 0
+#define DNSWIRE_RCODE_NXDOMAIN 3
+
+#define DNSWIRE_SECTION_ANSWER 0
+#define DNSWIRE_SECTION_AUTHORITY 1
+#define DNSWIRE_SECTION_ADDITIONAL 2
+
+// one resource record; offsets are into the parsed message
+typedef struct dnswire_record_s {
+	uint16_t name_offset;
+	uint16_t type;
+	uint16_t rclass;
+	uint16_t section;
+	uint32_t ttl;
+	uint16_t data_offset;
+	uint16_t data_length;
+} dnswire_record;
+
+typedef struct dnswire_response_s {
+	uint16_t id;
+	uint16_t flags;
+	int rcode;
+	int truncated;
+	// the first question, which is the only one a response to these queries has
+	uint16_t question_offset;
+	uint16_t question_type;
+	uint16_t question_class;
+	// records stored in the caller's array, and records in the message
+	// record_count is less than total_count only when the array was too small
+	int record_count;
+	int total_count;
+} dnswire_response;
+
+/* Function to encode a recursive query for records of type for name, with transaction ID id
+ * name may end in '.'; buffer should hold DNSWIRE_MAX_QUERY bytes
+ * Returns the length of the query, or DNSWIRE_FAILURE if name is not a valid domain name or does not fit
+ */
+int dnswire_encode_query(uint16_t id, const char *name, uint16_t type, uint8_t *buffer, size_t size);
+
+/* Function to parse a response into response and up to capacity records
+ * Records past capacity are checked but not stored
+ * Returns DNSWIRE_SUCCESS, or DNSWIRE_FAILURE if the message is malformed or not a response
+ */
+int dnswire_parse(const uint8_t *message, size_t length, dnswire_response *response, dnswire_record *records, int capacity);
+
+/* Function to expand the name at offset, following compression pointers, into text
+ * name should hold DNSWIRE_MAX_NAME_TEXT bytes; the root name is written as ""
+ * Returns DNSWIRE_SUCCESS or DNSWIRE_FAILURE
+ */
+int dnswire_name(const uint8_t *message, size_t length, size_t offset, char *name, size_t size);
+
+/* Function to compare the name at offset with name, ignoring case and a trailing '.' on name
+ * Returns 1 if they are the same name, 0 if not or if the message is malformed
+ */
+int dnswire_name_equal(const uint8_t *message, size_t length, size_t offset, const char *name);
+
+/* Function to write the address in an A or AAAA record as text
+ * Returns DNSWIRE_SUCCESS, or DNSWIRE_FAILURE if record is not an address of the right size
+ */
+int dnswire_address(const uint8_t *message, const dnswire_record *record, char *ip_str, size_t size);
+
+/* Function to write the first A record in the answer section of a NOERROR response as text
+ * Writes "" if there is none
+ */
+void dnswire_first_address(const uint8_t *message, const dnswire_response *response, const dnswire_record *records,
+			   char *ip_str, size_t size);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * File: dnswireBench.c
+ * Description:
+ * 	Microbenchmarks for the DNS codec in dnswire.h. Reports the time per
+ *	message to encode a query, to parse a typical response (a CNAME and
+ *	its address, names compressed), to parse a larger one with eight
+ *	addresses, and to check a response's question against a hostname.
+ *	Give an iteration count to run longer than the default.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dnswire.h"
+
+#define DEFAULT_ITERATIONS 2000000
+#define BENCH_RECORDS 16
+
+// keeps the compiler from discarding the work being timed
+static volatile long sink;
+
+static const uint8_t small_response[] = {
+	0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+	3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+	0x00, 0x01, 0x00, 0x01,
+	0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x06,
+	3, 'w', 'e', 'b', 0xc0, 0x10,
+	0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+	192, 0, 2, 7,
+};
+
+static double now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// builds a response for www.example.com with eight A records, each owner compressed
+static size_t build_large_response(uint8_t *message)
+{
+	size_t length = DNSWIRE_HEADER_SIZE;
+	memcpy(message, small_response, length);
+	message[7] = 8;
+	memcpy(message + length, small_response + DNSWIRE_HEADER_SIZE, 21);
+	length += 21;
+	for (int i = 0; i < 8; i++) {
+		static const uint8_t fixed[] = { 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04 };
+		memcpy(message + length, fixed, sizeof(fixed));
+		length += sizeof(fixed);
+		uint8_t address[] = { 192, 0, 2, i + 1 };
+		memcpy(message + length, address, sizeof(address));
+		length += sizeof(address);
+	}
+	return length;
+}
+
+static void report(const char *name, double start, long iterations)
+{
+	printf("%-28s %8.1f ns/message\n", name, (now_ns() - start) / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+
+	static const char *names[] = { "www.example.com", "host1234-5.invalid", "a.b.c.d.example.org", "localhost" };
+	uint8_t query[DNSWIRE_MAX_QUERY];
+	double start = now_ns();
+	for (long i = 0; i < iterations; i++)
+		sink += dnswire_encode_query(i, names[i & 3], DNSWIRE_TYPE_A, query, sizeof(query));
+	report("encode query", start, iterations);
+
+	dnswire_response response;
+	dnswire_record records[BENCH_RECORDS];
+	start = now_ns();
+	for (long i = 0; i < iterations; i++) {
+		dnswire_parse(small_response, sizeof(small_response), &response, records, BENCH_RECORDS);
+		sink += response.record_count;
+	}
+	report("parse CNAME + A", start, iterations);
+
+	uint8_t large_response[512];
+	size_t large_length = build_large_response(large_response);
+	start = now_ns();
+	for (long i = 0; i < iterations; i++) {
+		dnswire_parse(large_response, large_length, &response, records, BENCH_RECORDS);
+		sink += response.record_count;
+	}
+	report("parse 8 x A", start, iterations);
+
+	start = now_ns();
+	for (long i = 0; i < iterations; i++)
+		sink += dnswire_name_equal(small_response, sizeof(small_response), 12, "WWW.example.com");
+	report("compare question name", start, iterations);
+
+	if (dnswire_parse(large_response, large_length, &response, records, BENCH_RECORDS) == DNSWIRE_FAILURE ||
+	    response.record_count != 8) {
+		fprintf(stderr, "benchmark response did not parse\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * File: dnswireTest.c
+ * Description:
+ * 	This file contains test code for the DNS codec in dnswire.h: query
+ *	encoding, parsing a response that uses compression pointers, rejection
+ *	of malformed names and truncated messages, and a mutation fuzzer that
+ *	feeds damaged responses through every function. Give an iteration
+ *	count to fuzz for longer than the default; building with
+ *	-fsanitize=address makes any out-of-bounds read fatal.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "dnswire.h"
+
+#define DEFAULT_FUZZ_ITERATIONS 200000
+#define FUZZ_RECORDS 4
+
+static int errors = 0;
+
+static void fail(const char *message)
+{
+	fprintf(stderr, "error: %s\n", message);
+	errors++;
+}
+
+// a response for www.example.com: a CNAME to web.example.com, then its A record,
+// with every name after the question compressed
+static const uint8_t response_message[] = {
+	0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+	// question at 12: www.example.com A IN
+	3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+	0x00, 0x01, 0x00, 0x01,
+	// answer at 33: pointer to the question name, CNAME IN, TTL 300
+	0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x06,
+	// data at 45: web, then a pointer to example.com at 16
+	3, 'w', 'e', 'b', 0xc0, 0x10,
+	// answer at 51: pointer to the CNAME data, A IN, TTL 60, 192.0.2.7
+	0xc0, 0x2d, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+	192, 0, 2, 7,
+};
+
+static void test_encode()
+{
+	static const uint8_t expected[] = {
+		0xab, 0xcd, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		3, 'w', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+		0x00, 0x1c, 0x00, 0x01,
+	};
+	uint8_t buffer[DNSWIRE_MAX_QUERY];
+
+	/* Test a query against its exact encoding, with and without a trailing dot */
+	int length = dnswire_encode_query(0xabcd, "www.Example.com", DNSWIRE_TYPE_AAAA, buffer, sizeof(buffer));
+	if (length != sizeof(expected) || memcmp(buffer, expected, sizeof(expected)) != 0)
+		fail("query encoded incorrectly");
+	length = dnswire_encode_query(0xabcd, "www.Example.com.", DNSWIRE_TYPE_AAAA, buffer, sizeof(buffer));
+	if (length != sizeof(expected) || memcmp(buffer, expected, sizeof(expected)) != 0)
+		fail("trailing dot changed the encoding");
+
+	/* Test that a query does not parse as a response */
+	dnswire_response response;
+	if (dnswire_parse(buffer, length, &response, NULL, 0) != DNSWIRE_FAILURE)
+		fail("a query parsed as a response");
+
+	/* Test that a buffer one byte short is refused */
+	if (dnswire_encode_query(0, "www.Example.com", DNSWIRE_TYPE_A, buffer, sizeof(expected) - 1) != DNSWIRE_FAILURE)
+		fail("query encoded into a buffer that was too small");
+
+	/* Test invalid names */
+	char long_label[65];
+	memset(long_label, 'a', 64);
+	long_label[64] = '\0';
+	char long_name[256];
+	for (int i = 0; i < 255; i++)
+		long_name[i] = i % 2 ? '.' : 'a';
+	long_name[255] = '\0';
+	const char *invalid[] = { "", ".", "..", "a..b", ".a", long_label, long_name };
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		if (dnswire_encode_query(0, invalid[i], DNSWIRE_TYPE_A, buffer, sizeof(buffer)) != DNSWIRE_FAILURE)
+			fail("invalid name was encoded");
+	}
+
+	/* Test the longest valid name: 253 characters */
+	long_name[253] = '\0';
+	if (dnswire_encode_query(0, long_name, DNSWIRE_TYPE_A, buffer, sizeof(buffer)) != DNSWIRE_HEADER_SIZE + 255 + 4)
+		fail("longest valid name was not encoded");
+}
+
+static void test_parse()
+{
+	dnswire_response response;
+	dnswire_record records[4];
+	if (dnswire_parse(response_message, sizeof(response_message), &response, records, 4) != DNSWIRE_SUCCESS) {
+		fail("valid response did not parse");
+		return;
+	}
+
+	/* Test the header and question */
+	if (response.id != 0x1234 || response.rcode != DNSWIRE_RCODE_NOERROR || response.truncated ||
+	    response.question_offset != 12 || response.question_type != DNSWIRE_TYPE_A ||
+	    response.question_class != DNSWIRE_CLASS_IN)
+		fail("header or question parsed incorrectly");
+	if (response.record_count != 2 || response.total_count != 2)
+		fail("wrong number of records");
+
+	/* Test the records */
+	if (records[0].type != DNSWIRE_TYPE_CNAME || records[0].ttl != 300 || records[0].data_offset != 45 ||
+	    records[0].data_length != 6 || records[0].section != DNSWIRE_SECTION_ANSWER)
+		fail("CNAME record parsed incorrectly");
+	if (records[1].type != DNSWIRE_TYPE_A || records[1].ttl != 60 || records[1].name_offset != 51)
+		fail("A record parsed incorrectly");
+
+	/* Test expanding compressed names */
+	char name[DNSWIRE_MAX_NAME_TEXT];
+	if (dnswire_name(response_message, sizeof(response_message), records[0].name_offset, name, sizeof(name)) != DNSWIRE_SUCCESS ||
+	    strcmp(name, "www.example.com") != 0)
+		fail("compressed owner name expanded incorrectly");
+	if (dnswire_name(response_message, sizeof(response_message), records[0].data_offset, name, sizeof(name)) != DNSWIRE_SUCCESS ||
+	    strcmp(name, "web.example.com") != 0)
+		fail("CNAME target expanded incorrectly");
+	if (dnswire_name(response_message, sizeof(response_message), records[1].name_offset, name, 15) != DNSWIRE_FAILURE)
+		fail("name expanded into a buffer that was too small");
+
+	/* Test comparing names without expanding them */
+	size_t length = sizeof(response_message);
+	if (!dnswire_name_equal(response_message, length, 12, "WWW.example.COM") ||
+	    !dnswire_name_equal(response_message, length, 12, "www.example.com.") ||
+	    !dnswire_name_equal(response_message, length, records[1].name_offset, "web.example.com"))
+		fail("equal names compared unequal");
+	if (dnswire_name_equal(response_message, length, 12, "www.example.co") ||
+	    dnswire_name_equal(response_message, length, 12, "www.example.comm") ||
+	    dnswire_name_equal(response_message, length, 12, "www.example") ||
+	    dnswire_name_equal(response_message, length, 12, "www.example.com..") ||
+	    dnswire_name_equal(response_message, length, 12, "wwwexample.com"))
+		fail("different names compared equal");
+
+	/* Test the address */
+	char ip_str[INET6_ADDRSTRLEN];
+	if (dnswire_address(response_message, &records[1], ip_str, sizeof(ip_str)) != DNSWIRE_SUCCESS ||
+	    strcmp(ip_str, "192.0.2.7") != 0)
+		fail("address formatted incorrectly");
+	if (dnswire_address(response_message, &records[0], ip_str, sizeof(ip_str)) != DNSWIRE_FAILURE)
+		fail("CNAME formatted as an address");
+
+	/* Test that records past capacity are counted but not stored */
+	if (dnswire_parse(response_message, sizeof(response_message), &response, records, 1) != DNSWIRE_SUCCESS ||
+	    response.record_count != 1 || response.total_count != 2)
+		fail("records past capacity handled incorrectly");
+}
+
+static void test_malformed()
+{
+	uint8_t message[sizeof(response_message)];
+	dnswire_response response;
+	dnswire_record records[4];
+
+	/* Test that every truncation of the response is rejected */
+	for (size_t length = 0; length < sizeof(response_message); length++) {
+		if (dnswire_parse(response_message, length, &response, records, 4) != DNSWIRE_FAILURE)
+			fail("truncated response parsed");
+	}
+
+	/* Test pointers to the pointer itself, forwards, and past the end */
+	uint16_t targets[] = { 33, 40, 0x3fff };
+	for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+		memcpy(message, response_message, sizeof(message));
+		message[33] = 0xc0 | targets[i] >> 8;
+		message[34] = targets[i] & 0xff;
+		if (dnswire_parse(message, sizeof(message), &response, records, 4) != DNSWIRE_FAILURE)
+			fail("bad compression pointer parsed");
+	}
+
+	/* Test a loop through two pointers: the CNAME data points at the A record's owner, which points back */
+	memcpy(message, response_message, sizeof(message));
+	message[49] = 0xc0;
+	message[50] = 51;
+	char name[DNSWIRE_MAX_NAME_TEXT];
+	if (dnswire_name(message, sizeof(message), 45, name, sizeof(name)) != DNSWIRE_FAILURE ||
+	    dnswire_name_equal(message, sizeof(message), 51, "web.web.web"))
+		fail("pointer loop followed");
+
+	/* Test the two reserved label types */
+	uint8_t reserved[] = { 0x40, 0x80 };
+	for (size_t i = 0; i < sizeof(reserved); i++) {
+		memcpy(message, response_message, sizeof(message));
+		message[45] = reserved[i];
+		if (dnswire_name(message, sizeof(message), 45, name, sizeof(name)) != DNSWIRE_FAILURE)
+			fail("reserved label type accepted");
+	}
+
+	/* Test a name longer than 255 octets, made of five 63 octet labels */
+	uint8_t long_message[DNSWIRE_HEADER_SIZE + 5 * 64 + 1 + 4] = { 0, 0, 0x81, 0x80, 0, 1 };
+	for (int i = 0; i < 5; i++) {
+		long_message[DNSWIRE_HEADER_SIZE + i * 64] = 63;
+		memset(long_message + DNSWIRE_HEADER_SIZE + i * 64 + 1, 'a', 63);
+	}
+	if (dnswire_parse(long_message, sizeof(long_message), &response, records, 4) != DNSWIRE_FAILURE)
+		fail("name longer than 255 octets parsed");
+}
+
+static uint64_t fuzz_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t fuzz_random()
+{
+	fuzz_state ^= fuzz_state << 13;
+	fuzz_state ^= fuzz_state >> 7;
+	fuzz_state ^= fuzz_state << 17;
+	return fuzz_state;
+}
+
+// runs message through everything that reads a response, and checks what comes back is in bounds
+static void fuzz_one(const uint8_t *message, size_t length)
+{
+	dnswire_response response;
+	dnswire_record records[FUZZ_RECORDS];
+	if (dnswire_parse(message, length, &response, records, FUZZ_RECORDS) == DNSWIRE_FAILURE)
+		return;
+	if (response.record_count > FUZZ_RECORDS || response.record_count > response.total_count)
+		fail("fuzz: record count out of range");
+
+	char name[DNSWIRE_MAX_NAME_TEXT];
+	char ip_str[INET6_ADDRSTRLEN];
+	if (response.question_offset && dnswire_name(message, length, response.question_offset, name, sizeof(name)) == DNSWIRE_SUCCESS) {
+		if (strlen(name) >= DNSWIRE_MAX_NAME_TEXT)
+			fail("fuzz: question name too long");
+		dnswire_name_equal(message, length, response.question_offset, name);
+	}
+	for (int i = 0; i < response.record_count; i++) {
+		if ((size_t)records[i].data_offset + records[i].data_length > length)
+			fail("fuzz: record data past the end of the message");
+		if (dnswire_name(message, length, records[i].name_offset, name, sizeof(name)) == DNSWIRE_SUCCESS &&
+		    strlen(name) >= DNSWIRE_MAX_NAME_TEXT)
+			fail("fuzz: owner name too long");
+		dnswire_name(message, length, records[i].data_offset, name, sizeof(name));
+		dnswire_name_equal(message, length, records[i].data_offset, "web.example.com");
+		dnswire_address(message, &records[i], ip_str, sizeof(ip_str));
+	}
+}
+
+static void test_fuzz(long iterations)
+{
+	uint8_t message[512];
+	for (long n = 0; n < iterations; n++) {
+		size_t length = sizeof(response_message);
+		memcpy(message, response_message, length);
+		uint64_t r = fuzz_random();
+		switch (r % 4) {
+		case 0:
+			// overwrite a few bytes
+			for (int i = 0; i < 1 + (int)(r >> 8) % 4; i++)
+				message[fuzz_random() % length] = fuzz_random();
+			break;
+		case 1:
+			// point a name somewhere arbitrary
+			message[12 + fuzz_random() % (length - 13)] = 0xc0;
+			message[12 + fuzz_random() % (length - 12)] = fuzz_random();
+			break;
+		case 2:
+			// change a count, or cut the message short
+			message[4 + fuzz_random() % 8] = fuzz_random();
+			length = fuzz_random() % (length + 1);
+			break;
+		default:
+			// random bytes after a plausible header
+			length = DNSWIRE_HEADER_SIZE + fuzz_random() % (sizeof(message) - DNSWIRE_HEADER_SIZE);
+			for (size_t i = DNSWIRE_HEADER_SIZE; i < length; i++)
+				message[i] = fuzz_random();
+			message[4] = 0;
+			message[5] = fuzz_random() % 3;
+			message[7] = fuzz_random() % 8;
+			break;
+		}
+		fuzz_one(message, length);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_FUZZ_ITERATIONS;
+
+	test_encode();
+	test_parse();
+	test_malformed();
+	test_fuzz(iterations);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,505 @@
+/*
+ * File: hosts.c
+ * Description:
+ * 	Hosts-file parsing and the minimal perfect hash behind --hosts.
+ *
+ *	Names are split into buckets by one half of their hash. Each bucket,
+ *	largest first, is given the smallest displacement that sends all of
+ *	its names to slots nobody has taken yet, so every name ends up with a
+ *	slot of its own and the table has exactly one slot per name. A lookup
+ *	hashes the name, reads its bucket's displacement and compares the one
+ *	name in the resulting slot.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hosts.h"
+
+#define MAX_HOSTS_NAME_LENGTH 1025
+// a bucket that cannot be placed within this many displacements restarts the build with more buckets
+#define MAX_DISPLACEMENT (1u << 20)
+
+typedef struct pending_host_s {
+	char *name;
+	char *address;
+	uint64_t hash;
+} pending_host;
+
+typedef struct host_list_s {
+	pending_host *hosts;
+	size_t count;
+	size_t capacity;
+	// open addressing set of host numbers + 1, used to keep the first address of each name
+	uint32_t *seen;
+	size_t seen_capacity;
+} host_list;
+
+// the table, either built in memory or mapped from the cache file
+static const unsigned char *table = NULL;
+static size_t table_size = 0;
+static int table_mapped = 0;
+static const hosts_header *header;
+static const uint32_t *displacements;
+static const hosts_entry *entries;
+static const char *strings;
+
+
+static uint64_t hash_name(const char *name)
+{
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// maps a 32-bit value onto 0..n-1 with a multiply instead of a division
+static uint32_t reduce(uint32_t x, uint32_t n)
+{
+	return ((uint64_t)x * n) >> 32;
+}
+
+static uint32_t bucket_of(uint64_t hash, uint32_t bucket_count)
+{
+	return reduce((uint32_t)hash, bucket_count);
+}
+
+static uint32_t slot_of(uint64_t hash, uint32_t displacement, uint32_t entry_count)
+{
+	// splitmix64 finalizer over the hash and displacement
+	uint64_t x = hash + (uint64_t)displacement * 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return reduce((uint32_t)(x >> 32), entry_count);
+}
+
+static void lowercase(char *dst, const char *src, size_t size)
+{
+	size_t i;
+	for (i = 0; i + 1 < size && src[i]; i++)
+		dst[i] = tolower((unsigned char)src[i]);
+	dst[i] = '\0';
+}
+
+static uint64_t align8(uint64_t offset)
+{
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+static void set_table(const unsigned char *blob, size_t size, int mapped)
+{
+	table = blob;
+	table_size = size;
+	table_mapped = mapped;
+	header = (const hosts_header *)blob;
+	displacements = (const uint32_t *)(blob + header->displacements_offset);
+	entries = (const hosts_entry *)(blob + header->entries_offset);
+	strings = (const char *)(blob + header->strings_offset);
+}
+
+
+static int seen_before(host_list *list, const char *name, uint64_t hash)
+{
+	if ((list->count + 1) * 2 > list->seen_capacity) {
+		size_t capacity = list->seen_capacity ? list->seen_capacity * 2 : 1024;
+		uint32_t *seen = calloc(capacity, sizeof(uint32_t));
+		if (!seen)
+			return -1;
+		for (size_t i = 0; i < list->seen_capacity; i++) {
+			if (list->seen[i]) {
+				size_t s = list->hosts[list->seen[i] - 1].hash & (capacity - 1);
+				while (seen[s])
+					s = (s + 1) & (capacity - 1);
+				seen[s] = list->seen[i];
+			}
+		}
+		free(list->seen);
+		list->seen = seen;
+		list->seen_capacity = capacity;
+	}
+
+	size_t s = hash & (list->seen_capacity - 1);
+	while (list->seen[s]) {
+		pending_host *host = &list->hosts[list->seen[s] - 1];
+		if (host->hash == hash && strcmp(host->name, name) == 0)
+			return 1;
+		s = (s + 1) & (list->seen_capacity - 1);
+	}
+	// the caller appends the host next, so its number is known now
+	list->seen[s] = list->count + 1;
+	return 0;
+}
+
+static int add_host(host_list *list, const char *name, const char *address)
+{
+	char lowered[MAX_HOSTS_NAME_LENGTH];
+	lowercase(lowered, name, sizeof(lowered));
+	uint64_t hash = hash_name(lowered);
+
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+		pending_host *hosts = realloc(list->hosts, capacity * sizeof(pending_host));
+		if (!hosts)
+			return HOSTS_FAILURE;
+		list->hosts = hosts;
+		list->capacity = capacity;
+	}
+
+	int seen = seen_before(list, lowered, hash);
+	if (seen == -1)
+		return HOSTS_FAILURE;
+	if (seen)
+		return HOSTS_SUCCESS;
+
+	pending_host *host = &list->hosts[list->count];
+	host->name = strdup(lowered);
+	host->address = strdup(address);
+	host->hash = hash;
+	if (!host->name || !host->address) {
+		free(host->name);
+		free(host->address);
+		return HOSTS_FAILURE;
+	}
+	list->count++;
+	return HOSTS_SUCCESS;
+}
+
+static int parse_hosts_file(host_list *list, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Failed to open hosts file %s.\n", path);
+		return HOSTS_FAILURE;
+	}
+
+	int ret = HOSTS_SUCCESS;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	while (ret == HOSTS_SUCCESS && getline(&line, &line_capacity, fp) != -1) {
+		line[strcspn(line, "#")] = '\0';
+
+		char *save;
+		char *address = strtok_r(line, " \t\r\n", &save);
+		if (!address)
+			continue;
+
+		// addresses are stored the way inet_ntop prints them, like resolved ones
+		unsigned char binary[16];
+		char normalized[INET6_ADDRSTRLEN];
+		if (inet_pton(AF_INET, address, binary) == 1)
+			inet_ntop(AF_INET, binary, normalized, sizeof(normalized));
+		else if (inet_pton(AF_INET6, address, binary) == 1)
+			inet_ntop(AF_INET6, binary, normalized, sizeof(normalized));
+		else
+			continue;
+
+		char *name;
+		while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if (add_host(list, name, normalized) == HOSTS_FAILURE) {
+				ret = HOSTS_FAILURE;
+				break;
+			}
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static int compare_bucket_size(const void *a, const void *b, void *sizes)
+{
+	uint32_t x = ((const uint32_t *)sizes)[*(const uint32_t *)a];
+	uint32_t y = ((const uint32_t *)sizes)[*(const uint32_t *)b];
+	return (x < y) - (x > y);
+}
+
+// finds a displacement for every bucket; returns HOSTS_FAILURE if some bucket could not be placed
+static int place_buckets(host_list *list, uint32_t bucket_count, uint32_t *disp, uint32_t *slot_owner)
+{
+	uint32_t n = list->count;
+	uint32_t *sizes = calloc(bucket_count, sizeof(uint32_t));
+	uint32_t *starts = calloc(bucket_count + 1, sizeof(uint32_t));
+	uint32_t *members = malloc((n ? n : 1) * sizeof(uint32_t));
+	uint32_t *order = malloc(bucket_count * sizeof(uint32_t));
+	uint32_t *slots = malloc((n ? n : 1) * sizeof(uint32_t));
+	int ret = HOSTS_FAILURE;
+	if (!sizes || !starts || !members || !order || !slots)
+		goto done;
+
+	for (uint32_t i = 0; i < n; i++)
+		sizes[bucket_of(list->hosts[i].hash, bucket_count)]++;
+	for (uint32_t b = 0; b < bucket_count; b++)
+		starts[b + 1] = starts[b] + sizes[b];
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t b = bucket_of(list->hosts[i].hash, bucket_count);
+		members[starts[b]++] = i;
+	}
+	// starts now holds each bucket's end; shift it back to its start
+	for (uint32_t b = bucket_count; b > 0; b--)
+		starts[b] = starts[b - 1];
+	starts[0] = 0;
+
+	for (uint32_t b = 0; b < bucket_count; b++)
+		order[b] = b;
+	qsort_r(order, bucket_count, sizeof(uint32_t), compare_bucket_size, sizes);
+
+	for (uint32_t i = 0; i < n; i++)
+		slot_owner[i] = UINT32_MAX;
+
+	for (uint32_t k = 0; k < bucket_count && sizes[order[k]] > 0; k++) {
+		uint32_t b = order[k];
+		uint32_t *bucket = &members[starts[b]];
+		uint32_t d;
+		for (d = 0; d < MAX_DISPLACEMENT; d++) {
+			uint32_t j;
+			for (j = 0; j < sizes[b]; j++) {
+				slots[j] = slot_of(list->hosts[bucket[j]].hash, d, n);
+				if (slot_owner[slots[j]] != UINT32_MAX)
+					break;
+				// claim it for now, so two names in this bucket cannot share a slot
+				slot_owner[slots[j]] = bucket[j];
+			}
+			if (j == sizes[b])
+				break;
+			while (j-- > 0)
+				slot_owner[slots[j]] = UINT32_MAX;
+		}
+		if (d == MAX_DISPLACEMENT)
+			goto done;
+		disp[b] = d;
+	}
+	ret = HOSTS_SUCCESS;
+
+done:
+	free(sizes);
+	free(starts);
+	free(members);
+	free(order);
+	free(slots);
+	return ret;
+}
+
+// lays the table out as one block, the same way it is stored in the cache
+static int build_table(host_list *list, const char **paths, int num_paths, const struct stat *stats)
+{
+	if (list->count >= UINT32_MAX)
+		return HOSTS_FAILURE;
+	uint32_t n = list->count;
+	uint32_t bucket_count = n / HOSTS_BUCKET_LOAD + 1;
+
+	uint32_t *disp = NULL;
+	uint32_t *slot_owner = malloc((n ? n : 1) * sizeof(uint32_t));
+	if (!slot_owner)
+		return HOSTS_FAILURE;
+	while (1) {
+		free(disp);
+		disp = calloc(bucket_count, sizeof(uint32_t));
+		if (!disp) {
+			free(slot_owner);
+			return HOSTS_FAILURE;
+		}
+		if (place_buckets(list, bucket_count, disp, slot_owner) == HOSTS_SUCCESS)
+			break;
+		// smaller buckets are easier to place
+		bucket_count *= 2;
+	}
+
+	uint64_t strings_size = 0;
+	for (int i = 0; i < num_paths; i++)
+		strings_size += strlen(paths[i]) + 1;
+	for (uint32_t i = 0; i < n; i++)
+		strings_size += strlen(list->hosts[i].name) + 1 + strlen(list->hosts[i].address) + 1;
+
+	hosts_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, HOSTS_MAGIC, sizeof(HOSTS_MAGIC));
+	h.version = HOSTS_VERSION;
+	h.source_count = num_paths;
+	h.entry_count = n;
+	h.bucket_count = bucket_count;
+	h.sources_offset = align8(sizeof(h));
+	h.displacements_offset = align8(h.sources_offset + (uint64_t)num_paths * sizeof(hosts_source));
+	h.entries_offset = align8(h.displacements_offset + (uint64_t)bucket_count * sizeof(uint32_t));
+	h.strings_offset = align8(h.entries_offset + (uint64_t)n * sizeof(hosts_entry));
+	h.strings_size = strings_size;
+
+	size_t size = h.strings_offset + strings_size;
+	unsigned char *blob = calloc(1, size);
+	if (!blob || strings_size > UINT32_MAX) {
+		free(blob);
+		free(disp);
+		free(slot_owner);
+		return HOSTS_FAILURE;
+	}
+	memcpy(blob, &h, sizeof(h));
+	memcpy(blob + h.displacements_offset, disp, (size_t)bucket_count * sizeof(uint32_t));
+
+	char *s = (char *)blob + h.strings_offset;
+	uint32_t used = 0;
+	hosts_source *sources = (hosts_source *)(blob + h.sources_offset);
+	for (int i = 0; i < num_paths; i++) {
+		sources[i].size = stats[i].st_size;
+		sources[i].mtime_sec = stats[i].st_mtim.tv_sec;
+		sources[i].mtime_nsec = stats[i].st_mtim.tv_nsec;
+		sources[i].path_offset = used;
+		strcpy(s + used, paths[i]);
+		used += strlen(paths[i]) + 1;
+	}
+	hosts_entry *e = (hosts_entry *)(blob + h.entries_offset);
+	for (uint32_t slot = 0; slot < n; slot++) {
+		pending_host *host = &list->hosts[slot_owner[slot]];
+		e[slot].name_offset = used;
+		strcpy(s + used, host->name);
+		used += strlen(host->name) + 1;
+		e[slot].address_offset = used;
+		strcpy(s + used, host->address);
+		used += strlen(host->address) + 1;
+	}
+
+	free(disp);
+	free(slot_owner);
+	set_table(blob, size, 0);
+	return HOSTS_SUCCESS;
+}
+
+
+// maps cache_path if it is a well-formed table built from exactly these files as they are now
+static int load_cache(const char *cache_path, const char **paths, int num_paths, const struct stat *stats)
+{
+	int fd = open(cache_path, O_RDONLY);
+	if (fd == -1)
+		return HOSTS_FAILURE;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(hosts_header)) {
+		close(fd);
+		return HOSTS_FAILURE;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return HOSTS_FAILURE;
+
+	const hosts_header *h = map;
+	uint64_t size = st.st_size;
+	int valid = memcmp(h->magic, HOSTS_MAGIC, sizeof(HOSTS_MAGIC)) == 0 && h->version == HOSTS_VERSION &&
+		h->source_count == (uint32_t)num_paths && h->bucket_count > 0 &&
+		h->sources_offset <= size && (size - h->sources_offset) / sizeof(hosts_source) >= h->source_count &&
+		h->displacements_offset <= size && (size - h->displacements_offset) / sizeof(uint32_t) >= h->bucket_count &&
+		h->entries_offset <= size && (size - h->entries_offset) / sizeof(hosts_entry) >= h->entry_count &&
+		h->strings_offset <= size && size - h->strings_offset >= h->strings_size &&
+		h->strings_size > 0 && ((const char *)map)[h->strings_offset + h->strings_size - 1] == '\0';
+
+	const hosts_source *sources = (const hosts_source *)((const char *)map + h->sources_offset);
+	const char *s = (const char *)map + h->strings_offset;
+	for (int i = 0; valid && i < num_paths; i++) {
+		valid = sources[i].path_offset < h->strings_size && strcmp(s + sources[i].path_offset, paths[i]) == 0 &&
+			sources[i].size == stats[i].st_size && sources[i].mtime_sec == stats[i].st_mtim.tv_sec &&
+			sources[i].mtime_nsec == stats[i].st_mtim.tv_nsec;
+	}
+	// every displacement must land inside the table, and every offset inside the strings
+	const uint32_t *d = (const uint32_t *)((const char *)map + h->displacements_offset);
+	const hosts_entry *e = (const hosts_entry *)((const char *)map + h->entries_offset);
+	for (uint32_t i = 0; valid && i < h->bucket_count; i++)
+		valid = d[i] < MAX_DISPLACEMENT;
+	for (uint32_t i = 0; valid && i < h->entry_count; i++)
+		valid = e[i].name_offset < h->strings_size && e[i].address_offset < h->strings_size;
+
+	if (!valid) {
+		munmap(map, st.st_size);
+		return HOSTS_FAILURE;
+	}
+	set_table(map, st.st_size, 1);
+	return HOSTS_SUCCESS;
+}
+
+static void save_cache(const char *cache_path)
+{
+	char tmp_path[strlen(cache_path) + 5];
+	sprintf(tmp_path, "%s.tmp", cache_path);
+
+	FILE *fp = fopen(tmp_path, "w");
+	if (!fp) {
+		fprintf(stderr, "Failed to write hosts cache %s.\n", cache_path);
+		return;
+	}
+	int failed = fwrite(table, 1, table_size, fp) != table_size;
+	if (fclose(fp) != 0 || failed || rename(tmp_path, cache_path) == -1) {
+		fprintf(stderr, "Failed to write hosts cache %s.\n", cache_path);
+		unlink(tmp_path);
+	}
+}
+
+int hosts_load(const char **paths, int num_paths, const char *cache_path)
+{
+	struct stat stats[num_paths];
+	for (int i = 0; i < num_paths; i++) {
+		if (stat(paths[i], &stats[i]) == -1) {
+			fprintf(stderr, "Failed to open hosts file %s.\n", paths[i]);
+			return HOSTS_FAILURE;
+		}
+	}
+
+	if (cache_path && load_cache(cache_path, paths, num_paths, stats) == HOSTS_SUCCESS)
+		return HOSTS_SUCCESS;
+
+	host_list list;
+	memset(&list, 0, sizeof(list));
+	int ret = HOSTS_SUCCESS;
+	for (int i = 0; i < num_paths && ret == HOSTS_SUCCESS; i++)
+		ret = parse_hosts_file(&list, paths[i]);
+	if (ret == HOSTS_SUCCESS)
+		ret = build_table(&list, paths, num_paths, stats);
+
+	for (size_t i = 0; i < list.count; i++) {
+		free(list.hosts[i].name);
+		free(list.hosts[i].address);
+	}
+	free(list.hosts);
+	free(list.seen);
+
+	if (ret == HOSTS_SUCCESS && cache_path)
+		save_cache(cache_path);
+	return ret;
+}
+
+int hosts_lookup(const char *hostname, char *ip_str, size_t size)
+{
+	if (!table || header->entry_count == 0)
+		return HOSTS_MISS;
+
+	char lowered[MAX_HOSTS_NAME_LENGTH];
+	lowercase(lowered, hostname, sizeof(lowered));
+	uint64_t hash = hash_name(lowered);
+
+	uint32_t d = displacements[bucket_of(hash, header->bucket_count)];
+	const hosts_entry *entry = &entries[slot_of(hash, d, header->entry_count)];
+	if (strcmp(strings + entry->name_offset, lowered) != 0)
+		return HOSTS_MISS;
+
+	snprintf(ip_str, size, "%s", strings + entry->address_offset);
+	return HOSTS_HIT;
+}
+
+void hosts_cleanup()
+{
+	if (table_mapped)
+		munmap((void *)table, table_size);
+	else
+		free((void *)table);
+	table = NULL;
+	table_size = 0;
+}
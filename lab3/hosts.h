@@ -0,0 +1,78 @@
+/*
+ * File: hosts.h
+ * Description:
+ * 	Static name map for multi-lookup --hosts. Hosts-format files
+ *	("address name [alias ...]", '#' comments) are loaded once at startup
+ *	into a minimal perfect hash, so a pinned name is answered with one
+ *	probe and one string comparison instead of a getaddrinfo call that
+ *	parses /etc/hosts again. Names compare case-insensitively, and the
+ *	first address given for a name wins, as in /etc/hosts.
+ *
+ *	The table is one contiguous block that can be saved to a cache file
+ *	and mapped back in on later runs. The cache records the size and
+ *	modification time of every source file and is rebuilt when any of
+ *	them changes.
+ */
+
+#ifndef HOSTS_H
+#define HOSTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOSTS_MAGIC "MLHOST1"
+#define HOSTS_VERSION 1
+
+#define HOSTS_FAILURE -1
+#define HOSTS_SUCCESS 0
+
+#define HOSTS_HIT 1
+#define HOSTS_MISS 0
+
+// average number of names sharing a displacement; larger is smaller but slower to build
+#define HOSTS_BUCKET_LOAD 4
+
+typedef struct hosts_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t source_count;
+	uint32_t entry_count;
+	uint32_t bucket_count;
+	uint64_t sources_offset;
+	uint64_t displacements_offset;
+	uint64_t entries_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+} hosts_header;
+
+// a file the table was built from, used to tell whether a cache is stale
+typedef struct hosts_source_s {
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t path_offset;
+	uint32_t reserved;
+} hosts_source;
+
+typedef struct hosts_entry_s {
+	uint32_t name_offset;
+	uint32_t address_offset;
+} hosts_entry;
+
+/* Function to build the table from the hosts files in paths
+ * If cache_path is not NULL, a current cache there is used instead of
+ * parsing, and a missing or stale one is rewritten
+ * Returns HOSTS_SUCCESS or HOSTS_FAILURE
+ */
+int hosts_load(const char **paths, int num_paths, const char *cache_path);
+
+/* Function to look up hostname
+ * Returns HOSTS_HIT and copies its address into ip_str, or HOSTS_MISS
+ * Thread-safe once hosts_load has returned
+ */
+int hosts_lookup(const char *hostname, char *ip_str, size_t size);
+
+/* Function to free the table */
+void hosts_cleanup();
+
+#endif
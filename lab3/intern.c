@@ -0,0 +1,250 @@
+/*
+ * File: intern.c
+ * Description:
+ * 	Sharded open-addressing hash set of hostnames. Each shard has its own
+ *	lock, table and slab chain, so threads interning different names
+ *	rarely contend. Names added by intern() live in the slabs; counted
+ *	names are allocated one at a time so the last release can free them.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "intern.h"
+
+#define INTERN_INITIAL_CAPACITY 1024
+// refs of a name bump-allocated from a slab
+#define REFS_IN_SLAB UINT_MAX
+// refs of a counted name that intern() has since returned, so it is kept until intern_cleanup
+#define REFS_PINNED (UINT_MAX - 1)
+
+typedef struct intern_slab_s intern_slab;
+
+struct intern_slab_s {
+	intern_slab *next;
+	size_t used;
+	char data[];
+};
+
+typedef struct intern_slot_s {
+	const char *string;
+	unsigned int hash;
+	// references taken by intern_acquire, or one of the REFS_ markers
+	unsigned int refs;
+} intern_slot;
+
+typedef struct intern_shard_s {
+	pthread_mutex_t lock;
+	intern_slot *slots;
+	// always a power of two, and kept at most half full
+	size_t capacity;
+	size_t count;
+	intern_slab *slabs;
+} __attribute__((aligned(64))) intern_shard;
+
+static intern_shard shards[INTERN_SHARDS] = {
+	[0 ... INTERN_SHARDS-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+
+static unsigned int hash_hostname(const char *hostname, size_t *length)
+{
+	// 32-bit FNV-1a
+	unsigned int hash = 2166136261u;
+	const unsigned char *p = (const unsigned char *)hostname;
+	for (; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	*length = p - (const unsigned char *)hostname;
+	return hash;
+}
+
+// must be called with the shard locked
+static char *slab_alloc(intern_shard *shard, size_t size)
+{
+	intern_slab *slab = shard->slabs;
+	if (!slab || slab->used + size > INTERN_SLAB_SIZE) {
+		slab = malloc(sizeof(intern_slab) + INTERN_SLAB_SIZE);
+		if (!slab)
+			return NULL;
+		slab->used = 0;
+		slab->next = shard->slabs;
+		shard->slabs = slab;
+	}
+
+	char *p = slab->data + slab->used;
+	slab->used += size;
+	return p;
+}
+
+// must be called with the shard locked
+static int grow_table(intern_shard *shard)
+{
+	size_t capacity = shard->capacity ? shard->capacity * 2 : INTERN_INITIAL_CAPACITY;
+	intern_slot *slots = calloc(capacity, sizeof(intern_slot));
+	if (!slots)
+		return -1;
+
+	for (size_t i = 0; i < shard->capacity; i++) {
+		if (!shard->slots[i].string)
+			continue;
+		size_t j = shard->slots[i].hash & (capacity - 1);
+		while (slots[j].string)
+			j = (j + 1) & (capacity - 1);
+		slots[j] = shard->slots[i];
+	}
+
+	free(shard->slots);
+	shard->slots = slots;
+	shard->capacity = capacity;
+	return 0;
+}
+
+// returns the slot holding hostname, or the empty slot it belongs in; NULL if the table cannot grow
+// must be called with the shard locked
+static intern_slot *find_slot(intern_shard *shard, const char *hostname, unsigned int hash)
+{
+	if ((shard->count + 1) * 2 > shard->capacity && grow_table(shard) == -1)
+		return NULL;
+
+	size_t i = hash & (shard->capacity - 1);
+	while (shard->slots[i].string) {
+		if (shard->slots[i].hash == hash && strcmp(shard->slots[i].string, hostname) == 0)
+			break;
+		i = (i + 1) & (shard->capacity - 1);
+	}
+	return &shard->slots[i];
+}
+
+// the top bits pick the shard, the bottom bits the slot within it
+static intern_shard *shard_of(unsigned int hash)
+{
+	return &shards[hash >> 28 & (INTERN_SHARDS - 1)];
+}
+
+const char *intern(const char *hostname)
+{
+	size_t length;
+	unsigned int hash = hash_hostname(hostname, &length);
+	intern_shard *shard = shard_of(hash);
+	const char *ret = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	intern_slot *slot = find_slot(shard, hostname, hash);
+	if (slot && slot->string) {
+		// the caller may keep it until shutdown
+		if (slot->refs != REFS_IN_SLAB)
+			slot->refs = REFS_PINNED;
+		ret = slot->string;
+	}
+	else if (slot) {
+		char *copy = slab_alloc(shard, length + 1);
+		if (copy) {
+			memcpy(copy, hostname, length + 1);
+			slot->string = copy;
+			slot->hash = hash;
+			slot->refs = REFS_IN_SLAB;
+			shard->count++;
+			ret = copy;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+const char *intern_acquire(const char *hostname)
+{
+	size_t length;
+	unsigned int hash = hash_hostname(hostname, &length);
+	intern_shard *shard = shard_of(hash);
+	const char *ret = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	intern_slot *slot = find_slot(shard, hostname, hash);
+	if (slot && slot->string) {
+		if (slot->refs < REFS_PINNED)
+			slot->refs++;
+		ret = slot->string;
+	}
+	else if (slot) {
+		char *copy = malloc(length + 1);
+		if (copy) {
+			memcpy(copy, hostname, length + 1);
+			slot->string = copy;
+			slot->hash = hash;
+			slot->refs = 1;
+			shard->count++;
+			ret = copy;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+// empties slot i, moving later slots of the same probe run back so lookups still find them
+// must be called with the shard locked
+static void remove_slot(intern_shard *shard, size_t i)
+{
+	size_t mask = shard->capacity - 1;
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (!shard->slots[j].string)
+			break;
+		// a slot may fill the hole only if its home is not between the hole and itself
+		size_t home = shard->slots[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			shard->slots[i] = shard->slots[j];
+			i = j;
+		}
+	}
+	shard->slots[i].string = NULL;
+	shard->count--;
+}
+
+void intern_release(const char *interned)
+{
+	size_t length;
+	unsigned int hash = hash_hostname(interned, &length);
+	intern_shard *shard = shard_of(hash);
+	char *freed = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	size_t i = hash & (shard->capacity - 1);
+	while (shard->slots[i].string != interned)
+		i = (i + 1) & (shard->capacity - 1);
+	intern_slot *slot = &shard->slots[i];
+	if (slot->refs < REFS_PINNED && --slot->refs == 0) {
+		freed = (char *)slot->string;
+		remove_slot(shard, i);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	free(freed);
+}
+
+void intern_cleanup()
+{
+	for (int i = 0; i < INTERN_SHARDS; i++) {
+		for (size_t j = 0; j < shards[i].capacity; j++) {
+			if (shards[i].slots[j].string && shards[i].slots[j].refs != REFS_IN_SLAB)
+				free((char *)shards[i].slots[j].string);
+		}
+		intern_slab *slab = shards[i].slabs;
+		while (slab) {
+			intern_slab *next = slab->next;
+			free(slab);
+			slab = next;
+		}
+		free(shards[i].slots);
+		shards[i].slabs = NULL;
+		shards[i].slots = NULL;
+		shards[i].capacity = 0;
+		shards[i].count = 0;
+	}
+}
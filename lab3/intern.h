@@ -0,0 +1,38 @@
+/*
+ * File: intern.h
+ * Description:
+ * 	Thread-safe hostname interning. Every distinct hostname is stored once,
+ *	bump-allocated from large slabs, and all stages of the pipeline (queue,
+ *	cache and output) share the same pointer for it. Strings from intern()
+ *	are never freed individually; intern_cleanup releases every slab at
+ *	once when the program shuts down. Long-running modes use
+ *	intern_acquire and intern_release instead, so a name is freed once no
+ *	job or cache entry refers to it any more.
+ */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#define INTERN_SHARDS 16
+#define INTERN_SLAB_SIZE (1024 * 1024)
+
+/* Function to return the interned copy of hostname, adding it if it is new
+ * Pointers returned for equal strings are equal, and stay valid until intern_cleanup
+ * Returns NULL if memory could not be allocated
+ */
+const char *intern(const char *hostname);
+
+/* Function to take a reference to the interned copy of hostname, adding it if it is new
+ * The pointer stays valid until the reference is dropped with intern_release; a name
+ * already added by intern() is returned as is and kept until intern_cleanup
+ * Returns NULL if memory could not be allocated
+ */
+const char *intern_acquire(const char *hostname);
+
+/* Function to drop a reference taken with intern_acquire, freeing the name with the last one */
+void intern_release(const char *interned);
+
+/* Function to free every interned string; no other thread may use them afterwards */
+void intern_cleanup();
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * File: journal.c
+ * Description:
+ * 	Implementation of the append-only progress journal.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#define JOURNAL_LINE_LENGTH 4352
+
+
+static journal_entry *find_entry(journal *j, const char *name)
+{
+	for (int i = 0; i < j->num_entries; i++) {
+		if (strcmp(j->entries[i].name, name) == 0)
+			return &j->entries[i];
+	}
+	return NULL;
+}
+
+static int set_entry(journal *j, const char *name, long offset, long output_length)
+{
+	journal_entry *entry = find_entry(j, name);
+	if (!entry) {
+		if (j->num_entries == j->capacity) {
+			int capacity = j->capacity ? j->capacity * 2 : 16;
+			journal_entry *entries = realloc(j->entries, capacity * sizeof(journal_entry));
+			if (!entries)
+				return JOURNAL_FAILURE;
+			j->entries = entries;
+			j->capacity = capacity;
+		}
+		entry = &j->entries[j->num_entries];
+		entry->name = strdup(name);
+		if (!entry->name)
+			return JOURNAL_FAILURE;
+		j->num_entries++;
+	}
+	entry->offset = offset;
+	entry->output_length = output_length;
+	return JOURNAL_SUCCESS;
+}
+
+static void apply_pending(journal *j, journal_entry *pending, int num_pending)
+{
+	for (int i = 0; i < num_pending; i++) {
+		set_entry(j, pending[i].name, pending[i].offset, pending[i].output_length);
+		free(pending[i].name);
+	}
+}
+
+// replays committed records; anything after the last commit is an interrupted write and is dropped
+static void load_entries(journal *j, FILE *fp)
+{
+	char line[JOURNAL_LINE_LENGTH];
+	journal_entry *pending = NULL;
+	int num_pending = 0;
+	int capacity = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		size_t length = strlen(line);
+		if (line[length-1] != '\n')
+			break;
+		line[length-1] = '\0';
+
+		if (strcmp(line, "C") == 0) {
+			apply_pending(j, pending, num_pending);
+			num_pending = 0;
+			continue;
+		}
+
+		long offset, output_length;
+		int name_start;
+		if (sscanf(line, "R %ld %ld %n", &offset, &output_length, &name_start) != 2)
+			break;
+
+		if (num_pending == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			journal_entry *grown = realloc(pending, capacity * sizeof(journal_entry));
+			if (!grown)
+				break;
+			pending = grown;
+		}
+		pending[num_pending].name = strdup(line + name_start);
+		pending[num_pending].offset = offset;
+		pending[num_pending].output_length = output_length;
+		if (pending[num_pending].name)
+			num_pending++;
+	}
+
+	for (int i = 0; i < num_pending; i++)
+		free(pending[i].name);
+	free(pending);
+}
+
+// rewrites the journal with one record per name, then swaps it into place
+static int compact(journal *j)
+{
+	size_t length = strlen(j->path);
+	char *tmp_path = malloc(length + 5);
+	if (!tmp_path)
+		return JOURNAL_FAILURE;
+	sprintf(tmp_path, "%s.tmp", j->path);
+
+	FILE *fp = fopen(tmp_path, "w");
+	if (!fp) {
+		free(tmp_path);
+		return JOURNAL_FAILURE;
+	}
+	for (int i = 0; i < j->num_entries; i++)
+		fprintf(fp, "R %ld %ld %s\n", j->entries[i].offset, j->entries[i].output_length, j->entries[i].name);
+	fprintf(fp, "C\n");
+
+	int ret = JOURNAL_SUCCESS;
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		ret = JOURNAL_FAILURE;
+	fclose(fp);
+	if (ret == JOURNAL_SUCCESS && rename(tmp_path, j->path) != 0)
+		ret = JOURNAL_FAILURE;
+
+	free(tmp_path);
+	return ret;
+}
+
+int journal_open(journal *j, const char *path)
+{
+	memset(j, 0, sizeof(journal));
+	pthread_mutex_init(&j->lock, NULL);
+
+	j->path = strdup(path);
+	if (!j->path)
+		return JOURNAL_FAILURE;
+
+	FILE *fp = fopen(path, "r");
+	if (fp) {
+		load_entries(j, fp);
+		fclose(fp);
+	}
+
+	if (compact(j) == JOURNAL_FAILURE) {
+		perror("Error compacting journal");
+		return JOURNAL_FAILURE;
+	}
+
+	j->fp = fopen(path, "a");
+	if (!j->fp) {
+		perror("Error opening journal");
+		return JOURNAL_FAILURE;
+	}
+	return JOURNAL_SUCCESS;
+}
+
+int journal_find(journal *j, const char *name, long *offset, long *output_length)
+{
+	pthread_mutex_lock(&j->lock);
+	journal_entry *entry = find_entry(j, name);
+	if (entry) {
+		*offset = entry->offset;
+		*output_length = entry->output_length;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return entry != NULL;
+}
+
+int journal_record(journal *j, const char *name, long offset, long output_length)
+{
+	// names are stored one per line
+	if (strchr(name, '\n'))
+		return JOURNAL_FAILURE;
+
+	pthread_mutex_lock(&j->lock);
+	int ret = set_entry(j, name, offset, output_length);
+	if (ret == JOURNAL_SUCCESS && fprintf(j->fp, "R %ld %ld %s\n", offset, output_length, name) < 0)
+		ret = JOURNAL_FAILURE;
+	pthread_mutex_unlock(&j->lock);
+	return ret;
+}
+
+int journal_commit(journal *j)
+{
+	pthread_mutex_lock(&j->lock);
+	int ret = JOURNAL_SUCCESS;
+	// flushed to the kernel, so the commit survives the process crashing
+	if (fprintf(j->fp, "C\n") < 0 || fflush(j->fp) != 0)
+		ret = JOURNAL_FAILURE;
+	pthread_mutex_unlock(&j->lock);
+	return ret;
+}
+
+void journal_close(journal *j)
+{
+	if (j->fp)
+		fclose(j->fp);
+	for (int i = 0; i < j->num_entries; i++)
+		free(j->entries[i].name);
+	free(j->entries);
+	free(j->path);
+	pthread_mutex_destroy(&j->lock);
+}
@@ -0,0 +1,64 @@
+/*
+ * File: journal.h
+ * Description:
+ * 	Append-only progress journal. Each record says that every hostname
+ *	before byte offset in input file name has been resolved, and that the
+ *	matching results end at byte output_length of the output file. Records
+ *	only take effect once a commit follows them, so a group of records
+ *	written together is applied all or nothing. The journal is compacted
+ *	to one record per name each time it is opened.
+ *
+ *	On-disk format, one entry per line:
+ *	  R <offset> <output_length> <name>
+ *	  C
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define JOURNAL_FAILURE -1
+#define JOURNAL_SUCCESS 0
+
+typedef struct journal_entry_s {
+	char *name;
+	long offset;
+	long output_length;
+} journal_entry;
+
+typedef struct journal_s {
+	char *path;
+	FILE *fp;
+	journal_entry *entries;
+	int num_entries;
+	int capacity;
+	pthread_mutex_t lock;
+} journal;
+
+/* Function to load the committed state of the journal at path, if any,
+ * and open it for further records
+ * Returns JOURNAL_SUCCESS or JOURNAL_FAILURE
+ */
+int journal_open(journal *j, const char *path);
+
+/* Function to look up the most recent record for name
+ * Returns 1 and fills offset and output_length if found, 0 otherwise
+ */
+int journal_find(journal *j, const char *name, long *offset, long *output_length);
+
+/* Function to append a record for name; it takes effect at the next commit
+ * Returns JOURNAL_SUCCESS or JOURNAL_FAILURE
+ */
+int journal_record(journal *j, const char *name, long offset, long output_length);
+
+/* Function to commit every record written since the last commit
+ * Returns JOURNAL_SUCCESS or JOURNAL_FAILURE
+ */
+int journal_commit(journal *j);
+
+/* Function to close the journal and free its memory */
+void journal_close(journal *j);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * File: multi-lookup-coro.cpp
+ * Description:
+ * 	The multi-lookup pipeline on the coroutine runtime in coro.hpp.
+ *	One reader task per input file pushes interned hostnames into a
+ *	bounded AsyncQueue; a dispatcher task pops them and spawns one lookup
+ *	task per hostname, with at most MAX_IN_FLIGHT outstanding. Each lookup
+ *	sends its own UDP query through coro::Resolver and suspends until the
+ *	reply arrives, so a suspended lookup costs only its coroutine frame and
+ *	a query slot, and no thread.
+ *
+ *	Build with "make coro"; usage matches multi-lookup:
+ *	./multi-lookup-coro [--workers N] [--dns <server>] <input files...> <results-file>
+ *	The server defaults to the first nameserver in /etc/resolv.conf.
+ */
+
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+extern "C" {
+#include "cache.h"
+#include "dnstcp.h"
+#include "intern.h"
+}
+#include "coro.hpp"
+
+static const int MIN_ARGS = 3;
+static const int MAX_INPUT_FILES = 10;
+static const int DEFAULT_WORKERS = 4;
+static const size_t QUEUE_CAPACITY = 4096;
+static const long MAX_IN_FLIGHT = coro::RESOLVER_MAX_IN_FLIGHT;
+static const char *RESOLV_CONF = "/etc/resolv.conf";
+static const char *FALLBACK_SERVER = "127.0.0.1";
+#define MAX_NAME_LENGTH 1025
+#define READ_CHUNK_SIZE (64 * 1024)
+
+static FILE *output_fp;
+static std::mutex lock_output_file;
+
+
+// the first nameserver line that parses, as the libc resolver would use, or FALLBACK_SERVER as it would without one
+static void default_server(struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+	FILE *fp = fopen(RESOLV_CONF, "r");
+	if (fp) {
+		char line[256];
+		char server[INET6_ADDRSTRLEN + 2];
+		while (fgets(line, sizeof(line), fp)) {
+			// an IPv6 address is given without brackets, so it is bracketed before the port is looked for
+			if (sscanf(line, " nameserver %45s", server + 1) == 1) {
+				server[0] = '[';
+				strcat(server, "]");
+				if (dnstcp_parse_server(server, addr, addr_len) == DNSTCP_SUCCESS) {
+					fclose(fp);
+					return;
+				}
+			}
+		}
+		fclose(fp);
+	}
+	dnstcp_parse_server(FALLBACK_SERVER, addr, addr_len);
+}
+
+static coro::Task lookup(coro::Resolver &resolver, coro::Semaphore &in_flight, const char *hostname)
+{
+	char ip_str[INET6_ADDRSTRLEN];
+	if (cache_lookup(hostname, ip_str, sizeof(ip_str)) == CACHE_MISS) {
+		co_await resolver.resolve(hostname, ip_str, sizeof(ip_str));
+		cache_insert(hostname, ip_str);
+	}
+
+	if (ip_str[0] == '\0')
+		fprintf(stderr, "DNS lookup error: %s\n", hostname);
+
+	{
+		std::lock_guard<std::mutex> guard(lock_output_file);
+		fprintf(output_fp, "%s,%s\n", hostname, ip_str);
+	}
+	in_flight.release();
+}
+
+static coro::Task dispatch(coro::Scheduler &scheduler, coro::Resolver &resolver,
+			  coro::AsyncQueue<const char *> &names, coro::Semaphore &in_flight)
+{
+	while (auto hostname = co_await names.pop()) {
+		co_await in_flight.acquire();
+		scheduler.spawn(lookup(resolver, in_flight, *hostname));
+	}
+	// every permit back means every lookup has finished with the resolver
+	for (long i = 0; i < MAX_IN_FLIGHT; i++)
+		co_await in_flight.acquire();
+	resolver.close();
+}
+
+// splits input on whitespace like fscanf("%1024s"), so longer names are cut the same way
+static coro::Task read_input(coro::Scheduler &scheduler, coro::AsyncQueue<const char *> &names,
+			     std::atomic<int> &active_readers, const char *input_filename)
+{
+	// opening a FIFO waits for its writer, as fopen does; only reads afterwards are non-blocking
+	int fd = open(input_filename, O_RDONLY);
+	if (fd != -1)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (fd == -1)
+		fprintf(stderr, "Failed to open input file %s.\n", input_filename);
+	else {
+		char chunk[READ_CHUNK_SIZE];
+		char hostname[MAX_NAME_LENGTH];
+		size_t length = 0;
+		while (true) {
+			ssize_t n = read(fd, chunk, sizeof(chunk));
+			if (n == -1 && errno == EAGAIN) {
+				// a FIFO with nothing written yet
+				co_await scheduler.readable(fd);
+				continue;
+			}
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+
+			for (ssize_t i = 0; i < n; i++) {
+				bool space = isspace((unsigned char)chunk[i]);
+				if (!space)
+					hostname[length++] = chunk[i];
+				if ((space && length > 0) || length == MAX_NAME_LENGTH - 1) {
+					hostname[length] = '\0';
+					length = 0;
+					const char *interned = intern(hostname);
+					if (interned)
+						co_await names.push(interned);
+					else
+						fprintf(stderr, "Failed to allocate job for %s.\n", hostname);
+				}
+			}
+		}
+		if (length > 0) {
+			hostname[length] = '\0';
+			const char *interned = intern(hostname);
+			if (interned)
+				co_await names.push(interned);
+		}
+		close(fd);
+	}
+
+	if (active_readers.fetch_sub(1) == 1)
+		names.close();
+}
+
+int main(int argc, char **argv)
+{
+	int workers = DEFAULT_WORKERS;
+	const char *server = NULL;
+	while (argc > 2) {
+		if (strcmp(argv[1], "--workers") == 0) {
+			workers = atoi(argv[2]);
+			if (workers < 1) {
+				fprintf(stderr, "--workers must be at least 1.\n");
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[1], "--dns") == 0)
+			server = argv[2];
+		else
+			break;
+		argv += 2;
+		argc -= 2;
+	}
+
+	struct sockaddr_storage server_addr;
+	socklen_t server_addr_len;
+	if (!server)
+		default_server(&server_addr, &server_addr_len);
+	else if (dnstcp_parse_server(server, &server_addr, &server_addr_len) == DNSTCP_FAILURE) {
+		fprintf(stderr, "Invalid DNS server %s.\n", server);
+		return EXIT_FAILURE;
+	}
+
+	if (argc < MIN_ARGS) {
+		fprintf(stderr, "Requires at least %d arguments: the executable, one or more input files, and the results filename.\n", MIN_ARGS);
+		return EXIT_FAILURE;
+	}
+
+	if (argc > MAX_INPUT_FILES + 2) {
+		fprintf(stderr, "There cannot be more than %d input files. Please try again with less input files.\n", MAX_INPUT_FILES);
+		return EXIT_FAILURE;
+	}
+
+	output_fp = fopen(argv[argc-1], "w");
+	if (!output_fp) {
+		fprintf(stderr, "Failed to open specified output file.\n");
+		return EXIT_FAILURE;
+	}
+
+	coro::Scheduler scheduler(workers);
+	coro::Resolver resolver(scheduler);
+	if (!resolver.start((struct sockaddr *)&server_addr, server_addr_len)) {
+		perror("Failed to set up resolver");
+		return EXIT_FAILURE;
+	}
+	coro::AsyncQueue<const char *> names(scheduler, QUEUE_CAPACITY);
+	coro::Semaphore in_flight(scheduler, MAX_IN_FLIGHT);
+	std::atomic<int> active_readers(argc - 2);
+
+	for (int i = 1; i < argc-1; i++)
+		scheduler.spawn(read_input(scheduler, names, active_readers, argv[i]));
+	scheduler.spawn(dispatch(scheduler, resolver, names, in_flight));
+	scheduler.run();
+
+	fclose(output_fp);
+	cache_cleanup();
+	intern_cleanup();
+	return EXIT_SUCCESS;
+}
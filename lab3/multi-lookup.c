@@ -1,34 +1,275 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h>
+#include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "util.h"
-#include "queue.h"
+#include "bqueue.h"
+#include "cache.h"
+#include "intern.h"
+#include "daemon.h"
+#include "stream.h"
+#include "watch.h"
+#include "checkpoint.h"
+#include "results-index.h"
+#include "outsink.h"
+#include "affinity.h"
+#include "uring.h"
+#include "hosts.h"
+#include "dedup.h"
+#include "dnstcp.h"
 #include "multi-lookup.h"
 
 static const int MIN_ARGS = 3;
 static const int MAX_INPUT_FILES = 10;
-static const int NUM_RESOLVER_THREADS = 6;
-static const int MAX_NAME_LENGTH = 1025;
+#define MAX_HOSTS_FILES 16
+#define NUM_RESOLVER_THREADS 6
 static const char INPUT_FS[] = "%1024s";
+static const char JOURNAL_SUFFIX[] = ".journal";
 
-queue q;
+typedef struct requester_s {
+	char *input_filename;
+	int checkpoint_slot;
+	// where to start reading, when resuming an interrupted run
+	long offset;
+} requester;
+
+// the queue itself is lock-free; lock_queue is only taken to sleep on it or to wake a sleeper
+bqueue *q;
 pthread_mutex_t lock_queue;
+// resolvers wait on queue_not_empty, requesters wait on queue_not_full
+// this replaces sleeping for a random interval, so a job is picked up as soon as it is pushed
+pthread_cond_t queue_not_empty;
+pthread_cond_t queue_not_full;
+// threads sleeping on each condition, so pushes and pops only lock when someone needs waking
+int waiting_resolvers = 0;
+int waiting_requesters = 0;
 
 FILE *output_fp;
 pthread_mutex_t lock_output_file;
+// set when the results should also be written as an index (see results-index.h)
+const char *index_filename = NULL;
+// set when results are compressed; output_fp is unused in that case
+output_sink *output_sink_p = NULL;
+// set when uncompressed results are written through io_uring; output_fp is unused in that case
+uring_writer *output_uring_p = NULL;
+// set when input files are read through io_uring
+int use_uring = 0;
+// set when names missing from the hosts files and cache are looked up over TCP (see dnstcp.h)
+int use_dns_tcp = 0;
+// set when each distinct name is resolved once and its result fanned out (see dedup.h)
+int use_dedup = 0;
+// set by the long-running modes, whose jobs hold counted names that are freed once unused (see intern.h)
+int use_counted_names = 0;
 
 // this variable is used to detect if any requester threads running
 // this is useful when the queue is empty -- only when there are no requester threads running
 // can a resolver thread exit
 int num_active_requesters = 0;
-pthread_mutex_t lock_active_requesters;
 
+pthread_t resolver_threads[NUM_RESOLVER_THREADS];
+
+static void init_pipeline()
+{
+	q = bqueue_create();
+	if (!q) {
+		fprintf(stderr, "Failed to allocate the job queue.\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&lock_queue, NULL);
+	pthread_cond_init(&queue_not_empty, NULL);
+	pthread_cond_init(&queue_not_full, NULL);
+	pthread_mutex_init(&lock_output_file, NULL);
+}
+
+void start_resolvers()
+{
+	// a static number of resolver threads are created, given by NUM_RESOLVER_THREADS
+	for (int i = 0; i < NUM_RESOLVER_THREADS; i++) {
+		pthread_create(&resolver_threads[i], NULL, resolver_entry_point, NULL);
+	}
+}
+
+void join_resolvers()
+{
+	// all requesters must be complete before resolver threads exit
+	for (int i = 0; i < NUM_RESOLVER_THREADS; i++) {
+		pthread_join(resolver_threads[i], NULL);
+	}
+	// the last jobs a resolver handed to the TCP backend may still be waiting for their answers
+	if (use_dns_tcp)
+		dnstcp_drain();
+}
+
+// makes everything written so far durable in the output file, and returns its length
+static long sync_output()
+{
+	pthread_mutex_lock(&lock_output_file);
+	long length;
+	if (output_sink_p)
+		length = sink_sync(output_sink_p);
+	else if (output_uring_p)
+		length = uring_writer_sync(output_uring_p);
+	else {
+		fflush(output_fp);
+		length = ftell(output_fp);
+	}
+	pthread_mutex_unlock(&lock_output_file);
+	return length;
+}
+
+static void index_existing_results(const char *output_filename)
+{
+	FILE *fp = fopen(output_filename, "r");
+	if (!fp)
+		return;
 
+	char line[MAX_NAME_LENGTH + INET6_ADDRSTRLEN + 2];
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		// hostnames cannot contain commas, so the last one separates the address
+		char *comma = strrchr(line, ',');
+		if (!comma)
+			continue;
+		*comma = '\0';
+		const char *hostname = intern(line);
+		if (hostname)
+			index_add(hostname, comma + 1);
+	}
+	fclose(fp);
+}
 
 int main(int argc, char **argv)
 {
+	// placement and static names apply to every mode, so they are taken before the mode is chosen
+	const char *hosts_files[MAX_HOSTS_FILES];
+	int num_hosts_files = 0;
+	const char *hosts_cache = NULL;
+	while (argc > 2) {
+		if (strcmp(argv[1], "--cpus") == 0) {
+			if (affinity_init(argv[2]) == AFFINITY_FAILURE) {
+				fprintf(stderr, "Invalid CPU placement %s; use compact, scatter or a list such as 0,2,4-7.\n", argv[2]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if (strcmp(argv[1], "--hosts") == 0) {
+			if (num_hosts_files == MAX_HOSTS_FILES) {
+				fprintf(stderr, "There cannot be more than %d hosts files.\n", MAX_HOSTS_FILES);
+				return EXIT_FAILURE;
+			}
+			hosts_files[num_hosts_files++] = argv[2];
+		}
+		else if (strcmp(argv[1], "--hosts-cache") == 0)
+			hosts_cache = argv[2];
+		else if (strcmp(argv[1], "--dns-tcp") == 0) {
+			if (dnstcp_init(argv[2]) == DNSTCP_FAILURE) {
+				fprintf(stderr, "Failed to connect to DNS server %s over TCP.\n", argv[2]);
+				return EXIT_FAILURE;
+			}
+			use_dns_tcp = 1;
+		}
+		else
+			break;
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (hosts_cache && num_hosts_files == 0) {
+		fprintf(stderr, "--hosts-cache needs at least one --hosts file.\n");
+		return EXIT_FAILURE;
+	}
+	if (num_hosts_files > 0 && hosts_load(hosts_files, num_hosts_files, hosts_cache) == HOSTS_FAILURE) {
+		fprintf(stderr, "Failed to load hosts files.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 3 && strcmp(argv[1], "--daemon") == 0) {
+		// the daemon counts as a requester that never finishes, so resolvers stay alive between batches
+		use_counted_names = 1;
+		init_pipeline();
+		increment_requesters();
+		start_resolvers();
+		return run_daemon(argv[2]);
+	}
+
+	if (argc == 4 && strcmp(argv[1], "--watch") == 0) {
+		// like the daemon, the watcher never finishes requesting
+		use_counted_names = 1;
+		init_pipeline();
+		increment_requesters();
+		start_resolvers();
+		return run_watch(argv[2], argv[3]);
+	}
+
+	if ((argc == 2 || argc == 3) && strcmp(argv[1], "--stream") == 0) {
+		FILE *input_fp = stdin;
+		if (argc == 3) {
+			input_fp = fopen(argv[2], "r");
+			if (!input_fp) {
+				fprintf(stderr, "Failed to open input stream %s.\n", argv[2]);
+				return EXIT_FAILURE;
+			}
+		}
+
+		// the stream counts as a single requester until its input ends
+		use_counted_names = 1;
+		init_pipeline();
+		increment_requesters();
+		start_resolvers();
+		int ret = run_stream(input_fp);
+
+		if (input_fp != stdin)
+			fclose(input_fp);
+		bqueue_destroy(q);
+		dnstcp_cleanup();
+		cache_cleanup();
+		intern_cleanup();
+		hosts_cleanup();
+		return ret;
+	}
+
+	// resuming picks up from the last checkpoint, rather than starting the output over
+	int resume = 0;
+	int compress = 0;
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--resume") == 0)
+			resume = 1;
+		else if (strcmp(argv[1], "--compress") == 0)
+			compress = 1;
+		else if (strcmp(argv[1], "--uring") == 0)
+			use_uring = 1;
+		else if (strcmp(argv[1], "--dedup") == 0)
+			use_dedup = 1;
+		else if (strcmp(argv[1], "--index") == 0 && argc > 2) {
+			index_filename = argv[2];
+			argv++;
+			argc--;
+		}
+		else {
+			fprintf(stderr, "Unknown option %s.\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		argv++;
+		argc--;
+	}
+
+	if (compress && !sink_supported()) {
+		fprintf(stderr, "This build has no compression support; rebuild with make COMPRESS=zlib or COMPRESS=zstd.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (use_uring && !uring_supported()) {
+		fprintf(stderr, "io_uring is not available on this system.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (compress && resume && index_filename) {
+		fprintf(stderr, "--index cannot be combined with --resume for compressed results.\n");
+		return EXIT_FAILURE;
+	}
+
 	if (argc < MIN_ARGS) {
 		fprintf(stderr, "Requires at least %d arguments: the executable, one or more input files, and the results filename.\n", MIN_ARGS);
 		return EXIT_FAILURE;
@@ -40,16 +281,39 @@ int main(int argc, char **argv)
 	}
 
 	char *output_filename = argv[argc-1];
-	output_fp = fopen(output_filename, "w");
-	if (!output_fp) {
+	char journal_filename[strlen(output_filename) + sizeof(JOURNAL_SUFFIX)];
+	sprintf(journal_filename, "%s%s", output_filename, JOURNAL_SUFFIX);
+	if (checkpoint_open(journal_filename, resume) == CHECKPOINT_FAILURE) {
+		fprintf(stderr, "Failed to open checkpoint journal %s.\n", journal_filename);
+		return EXIT_FAILURE;
+	}
+
+	// anything after the last checkpoint is dropped, since those names will be resolved again
+	// compressed checkpoints end on a member/frame boundary, so the same truncation works for both
+	int output_fd = open(output_filename, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+	if (output_fd == -1 || (resume && ftruncate(output_fd, checkpoint_output_length()) == -1) ||
+	    lseek(output_fd, 0, SEEK_END) == -1 ||
+	    (compress ? !(output_sink_p = sink_open(output_fd)) :
+	     use_uring ? !(output_uring_p = uring_writer_open(output_fd)) : !(output_fp = fdopen(output_fd, "w")))) {
 		fprintf(stderr, "Failed to open specified output file.\n");
 		return EXIT_FAILURE;
 	}
+	// results kept from before the checkpoint belong in the index too
+	if (index_filename && resume)
+		index_existing_results(output_filename);
 
-	queue_init(&q, QUEUEMAXSIZE);
-	pthread_mutex_init(&lock_queue, NULL);
-	pthread_mutex_init(&lock_output_file, NULL);
-	pthread_mutex_init(&lock_active_requesters, NULL);
+	init_pipeline();
+
+	requester requesters[argc-2];
+	for (int i = 1; i < argc-1; i++) {
+		requesters[i-1].input_filename = argv[i];
+		requesters[i-1].checkpoint_slot = checkpoint_add_requester(i, argv[i], &requesters[i-1].offset);
+		if (requesters[i-1].checkpoint_slot == CHECKPOINT_FAILURE) {
+			fprintf(stderr, "Failed to set up checkpoints for %s.\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+	checkpoint_start(sync_output);
 
 	// one requester thread is created for each input file
 	// the resolvers threads will be started in the detatched state, so memory cleanup via join is not necessary for them
@@ -60,122 +324,281 @@ int main(int argc, char **argv)
 	pthread_t requester_threads[argc-2];
 	for (int i = 1; i < argc-1; i++) {
 		increment_requesters();
-		pthread_create(&requester_threads[i-1], &attr, requester_entry_point, argv[i]);
+		pthread_create(&requester_threads[i-1], &attr, requester_entry_point, &requesters[i-1]);
 	}
 
-	// a static number of resolver threads are created, given by NUM_RESOLVER_THREADS
-	pthread_t resolver_threads[NUM_RESOLVER_THREADS];
-	for (int i = 0; i < NUM_RESOLVER_THREADS; i++) {
-		pthread_create(&resolver_threads[i], NULL, resolver_entry_point, NULL);
-	}
+	start_resolvers();
 
 	// exiting main exits entire program, so only do so after all threads have completed
 	// all requester threads must be complete before resolver threads exit, so we can just check resolver threads
-	for (int i = 0; i < NUM_RESOLVER_THREADS; i++) {
-		pthread_join(resolver_threads[i], NULL);
-	}
+	join_resolvers();
 
 	// at this point, the main thread is the only remaining thread, so access to resources does not have to be protected
-	fclose(output_fp);
-	queue_cleanup(&q);
+	checkpoint_finish();
+	int close_failed;
+	if (output_sink_p)
+		close_failed = sink_close(output_sink_p) == -1;
+	else if (output_uring_p)
+		close_failed = uring_writer_close(output_uring_p) == -1;
+	else
+		close_failed = fclose(output_fp) == EOF;
+	if (close_failed) {
+		fprintf(stderr, "Failed to write results to %s.\n", output_filename);
+		return EXIT_FAILURE;
+	}
+	if (index_filename && index_write(index_filename) == INDEX_FAILURE) {
+		fprintf(stderr, "Failed to write index file %s.\n", index_filename);
+		return EXIT_FAILURE;
+	}
+	// the last checkpoint is kept until here, in case the results could not be written out
+	if (unlink(journal_filename) == -1)
+		perror("Error removing checkpoint journal");
+	bqueue_destroy(q);
+	dnstcp_cleanup();
+	dedup_cleanup();
+	cache_cleanup();
+	intern_cleanup();
+	hosts_cleanup();
 }
 
 void increment_requesters() {
-	pthread_mutex_lock(&lock_active_requesters);
-	num_active_requesters++;
-	pthread_mutex_unlock(&lock_active_requesters);
+	__atomic_add_fetch(&num_active_requesters, 1, __ATOMIC_RELEASE);
 }
 
 void decrement_requesters() {
-	pthread_mutex_lock(&lock_active_requesters);
-	num_active_requesters--;
-	pthread_mutex_unlock(&lock_active_requesters);
+	// release, so jobs pushed before this are seen by a resolver that sees the new count
+	__atomic_sub_fetch(&num_active_requesters, 1, __ATOMIC_RELEASE);
+
+	// wake any idle resolvers so they can notice there is nothing left to wait for
+	pthread_mutex_lock(&lock_queue);
+	pthread_cond_broadcast(&queue_not_empty);
+	pthread_mutex_unlock(&lock_queue);
 }
 
 int requesters_are_running() {
-	// don't surround this with lock because it is simply a real-time update of value
-	return num_active_requesters > 0;
+	// the count is atomic, so no lock is needed to read it
+	return __atomic_load_n(&num_active_requesters, __ATOMIC_ACQUIRE) > 0;
+}
+
+lookup_job *create_job(const char *hostname, lookup_callback on_resolved, void *context)
+{
+	// every occurrence of a hostname shares one interned copy
+	const char *interned = use_counted_names ? intern_acquire(hostname) : intern(hostname);
+	if (!interned)
+		return NULL;
+
+	lookup_job *job = malloc(sizeof(lookup_job));
+	if (!job) {
+		if (use_counted_names)
+			intern_release(interned);
+		return NULL;
+	}
+
+	job->hostname = interned;
+	job->on_resolved = on_resolved;
+	job->context = context;
+	return job;
+}
+
+// wakes one thread sleeping on cond, if there is any
+// a sleeper counts itself in waiting before its last look at the queue, so either it sees
+// the change that was just made, or this sees it and signals once it is asleep
+static void wake_one(int *waiting, pthread_cond_t *cond)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&lock_queue);
+		pthread_cond_signal(cond);
+		pthread_mutex_unlock(&lock_queue);
+	}
+}
+
+void submit_job(lookup_job *job)
+{
+	if (bqueue_push(q, job) == BQUEUE_FAILURE) {
+		pthread_mutex_lock(&lock_queue);
+		__atomic_add_fetch(&waiting_requesters, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (bqueue_push(q, job) == BQUEUE_FAILURE) {
+			pthread_cond_wait(&queue_not_full, &lock_queue);
+		}
+		__atomic_sub_fetch(&waiting_requesters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&lock_queue);
+	}
+	wake_one(&waiting_resolvers, &queue_not_empty);
+}
+
+static void write_result(const char *hostname, const char *ip_str)
+{
+	// write to output file and protect this operation
+	if (output_sink_p || output_uring_p) {
+		char line[MAX_NAME_LENGTH + INET6_ADDRSTRLEN + 2];
+		int length = snprintf(line, sizeof(line), "%s,%s\n", hostname, ip_str);
+		pthread_mutex_lock(&lock_output_file);
+		if (output_sink_p)
+			sink_write(output_sink_p, line, length);
+		else
+			uring_writer_write(output_uring_p, line, length);
+		pthread_mutex_unlock(&lock_output_file);
+	}
+	else {
+		pthread_mutex_lock(&lock_output_file);
+		fprintf(output_fp, "%s,%s\n", hostname, ip_str);
+		pthread_mutex_unlock(&lock_output_file);
+	}
+
+	if (index_filename)
+		index_add(hostname, ip_str);
+
+	checkpoint_written();
 }
 
-void sleep_random()
+static void write_result_to_file(lookup_job *job, const char *ip_str)
 {
-	// sleep randomly between 0 and 100 ms
-	int ms_to_sleep = rand() % 101;
+	write_result(job->hostname, ip_str);
+}
 
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = ms_to_sleep * 1000000;
-	nanosleep(&ts, NULL);
+// one lookup stands for every occurrence of the name read so far
+static void fan_out_result(lookup_job *job, const char *ip_str)
+{
+	dedup_resolve((dedup_entry *)job->context, ip_str, write_result);
 }
 
+// registers one occurrence of hostname for --dedup
+// returns the job to queue if this is the first occurrence, otherwise NULL
+static lookup_job *dedup_job(const char *hostname)
+{
+	const char *interned = intern(hostname);
+	dedup_entry *entry;
+	char ip_str[INET6_ADDRSTRLEN];
+	switch (interned ? dedup_add(interned, &entry, ip_str, sizeof(ip_str)) : DEDUP_FAILURE) {
+	case DEDUP_NEW: {
+		lookup_job *job = create_job(dedup_key(entry), fan_out_result, entry);
+		if (!job) {
+			// later occurrences are waiting on this entry, so it is settled with an empty result
+			fprintf(stderr, "Failed to allocate job for %s.\n", hostname);
+			dedup_resolve(entry, "", write_result);
+		}
+		return job;
+	}
+	case DEDUP_RESOLVED:
+		write_result(interned, ip_str);
+		return NULL;
+	case DEDUP_PENDING:
+		// written by fan_out_result when the first occurrence is resolved
+		return NULL;
+	default:
+		fprintf(stderr, "Failed to record %s.\n", hostname);
+		checkpoint_written();
+		return NULL;
+	}
+}
 
 void *requester_entry_point(void *void_ptr)
 {
-	char *input_filename = (char *)void_ptr;
-	FILE *input_fp = fopen(input_filename, "r");
+	requester *self = (requester *)void_ptr;
+	affinity_pin_self();
+	FILE *input_fp = use_uring ? uring_fopen(self->input_filename) : fopen(self->input_filename, "r");
 	if (!input_fp) {
-		fprintf(stderr, "Failed to open input file %s.\n", input_filename);
+		fprintf(stderr, "Failed to open input file %s.\n", self->input_filename);
+		checkpoint_requester_done(self->checkpoint_slot, NULL);
 		decrement_requesters();
 		return NULL;
 	}
+	// names before the resume offset were resolved by an earlier run
+	fseek(input_fp, self->offset, SEEK_SET);
 
-	// put hostnames on heap so they're accessible even after hostname is redefined
-	char *hostname = malloc(sizeof(char) * MAX_NAME_LENGTH);
+	// each job refers to an interned copy of the hostname, so this buffer can be reused
+	char hostname[MAX_NAME_LENGTH];
 	while (fscanf(input_fp, INPUT_FS, hostname) > 0) {
-		// access to queue must be protected
-		pthread_mutex_lock(&lock_queue);
-		while (queue_push(&q, hostname) == QUEUE_FAILURE) {
-			pthread_mutex_unlock(&lock_queue);
-			sleep_random();
-			pthread_mutex_lock(&lock_queue);
+		if (use_dedup) {
+			// every occurrence is written once, so every occurrence is counted as submitted
+			checkpoint_submitted();
+			lookup_job *job = dedup_job(hostname);
+			if (job)
+				submit_job(job);
+			checkpoint_safe_point(self->checkpoint_slot, input_fp);
+			continue;
 		}
-		pthread_mutex_unlock(&lock_queue);
-		hostname = malloc(sizeof(char) * MAX_NAME_LENGTH);
+		lookup_job *job = create_job(hostname, write_result_to_file, NULL);
+		if (!job) {
+			fprintf(stderr, "Failed to allocate job for %s.\n", hostname);
+			continue;
+		}
+		checkpoint_submitted();
+		submit_job(job);
+		checkpoint_safe_point(self->checkpoint_slot, input_fp);
 	}
-	// last hostname will not be used in queue, so it can be freed
-	free(hostname);
 
+	checkpoint_requester_done(self->checkpoint_slot, input_fp);
 	fclose(input_fp);
 
 	decrement_requesters();
 	return NULL;
 }
 
+static void finish_job(lookup_job *job, const char *ip_str)
+{
+	if (ip_str[0] == '\0')
+		fprintf(stderr, "DNS lookup error: %s\n", job->hostname);
+
+	job->on_resolved(job, ip_str);
+
+	// in batch runs the hostname is interned until shutdown; otherwise the cache holds it if it still needs it
+	if (use_counted_names)
+		intern_release(job->hostname);
+	free(job);
+}
+
+static void finish_tcp_lookup(void *context, const char *ip_str)
+{
+	lookup_job *job = (lookup_job *)context;
+	cache_insert(job->hostname, ip_str);
+	finish_job(job, ip_str);
+}
+
 void *resolver_entry_point()
 {
+	affinity_pin_self();
 	while (1) {
-		// access to queue must be protected
-		pthread_mutex_lock(&lock_queue);
-		char *hostname = (char *)queue_pop(&q);
-		pthread_mutex_unlock(&lock_queue);
-
-		if (hostname == NULL) {
+		lookup_job *job = (lookup_job *)bqueue_pop(q);
+		if (job == NULL) {
 			// queue is empty
-			// if there are still requesters running, sleep and wait for them to fill up queue
-			// otherwise, exit
-			if (!requesters_are_running()) {
-				return NULL;
-			}
-			else {
-				sleep_random();
+			// if there are still requesters running, wait for them to fill up queue
+			// otherwise, take one last look (a requester may have pushed just before finishing) and exit
+			pthread_mutex_lock(&lock_queue);
+			__atomic_add_fetch(&waiting_resolvers, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			while ((job = (lookup_job *)bqueue_pop(q)) == NULL) {
+				if (!requesters_are_running()) {
+					job = (lookup_job *)bqueue_pop(q);
+					break;
+				}
+				pthread_cond_wait(&queue_not_empty, &lock_queue);
 			}
+			__atomic_sub_fetch(&waiting_resolvers, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&lock_queue);
+			if (job == NULL)
+				return NULL;
 		}
-		else {
-			char ip_str[INET6_ADDRSTRLEN];
-			if (dnslookup(hostname, ip_str, sizeof(ip_str)) == UTIL_FAILURE) {
-				printf("DNS lookup error: %s\n", hostname);
+		wake_one(&waiting_requesters, &queue_not_full);
 
+		char ip_str[INET6_ADDRSTRLEN];
+		// pinned names never reach the cache or the resolver
+		if (hosts_lookup(job->hostname, ip_str, sizeof(ip_str)) == HOSTS_MISS &&
+		    cache_lookup(job->hostname, ip_str, sizeof(ip_str)) == CACHE_MISS) {
+			if (use_dns_tcp) {
+				// the backend finishes the job once the answer arrives, so this thread can move on
+				dnstcp_submit(job->hostname, finish_tcp_lookup, job);
+				continue;
+			}
+			if (dnslookup(job->hostname, ip_str, sizeof(ip_str)) == UTIL_FAILURE) {
 				// force the ip string to be empty
 				ip_str[0] = '\0';
 			}
-			
-			// write to output file and protect this operation
-			pthread_mutex_lock(&lock_output_file);
-			fprintf(output_fp, "%s,%s\n", hostname, ip_str);
-			pthread_mutex_unlock(&lock_output_file);
-
-			// now that the hostname has been used, we can free the memory
-			free(hostname);
+			cache_insert(job->hostname, ip_str);
 		}
+
+		finish_job(job, ip_str);
 	}
-}
\ No newline at end of file
+}
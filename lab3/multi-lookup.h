@@ -1,7 +1,33 @@
+#ifndef MULTI_LOOKUP_H
+#define MULTI_LOOKUP_H
+
+#define MAX_NAME_LENGTH 1025
+
+typedef struct lookup_job_s lookup_job;
+
+// called by the resolver thread that handled job (or by the TCP backend, see dnstcp.h), with "" if the lookup failed
+// the job is freed by the resolver once the callback returns
+typedef void (*lookup_callback)(lookup_job *job, const char *ip_str);
+
+// a single hostname waiting in the queue, along with where its result should go
+struct lookup_job_s {
+	// interned, so it is shared with the cache; counted names (see intern.h) are released with the job
+	const char *hostname;
+	lookup_callback on_resolved;
+	void *context;
+};
+
 void increment_requesters();
 void decrement_requesters();
 int requesters_are_running();
-void sleep_random();
+
+void start_resolvers();
+void join_resolvers();
+
+lookup_job *create_job(const char *hostname, lookup_callback on_resolved, void *context);
+void submit_job(lookup_job *job);
 
 void *requester_entry_point(void *void_ptr);
-void *resolver_entry_point();
\ No newline at end of file
+void *resolver_entry_point();
+
+#endif
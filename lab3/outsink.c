@@ -0,0 +1,314 @@
+/*
+ * File: outsink.c
+ * Description:
+ * 	Double-buffered compressed writer. Writers fill one buffer while the
+ *	compressor thread works through the ones already handed off; a writer
+ *	only waits if all SINK_BUFFERS buffers are queued for compression.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#elif defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "outsink.h"
+#include "affinity.h"
+
+// favour speed: results files are large and highly repetitive, so low levels already compress well
+#define SINK_ZLIB_LEVEL 3
+#define SINK_ZSTD_LEVEL 3
+
+typedef struct sink_buffer_s sink_buffer;
+
+struct sink_buffer_s {
+	char *data;
+	size_t used;
+	// set by sink_sync: the compressor ends the member/frame after this buffer
+	int end_frame;
+	sink_buffer *next;
+};
+
+struct output_sink_s {
+	int fd;
+	sink_buffer buffers[SINK_BUFFERS];
+	// the buffer writers are filling; only touched by writers
+	sink_buffer *current;
+
+	// the remaining state is protected by lock
+	sink_buffer *free_list;
+	sink_buffer *full_head;
+	sink_buffer *full_tail;
+	unsigned long syncs_requested;
+	unsigned long syncs_completed;
+	int stopping;
+	int error;
+	pthread_mutex_t lock;
+	// signaled when a buffer is handed to the compressor, or the sink is stopping
+	pthread_cond_t work_ready;
+	// broadcast when the compressor returns a buffer to the free list
+	pthread_cond_t buffer_done;
+	pthread_t thread;
+
+	// only touched by the compressor thread
+	char *compressed;
+	size_t compressed_capacity;
+	int frame_open;
+#if defined(HAVE_ZLIB)
+	z_stream zs;
+#elif defined(HAVE_ZSTD)
+	ZSTD_CCtx *cctx;
+#endif
+};
+
+
+int sink_supported()
+{
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+static int write_full(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+#endif
+
+// compresses len bytes, ending the member/frame afterwards if end is set
+static int compress_chunk(output_sink *sink, const char *data, size_t len, int end)
+{
+	if (len == 0 && (!end || !sink->frame_open))
+		return 0;
+
+#if defined(HAVE_ZLIB)
+	if (!sink->frame_open && deflateReset(&sink->zs) != Z_OK)
+		return -1;
+	sink->frame_open = 1;
+
+	sink->zs.next_in = (Bytef *)data;
+	sink->zs.avail_in = len;
+	int ret;
+	do {
+		sink->zs.next_out = (Bytef *)sink->compressed;
+		sink->zs.avail_out = sink->compressed_capacity;
+		ret = deflate(&sink->zs, end ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+		if (write_full(sink->fd, sink->compressed, sink->compressed_capacity - sink->zs.avail_out) == -1)
+			return -1;
+	} while (sink->zs.avail_out == 0 || (end && ret != Z_STREAM_END));
+#elif defined(HAVE_ZSTD)
+	sink->frame_open = 1;
+
+	ZSTD_inBuffer in = { data, len, 0 };
+	size_t remaining;
+	do {
+		ZSTD_outBuffer out = { sink->compressed, sink->compressed_capacity, 0 };
+		remaining = ZSTD_compressStream2(sink->cctx, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(remaining))
+			return -1;
+		if (write_full(sink->fd, sink->compressed, out.pos) == -1)
+			return -1;
+	} while (end ? remaining != 0 : in.pos < in.size);
+#else
+	(void) data;
+	return -1;
+#endif
+
+	if (end)
+		sink->frame_open = 0;
+	return 0;
+}
+
+static void *compressor_entry_point(void *void_ptr)
+{
+	output_sink *sink = (output_sink *)void_ptr;
+	affinity_pin_self();
+
+	while (1) {
+		pthread_mutex_lock(&sink->lock);
+		while (sink->full_head == NULL && !sink->stopping)
+			pthread_cond_wait(&sink->work_ready, &sink->lock);
+		sink_buffer *buf = sink->full_head;
+		if (buf == NULL) {
+			pthread_mutex_unlock(&sink->lock);
+			return NULL;
+		}
+		sink->full_head = buf->next;
+		if (sink->full_head == NULL)
+			sink->full_tail = NULL;
+		pthread_mutex_unlock(&sink->lock);
+
+		int ret = compress_chunk(sink, buf->data, buf->used, buf->end_frame);
+
+		pthread_mutex_lock(&sink->lock);
+		if (ret == -1)
+			sink->error = 1;
+		if (buf->end_frame)
+			sink->syncs_completed++;
+		buf->used = 0;
+		buf->end_frame = 0;
+		buf->next = sink->free_list;
+		sink->free_list = buf;
+		pthread_cond_broadcast(&sink->buffer_done);
+		pthread_mutex_unlock(&sink->lock);
+	}
+}
+
+static void hand_off(output_sink *sink, int end_frame)
+{
+	sink_buffer *buf = sink->current;
+	buf->end_frame = end_frame;
+	buf->next = NULL;
+
+	pthread_mutex_lock(&sink->lock);
+	if (sink->full_tail)
+		sink->full_tail->next = buf;
+	else
+		sink->full_head = buf;
+	sink->full_tail = buf;
+	if (end_frame)
+		sink->syncs_requested++;
+	pthread_cond_signal(&sink->work_ready);
+
+	// this is the only place a writer can block: every buffer is waiting on the compressor
+	while (sink->free_list == NULL)
+		pthread_cond_wait(&sink->buffer_done, &sink->lock);
+	sink->current = sink->free_list;
+	sink->free_list = sink->current->next;
+	pthread_mutex_unlock(&sink->lock);
+}
+
+output_sink *sink_open(int fd)
+{
+	if (!sink_supported())
+		return NULL;
+
+	output_sink *sink = calloc(1, sizeof(output_sink));
+	if (!sink)
+		return NULL;
+	sink->fd = fd;
+
+	for (int i = 0; i < SINK_BUFFERS; i++) {
+		sink->buffers[i].data = malloc(SINK_BUFFER_SIZE);
+		if (!sink->buffers[i].data)
+			goto fail;
+		if (i > 0) {
+			sink->buffers[i].next = sink->free_list;
+			sink->free_list = &sink->buffers[i];
+		}
+	}
+	sink->current = &sink->buffers[0];
+
+	sink->compressed_capacity = SINK_BUFFER_SIZE;
+	sink->compressed = malloc(sink->compressed_capacity);
+	if (!sink->compressed)
+		goto fail;
+
+#if defined(HAVE_ZLIB)
+	// 16 added to the window bits selects a gzip wrapper rather than raw zlib
+	if (deflateInit2(&sink->zs, SINK_ZLIB_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		goto fail;
+#elif defined(HAVE_ZSTD)
+	sink->cctx = ZSTD_createCCtx();
+	if (!sink->cctx || ZSTD_isError(ZSTD_CCtx_setParameter(sink->cctx, ZSTD_c_compressionLevel, SINK_ZSTD_LEVEL)))
+		goto fail;
+#endif
+
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->work_ready, NULL);
+	pthread_cond_init(&sink->buffer_done, NULL);
+	if (pthread_create(&sink->thread, NULL, compressor_entry_point, sink) != 0)
+		goto fail;
+
+	return sink;
+
+fail:
+#if defined(HAVE_ZSTD)
+	ZSTD_freeCCtx(sink->cctx);
+#endif
+	for (int i = 0; i < SINK_BUFFERS; i++)
+		free(sink->buffers[i].data);
+	free(sink->compressed);
+	free(sink);
+	return NULL;
+}
+
+void sink_write(output_sink *sink, const char *data, size_t len)
+{
+	while (len > 0) {
+		size_t space = SINK_BUFFER_SIZE - sink->current->used;
+		size_t n = len < space ? len : space;
+		memcpy(sink->current->data + sink->current->used, data, n);
+		sink->current->used += n;
+		data += n;
+		len -= n;
+
+		if (sink->current->used == SINK_BUFFER_SIZE)
+			hand_off(sink, 0);
+	}
+}
+
+long sink_sync(output_sink *sink)
+{
+	hand_off(sink, 1);
+
+	pthread_mutex_lock(&sink->lock);
+	while (sink->syncs_completed < sink->syncs_requested)
+		pthread_cond_wait(&sink->buffer_done, &sink->lock);
+	int error = sink->error;
+	pthread_mutex_unlock(&sink->lock);
+
+	if (error)
+		return -1;
+	return lseek(sink->fd, 0, SEEK_END);
+}
+
+int sink_close(output_sink *sink)
+{
+	int ret = sink_sync(sink) == -1 ? -1 : 0;
+
+	pthread_mutex_lock(&sink->lock);
+	sink->stopping = 1;
+	pthread_cond_signal(&sink->work_ready);
+	pthread_mutex_unlock(&sink->lock);
+	pthread_join(sink->thread, NULL);
+
+#if defined(HAVE_ZLIB)
+	deflateEnd(&sink->zs);
+#elif defined(HAVE_ZSTD)
+	ZSTD_freeCCtx(sink->cctx);
+#endif
+	if (close(sink->fd) == -1)
+		ret = -1;
+
+	pthread_mutex_destroy(&sink->lock);
+	pthread_cond_destroy(&sink->work_ready);
+	pthread_cond_destroy(&sink->buffer_done);
+	for (int i = 0; i < SINK_BUFFERS; i++)
+		free(sink->buffers[i].data);
+	free(sink->compressed);
+	free(sink);
+	return ret;
+}
@@ -0,0 +1,52 @@
+/*
+ * File: outsink.h
+ * Description:
+ * 	Compressed output sink for multi-lookup results. Writers copy lines
+ *	into large buffers; full buffers are handed to a dedicated compressor
+ *	thread, so compression and file I/O never run on a resolver thread
+ *	unless every buffer is already waiting to be compressed.
+ *
+ *	The codec is chosen at build time: make COMPRESS=zlib produces gzip
+ *	output, make COMPRESS=zstd produces zstd output. Each call to
+ *	sink_sync ends the current gzip member or zstd frame, so the file can
+ *	be cut at any length sink_sync returned and appended to later; both
+ *	formats decompress concatenated members/frames as one stream.
+ */
+
+#ifndef OUTSINK_H
+#define OUTSINK_H
+
+#include <stddef.h>
+
+#define SINK_BUFFER_SIZE (1024 * 1024)
+#define SINK_BUFFERS 4
+
+typedef struct output_sink_s output_sink;
+
+/* Function to report whether this build can compress output */
+int sink_supported();
+
+/* Function to start a sink that appends compressed data to fd
+ * On success the sink takes ownership of fd
+ * Returns NULL on failure
+ */
+output_sink *sink_open(int fd);
+
+/* Function to append len bytes to the sink
+ * Not thread-safe; callers must serialize writes
+ */
+void sink_write(output_sink *sink, const char *data, size_t len);
+
+/* Function to compress and write everything appended so far, ending the
+ * current member/frame
+ * Not thread-safe with respect to sink_write
+ * Returns the file length afterwards, or -1 on error
+ */
+long sink_sync(output_sink *sink);
+
+/* Function to sync the sink, stop its thread and close its file
+ * Returns 0 on success or -1 if any data could not be written
+ */
+int sink_close(output_sink *sink);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * File: results-index.c
+ * Description:
+ * 	Writer and mmap-based reader for the indexed binary results format.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "results-index.h"
+
+typedef struct pending_result_s {
+	const char *hostname;
+	uint8_t family;
+	uint8_t address[16];
+} pending_result;
+
+static pending_result *pending = NULL;
+static size_t num_pending = 0;
+static size_t pending_capacity = 0;
+// hostnames already in pending, by address: open addressing, at most half full
+static const char **added = NULL;
+static size_t added_capacity = 0;
+static pthread_mutex_t lock_pending = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint32_t hash_hostname(const char *hostname)
+{
+	// 32-bit FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)hostname; *p; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static size_t hash_pointer(const char *hostname)
+{
+	// interned names are unique, so their addresses are hashed rather than their characters
+	uint64_t x = (uintptr_t)hostname;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	return x;
+}
+
+// must be called with lock_pending held
+// returns 1 if hostname was added before, 0 if it is new and now recorded, or -1 if memory ran out
+static int record_added(const char *hostname)
+{
+	if ((num_pending + 1) * 2 > added_capacity) {
+		size_t capacity = added_capacity ? added_capacity * 2 : 8192;
+		const char **grown = calloc(capacity, sizeof(char *));
+		if (!grown)
+			return -1;
+		for (size_t i = 0; i < added_capacity; i++) {
+			if (!added[i])
+				continue;
+			size_t b = hash_pointer(added[i]) & (capacity - 1);
+			while (grown[b])
+				b = (b + 1) & (capacity - 1);
+			grown[b] = added[i];
+		}
+		free(added);
+		added = grown;
+		added_capacity = capacity;
+	}
+
+	size_t b = hash_pointer(hostname) & (added_capacity - 1);
+	while (added[b] && added[b] != hostname)
+		b = (b + 1) & (added_capacity - 1);
+	if (added[b])
+		return 1;
+	added[b] = hostname;
+	return 0;
+}
+
+static uint64_t align8(uint64_t offset)
+{
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+void index_add(const char *hostname, const char *ip_str)
+{
+	pending_result result;
+	memset(&result, 0, sizeof(result));
+	result.hostname = hostname;
+	if (inet_pton(AF_INET, ip_str, result.address) == 1)
+		result.family = INDEX_FAMILY_INET;
+	else if (inet_pton(AF_INET6, ip_str, result.address) == 1)
+		result.family = INDEX_FAMILY_INET6;
+	else
+		result.family = INDEX_FAMILY_NONE;
+
+	pthread_mutex_lock(&lock_pending);
+	if (num_pending == pending_capacity) {
+		size_t capacity = pending_capacity ? pending_capacity * 2 : 4096;
+		pending_result *grown = realloc(pending, capacity * sizeof(pending_result));
+		if (!grown) {
+			pthread_mutex_unlock(&lock_pending);
+			fprintf(stderr, "Failed to add %s to index.\n", hostname);
+			return;
+		}
+		pending = grown;
+		pending_capacity = capacity;
+	}
+	// only the first result for a name is kept, so memory grows with the number of distinct names
+	int seen = record_added(hostname);
+	if (seen == 0)
+		pending[num_pending++] = result;
+	pthread_mutex_unlock(&lock_pending);
+	if (seen == -1)
+		fprintf(stderr, "Failed to add %s to index.\n", hostname);
+}
+
+int index_write(const char *path)
+{
+	size_t bucket_count = 16;
+	while (bucket_count < num_pending * 2)
+		bucket_count *= 2;
+
+	uint32_t *buckets = calloc(bucket_count, sizeof(uint32_t));
+	index_record *records = calloc(num_pending ? num_pending : 1, sizeof(index_record));
+	const char **names = calloc(num_pending ? num_pending : 1, sizeof(char *));
+	if (!buckets || !records || !names) {
+		free(buckets);
+		free(records);
+		free(names);
+		return INDEX_FAILURE;
+	}
+
+	uint32_t record_count = 0;
+	uint64_t strings_size = 0;
+	for (size_t i = 0; i < num_pending; i++) {
+		uint32_t hash = hash_hostname(pending[i].hostname);
+		size_t b = hash & (bucket_count - 1);
+		while (buckets[b] && names[buckets[b] - 1] != pending[i].hostname)
+			b = (b + 1) & (bucket_count - 1);
+		if (buckets[b])
+			continue;
+
+		size_t length = strlen(pending[i].hostname);
+		index_record *record = &records[record_count];
+		record->name_offset = strings_size;
+		record->name_length = length;
+		record->hash = hash;
+		record->family = pending[i].family;
+		memcpy(record->address, pending[i].address, sizeof(record->address));
+		names[record_count] = pending[i].hostname;
+		buckets[b] = ++record_count;
+		strings_size += length + 1;
+	}
+
+	index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.version = INDEX_VERSION;
+	header.record_count = record_count;
+	header.bucket_count = bucket_count;
+	header.records_offset = align8(sizeof(header));
+	header.buckets_offset = align8(header.records_offset + (uint64_t)record_count * sizeof(index_record));
+	header.strings_offset = align8(header.buckets_offset + (uint64_t)bucket_count * sizeof(uint32_t));
+	header.strings_size = strings_size;
+
+	int ret = INDEX_SUCCESS;
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		ret = INDEX_FAILURE;
+	else {
+		static const char padding[8];
+		fwrite(&header, sizeof(header), 1, fp);
+		fwrite(padding, 1, header.records_offset - sizeof(header), fp);
+		fwrite(records, sizeof(index_record), record_count, fp);
+		fwrite(padding, 1, header.buckets_offset - ftell(fp), fp);
+		fwrite(buckets, sizeof(uint32_t), bucket_count, fp);
+		fwrite(padding, 1, header.strings_offset - ftell(fp), fp);
+		for (uint32_t i = 0; i < record_count; i++)
+			fwrite(names[i], 1, records[i].name_length + 1, fp);
+		if (ferror(fp))
+			ret = INDEX_FAILURE;
+		if (fclose(fp) != 0)
+			ret = INDEX_FAILURE;
+	}
+
+	free(buckets);
+	free(records);
+	free(names);
+	free(pending);
+	pending = NULL;
+	num_pending = 0;
+	pending_capacity = 0;
+	free(added);
+	added = NULL;
+	added_capacity = 0;
+	return ret;
+}
+
+int index_open(results_index *idx, const char *path)
+{
+	memset(idx, 0, sizeof(results_index));
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return INDEX_FAILURE;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(index_header)) {
+		close(fd);
+		return INDEX_FAILURE;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return INDEX_FAILURE;
+
+	idx->map = map;
+	idx->map_size = st.st_size;
+	idx->header = map;
+
+	// reject anything whose sections would reach past the end of the file
+	const index_header *h = idx->header;
+	uint64_t size = st.st_size;
+	if (memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h->version != INDEX_VERSION ||
+	    h->bucket_count == 0 || (h->bucket_count & (h->bucket_count - 1)) != 0 ||
+	    h->records_offset > size || (size - h->records_offset) / sizeof(index_record) < h->record_count ||
+	    h->buckets_offset > size || (size - h->buckets_offset) / sizeof(uint32_t) < h->bucket_count ||
+	    h->strings_offset > size || size - h->strings_offset < h->strings_size) {
+		index_close(idx);
+		return INDEX_FAILURE;
+	}
+
+	idx->records = (const index_record *)(idx->map + h->records_offset);
+	idx->buckets = (const uint32_t *)(idx->map + h->buckets_offset);
+	idx->strings = (const char *)(idx->map + h->strings_offset);
+	return INDEX_SUCCESS;
+}
+
+int index_lookup(const results_index *idx, const char *hostname, char *ip_str, size_t size)
+{
+	uint32_t hash = hash_hostname(hostname);
+	size_t length = strlen(hostname);
+	uint32_t mask = idx->header->bucket_count - 1;
+
+	for (uint32_t b = hash & mask, probes = 0; probes <= mask; b = (b + 1) & mask, probes++) {
+		uint32_t slot = idx->buckets[b];
+		if (slot == 0 || slot > idx->header->record_count)
+			return 0;
+
+		const index_record *record = &idx->records[slot - 1];
+		if (record->hash != hash || record->name_length != length ||
+		    (uint64_t)record->name_offset + length >= idx->header->strings_size ||
+		    memcmp(idx->strings + record->name_offset, hostname, length) != 0)
+			continue;
+
+		if (record->family == INDEX_FAMILY_INET)
+			inet_ntop(AF_INET, record->address, ip_str, size);
+		else if (record->family == INDEX_FAMILY_INET6)
+			inet_ntop(AF_INET6, record->address, ip_str, size);
+		else if (size > 0)
+			ip_str[0] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+void index_close(results_index *idx)
+{
+	if (idx->map)
+		munmap((void *)idx->map, idx->map_size);
+	memset(idx, 0, sizeof(results_index));
+}
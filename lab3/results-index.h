@@ -0,0 +1,88 @@
+/*
+ * File: results-index.h
+ * Description:
+ * 	Indexed binary results format, written by multi-lookup --index and
+ *	read with mmap by results-query. A point query costs one hash, a short
+ *	probe of the bucket array and one string comparison, instead of a scan
+ *	of the CSV results file.
+ *
+ *	Layout (all integers in host byte order, sections 8-byte aligned):
+ *	  index_header
+ *	  index_record[record_count]   fixed width, one per distinct hostname
+ *	  uint32_t[bucket_count]       open addressing, linear probing;
+ *	                               record number + 1, or 0 for empty
+ *	  string table                 NUL-terminated hostnames
+ */
+
+#ifndef RESULTS_INDEX_H
+#define RESULTS_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INDEX_MAGIC "MLIDX01"
+#define INDEX_VERSION 1
+
+#define INDEX_FAILURE -1
+#define INDEX_SUCCESS 0
+
+// address family of a record; failed lookups are kept so they can be told apart from unknown names
+#define INDEX_FAMILY_NONE 0
+#define INDEX_FAMILY_INET 4
+#define INDEX_FAMILY_INET6 6
+
+typedef struct index_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_count;
+	uint32_t bucket_count;
+	uint32_t reserved;
+	uint64_t records_offset;
+	uint64_t buckets_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+} index_header;
+
+typedef struct index_record_s {
+	uint32_t name_offset;
+	uint32_t hash;
+	uint16_t name_length;
+	uint8_t family;
+	uint8_t reserved[5];
+	uint8_t address[16];
+} index_record;
+
+typedef struct results_index_s {
+	const unsigned char *map;
+	size_t map_size;
+	const index_header *header;
+	const index_record *records;
+	const uint32_t *buckets;
+	const char *strings;
+} results_index;
+
+/* Function to remember the result for hostname, for the next index_write
+ * hostname must be interned (see intern.h); repeats of a name are ignored
+ * Thread-safe
+ */
+void index_add(const char *hostname, const char *ip_str);
+
+/* Function to write every result added so far to path, then forget them
+ * Returns INDEX_SUCCESS or INDEX_FAILURE
+ */
+int index_write(const char *path);
+
+/* Function to map the index at path for queries
+ * Returns INDEX_SUCCESS or INDEX_FAILURE
+ */
+int index_open(results_index *idx, const char *path);
+
+/* Function to look up hostname
+ * Returns 1 and copies its address ("" for a failed lookup) into ip_str if found, 0 if not
+ */
+int index_lookup(const results_index *idx, const char *hostname, char *ip_str, size_t size);
+
+/* Function to unmap an index */
+void index_close(results_index *idx);
+
+#endif
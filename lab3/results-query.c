@@ -0,0 +1,55 @@
+/*
+ * File: results-query.c
+ * Description:
+ * 	Answers point queries against an index written by multi-lookup --index.
+ *	Prints "hostname,ip" for each hostname found (with an empty ip if its
+ *	lookup failed) and reports names that are not in the index on stderr.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "results-index.h"
+
+#define MINARGS 3
+#define USAGE "<indexFilePath> <hostname> [hostname ...]"
+
+int main(int argc, char* argv[]){
+
+    /* Local Vars */
+    results_index idx;
+    char ipstr[INET6_ADDRSTRLEN];
+    int i;
+    int missing = 0;
+
+    /* Check Arguments */
+    if(argc < MINARGS){
+	fprintf(stderr, "Not enough arguments: %d\n", (argc - 1));
+	fprintf(stderr, "Usage:\n %s %s\n", argv[0], USAGE);
+	return EXIT_FAILURE;
+    }
+
+    /* Map Index */
+    if(index_open(&idx, argv[1]) == INDEX_FAILURE){
+	fprintf(stderr, "Error Opening Index File %s\n", argv[1]);
+	return EXIT_FAILURE;
+    }
+
+    /* Look Up Each Hostname */
+    for(i=2; i<argc; i++){
+	if(index_lookup(&idx, argv[i], ipstr, sizeof(ipstr))){
+	    printf("%s,%s\n", argv[i], ipstr);
+	}
+	else{
+	    fprintf(stderr, "Not Found: %s\n", argv[i]);
+	    missing = 1;
+	}
+    }
+
+    /* Cleanup */
+    index_close(&idx);
+
+    return missing ? EXIT_FAILURE : EXIT_SUCCESS;
+}
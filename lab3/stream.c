@@ -0,0 +1,150 @@
+/*
+ * File: stream.c
+ * Description:
+ * 	Reads hostnames from a stream and writes results to standard output
+ *	through a bounded buffer, so a slow trickle of names still produces
+ *	output promptly without issuing one write per result.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "multi-lookup.h"
+
+static const char INPUT_FS[] = "%1024s";
+
+static char output_buffer[STREAM_BUFFER_SIZE];
+static size_t buffered = 0;
+// when the oldest line still sitting in output_buffer was added
+static struct timespec oldest_buffered;
+
+// number of submitted names whose result has not been buffered yet
+static int in_flight = 0;
+static int input_done = 0;
+
+static pthread_mutex_t lock_stream = PTHREAD_MUTEX_INITIALIZER;
+// signaled when the buffer goes from empty to non-empty, or input is done
+static pthread_cond_t stream_wakeup;
+
+
+// must be called with lock_stream held
+static void flush_output()
+{
+	size_t done = 0;
+	while (done < buffered) {
+		ssize_t n = write(STDOUT_FILENO, output_buffer + done, buffered - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error writing results");
+			break;
+		}
+		done += n;
+	}
+	buffered = 0;
+}
+
+static void stream_result(lookup_job *job, const char *ip_str)
+{
+	size_t host_length = strlen(job->hostname);
+	size_t ip_length = strlen(ip_str);
+	size_t line_length = host_length + ip_length + 2;
+
+	pthread_mutex_lock(&lock_stream);
+	if (buffered + line_length > sizeof(output_buffer))
+		flush_output();
+
+	if (buffered == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &oldest_buffered);
+		pthread_cond_signal(&stream_wakeup);
+	}
+
+	char *p = output_buffer + buffered;
+	memcpy(p, job->hostname, host_length);
+	p[host_length] = ',';
+	memcpy(p + host_length + 1, ip_str, ip_length);
+	p[line_length - 1] = '\n';
+	buffered += line_length;
+
+	// nothing else is about to arrive, so don't make this result wait for company
+	if (--in_flight == 0)
+		flush_output();
+	pthread_mutex_unlock(&lock_stream);
+}
+
+static void *flusher_entry_point()
+{
+	pthread_mutex_lock(&lock_stream);
+	while (!input_done) {
+		if (buffered == 0) {
+			pthread_cond_wait(&stream_wakeup, &lock_stream);
+			continue;
+		}
+
+		struct timespec deadline = oldest_buffered;
+		deadline.tv_nsec += STREAM_FLUSH_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		int ret = pthread_cond_timedwait(&stream_wakeup, &lock_stream, &deadline);
+		if (ret == ETIMEDOUT && buffered > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline.tv_sec ||
+			    (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+				flush_output();
+		}
+	}
+	pthread_mutex_unlock(&lock_stream);
+	return NULL;
+}
+
+int run_stream(FILE *input_fp)
+{
+	// the flusher's deadlines are computed from CLOCK_MONOTONIC, so wait on that clock too
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stream_wakeup, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	pthread_t flusher_thread;
+	pthread_create(&flusher_thread, NULL, flusher_entry_point, NULL);
+
+	char hostname[MAX_NAME_LENGTH];
+	while (fscanf(input_fp, INPUT_FS, hostname) > 0) {
+		lookup_job *job = create_job(hostname, stream_result, NULL);
+		if (!job) {
+			fprintf(stderr, "Failed to allocate job for %s.\n", hostname);
+			continue;
+		}
+
+		pthread_mutex_lock(&lock_stream);
+		in_flight++;
+		pthread_mutex_unlock(&lock_stream);
+
+		submit_job(job);
+	}
+
+	// resolvers exit once the queue drains, and every job they take is written before they do
+	decrement_requesters();
+	join_resolvers();
+
+	pthread_mutex_lock(&lock_stream);
+	input_done = 1;
+	flush_output();
+	pthread_cond_signal(&stream_wakeup);
+	pthread_mutex_unlock(&lock_stream);
+
+	pthread_join(flusher_thread, NULL);
+	pthread_cond_destroy(&stream_wakeup);
+	return EXIT_SUCCESS;
+}
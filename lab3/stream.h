@@ -0,0 +1,27 @@
+/*
+ * File: stream.h
+ * Description:
+ * 	Streaming pipeline mode. multi-lookup --stream [input] reads hostnames
+ *	from standard input (or from input, e.g. a FIFO) until end of file and
+ *	writes "hostname,ip" lines to standard output as names are resolved.
+ *	Output is held in a bounded buffer which is flushed whenever it fills,
+ *	whenever no lookups are outstanding, and at the latest
+ *	STREAM_FLUSH_INTERVAL_MS after the oldest buffered line was added.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+#define STREAM_BUFFER_SIZE (64 * 1024)
+#define STREAM_FLUSH_INTERVAL_MS 50
+
+/* Function to feed every hostname in input_fp to the resolvers
+ * Resolver threads must already be running, and the caller must have
+ * registered this stream with increment_requesters()
+ * Returns once input_fp reaches end of file and every result is written
+ */
+int run_stream(FILE *input_fp);
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * File: uring.c
+ * Description:
+ * 	Minimal io_uring ring setup, plus the read-ahead reader and batched
+ *	writer described in uring.h. Each ring is only ever used by one thread
+ *	at a time, so the only synchronization needed is with the kernel.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+#define RING_ENTRIES 8
+
+typedef struct ring_s {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	// entries queued since the last io_uring_enter
+	unsigned to_submit;
+} ring;
+
+// the state of a registered buffer
+#define BUFFER_FREE 0
+#define BUFFER_IN_FLIGHT 1
+#define BUFFER_DONE 2
+
+typedef struct uring_buffer_s {
+	char *data;
+	int state;
+	long offset;
+	// bytes filled by the writer
+	size_t length;
+	// the result of the completed read or write
+	int result;
+} uring_buffer;
+
+typedef struct uring_reader_s {
+	ring r;
+	int fd;
+	char *memory;
+	uring_buffer buffers[URING_READ_BUFFERS];
+	// buffers are consumed in the order they were submitted, starting at oldest
+	unsigned oldest;
+	unsigned in_use;
+	size_t consumed;
+	// offset of the next byte handed to stdio, and of the next read to submit
+	long position;
+	long next_offset;
+} uring_reader;
+
+struct uring_writer_s {
+	ring r;
+	int fd;
+	char *memory;
+	uring_buffer buffers[URING_WRITE_BUFFERS];
+	uring_buffer *current;
+	int in_flight;
+	long offset;
+	int error;
+};
+
+
+static int ring_init(ring *r)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(r, 0, sizeof(ring));
+	r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (r->fd == -1)
+		return -1;
+	r->entries = params.sq_entries;
+
+	r->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	// newer kernels map both rings with one call
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_size > r->sq_map_size)
+			r->sq_map_size = r->cq_map_size;
+		r->cq_map_size = 0;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto fail;
+	r->cq_map = r->sq_map;
+	if (r->cq_map_size) {
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	char *sq = r->sq_map;
+	char *cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + params.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + params.sq_off.array);
+	r->cq_head = (unsigned *)(cq + params.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+
+fail:
+	if (r->sq_map && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_map_size);
+	if (r->cq_map_size && r->cq_map && r->cq_map != MAP_FAILED)
+		munmap(r->cq_map, r->cq_map_size);
+	close(r->fd);
+	return -1;
+}
+
+static void ring_exit(ring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map_size)
+		munmap(r->cq_map, r->cq_map_size);
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+}
+
+static int ring_register_buffers(ring *r, char *memory, int count)
+{
+	struct iovec iovecs[count];
+	for (int i = 0; i < count; i++) {
+		iovecs[i].iov_base = memory + (size_t)i * URING_BUFFER_SIZE;
+		iovecs[i].iov_len = URING_BUFFER_SIZE;
+	}
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iovecs, count) == -1 ? -1 : 0;
+}
+
+// queues a fixed-buffer read or write; the ring is never fuller than the number of buffers
+static void ring_queue(ring *r, int opcode, int fd, uring_buffer *buf, int index, size_t len)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned slot = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf->data;
+	sqe->len = len;
+	sqe->off = buf->offset;
+	sqe->buf_index = index;
+	sqe->user_data = index;
+	r->sq_array[slot] = slot;
+	// the kernel must see the entry before it sees the new tail
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	buf->state = BUFFER_IN_FLIGHT;
+}
+
+// submits everything queued and waits until at least one completion is available
+static int ring_wait(ring *r)
+{
+	while (1) {
+		int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0) {
+			r->to_submit -= ret;
+			return 0;
+		}
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+// marks every completed buffer done and records its result
+static void ring_reap(ring *r, uring_buffer *buffers)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		uring_buffer *buf = &buffers[cqe->user_data];
+		buf->state = BUFFER_DONE;
+		buf->result = cqe->res;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uring_supported()
+{
+	ring r;
+	if (ring_init(&r) == -1)
+		return 0;
+	ring_exit(&r);
+	return 1;
+}
+
+
+// waits for every outstanding read, discards all buffered data and continues reading at position
+static int reader_restart(uring_reader *reader, long position)
+{
+	int ret = 0;
+	for (int i = 0; i < URING_READ_BUFFERS; i++) {
+		while (reader->buffers[i].state == BUFFER_IN_FLIGHT) {
+			if (ring_wait(&reader->r) == -1) {
+				ret = -1;
+				break;
+			}
+			ring_reap(&reader->r, reader->buffers);
+		}
+		reader->buffers[i].state = BUFFER_FREE;
+	}
+	reader->oldest = 0;
+	reader->in_use = 0;
+	reader->consumed = 0;
+	reader->position = position;
+	reader->next_offset = position;
+	return ret;
+}
+
+static ssize_t reader_read(void *cookie, char *data, size_t size)
+{
+	uring_reader *reader = cookie;
+	uring_buffer *buf = &reader->buffers[reader->oldest];
+
+	if (reader->in_use == 0 || buf->state == BUFFER_IN_FLIGHT) {
+		// refill every free buffer, so the reads are submitted together with this wait
+		while (reader->in_use < URING_READ_BUFFERS) {
+			int index = (reader->oldest + reader->in_use) % URING_READ_BUFFERS;
+			reader->buffers[index].offset = reader->next_offset;
+			ring_queue(&reader->r, IORING_OP_READ_FIXED, reader->fd, &reader->buffers[index], index, URING_BUFFER_SIZE);
+			reader->next_offset += URING_BUFFER_SIZE;
+			reader->in_use++;
+		}
+		while (buf->state == BUFFER_IN_FLIGHT) {
+			if (ring_wait(&reader->r) == -1)
+				return -1;
+			ring_reap(&reader->r, reader->buffers);
+		}
+	}
+
+	if (buf->result < 0) {
+		errno = -buf->result;
+		return -1;
+	}
+
+	size_t available = buf->result - reader->consumed;
+	size_t n = size < available ? size : available;
+	memcpy(data, buf->data + reader->consumed, n);
+	reader->consumed += n;
+	reader->position += n;
+
+	if (reader->consumed == (size_t)buf->result) {
+		// the reads after a short one started at the wrong offset
+		if (buf->result < URING_BUFFER_SIZE) {
+			if (reader_restart(reader, reader->position) == -1)
+				return -1;
+		}
+		else {
+			buf->state = BUFFER_FREE;
+			reader->oldest = (reader->oldest + 1) % URING_READ_BUFFERS;
+			reader->in_use--;
+			reader->consumed = 0;
+		}
+	}
+	return n;
+}
+
+static int reader_seek(void *cookie, off64_t *offset, int whence)
+{
+	uring_reader *reader = cookie;
+	long target;
+	if (whence == SEEK_SET)
+		target = *offset;
+	else if (whence == SEEK_CUR)
+		target = reader->position + *offset;
+	else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (target != reader->position && reader_restart(reader, target) == -1)
+		return -1;
+	*offset = reader->position;
+	return 0;
+}
+
+static int reader_close(void *cookie)
+{
+	uring_reader *reader = cookie;
+	reader_restart(reader, 0);
+	ring_exit(&reader->r);
+	int ret = close(reader->fd);
+	free(reader->memory);
+	free(reader);
+	return ret;
+}
+
+FILE *uring_fopen(const char *path)
+{
+	uring_reader *reader = calloc(1, sizeof(uring_reader));
+	if (!reader)
+		return NULL;
+
+	reader->fd = open(path, O_RDONLY);
+	if (reader->fd == -1) {
+		free(reader);
+		return NULL;
+	}
+	if (posix_memalign((void **)&reader->memory, 4096, (size_t)URING_READ_BUFFERS * URING_BUFFER_SIZE) != 0) {
+		reader->memory = NULL;
+		goto fail;
+	}
+	if (ring_init(&reader->r) == -1)
+		goto fail;
+	if (ring_register_buffers(&reader->r, reader->memory, URING_READ_BUFFERS) == -1) {
+		ring_exit(&reader->r);
+		goto fail;
+	}
+	for (int i = 0; i < URING_READ_BUFFERS; i++)
+		reader->buffers[i].data = reader->memory + (size_t)i * URING_BUFFER_SIZE;
+
+	cookie_io_functions_t functions = { reader_read, NULL, reader_seek, reader_close };
+	FILE *fp = fopencookie(reader, "r", functions);
+	if (!fp) {
+		ring_exit(&reader->r);
+		goto fail;
+	}
+	return fp;
+
+fail:
+	close(reader->fd);
+	free(reader->memory);
+	free(reader);
+	return NULL;
+}
+
+
+// releases every completed write; a short write is finished synchronously, which should be rare
+static void writer_complete(uring_writer *w)
+{
+	for (int i = 0; i < URING_WRITE_BUFFERS; i++) {
+		uring_buffer *buf = &w->buffers[i];
+		if (buf->state != BUFFER_DONE)
+			continue;
+
+		if (buf->result < 0)
+			w->error = 1;
+		else {
+			size_t done = buf->result;
+			while (done < buf->length) {
+				ssize_t n = pwrite(w->fd, buf->data + done, buf->length - done, buf->offset + done);
+				if (n <= 0 && errno != EINTR) {
+					w->error = 1;
+					break;
+				}
+				if (n > 0)
+					done += n;
+			}
+		}
+		buf->state = BUFFER_FREE;
+		buf->length = 0;
+		w->in_flight--;
+	}
+}
+
+// submits whatever is queued and waits for at least one write to complete
+static void writer_wait(uring_writer *w)
+{
+	if (ring_wait(&w->r) == -1) {
+		// nothing more can be learned about the queued writes
+		w->error = 1;
+		for (int i = 0; i < URING_WRITE_BUFFERS; i++) {
+			if (w->buffers[i].state == BUFFER_IN_FLIGHT) {
+				w->buffers[i].state = BUFFER_FREE;
+				w->buffers[i].length = 0;
+				w->in_flight--;
+			}
+		}
+		return;
+	}
+	ring_reap(&w->r, w->buffers);
+	writer_complete(w);
+}
+
+// queues the current buffer as one write, then moves on to a free buffer
+static void writer_queue_current(uring_writer *w)
+{
+	uring_buffer *buf = w->current;
+	buf->offset = w->offset;
+	w->offset += buf->length;
+	ring_queue(&w->r, IORING_OP_WRITE_FIXED, w->fd, buf, buf - w->buffers, buf->length);
+	w->in_flight++;
+
+	// writes are only handed to the kernel once every buffer is queued
+	while (w->in_flight == URING_WRITE_BUFFERS)
+		writer_wait(w);
+	for (int i = 0; i < URING_WRITE_BUFFERS; i++) {
+		if (w->buffers[i].state == BUFFER_FREE) {
+			w->current = &w->buffers[i];
+			break;
+		}
+	}
+}
+
+uring_writer *uring_writer_open(int fd)
+{
+	uring_writer *w = calloc(1, sizeof(uring_writer));
+	if (!w)
+		return NULL;
+
+	w->fd = fd;
+	w->offset = lseek(fd, 0, SEEK_CUR);
+	if (w->offset == -1)
+		goto fail;
+	if (posix_memalign((void **)&w->memory, 4096, (size_t)URING_WRITE_BUFFERS * URING_BUFFER_SIZE) != 0) {
+		w->memory = NULL;
+		goto fail;
+	}
+	if (ring_init(&w->r) == -1)
+		goto fail;
+	if (ring_register_buffers(&w->r, w->memory, URING_WRITE_BUFFERS) == -1) {
+		ring_exit(&w->r);
+		goto fail;
+	}
+	for (int i = 0; i < URING_WRITE_BUFFERS; i++)
+		w->buffers[i].data = w->memory + (size_t)i * URING_BUFFER_SIZE;
+	w->current = &w->buffers[0];
+	return w;
+
+fail:
+	free(w->memory);
+	free(w);
+	return NULL;
+}
+
+void uring_writer_write(uring_writer *w, const char *data, size_t len)
+{
+	while (len > 0) {
+		size_t space = URING_BUFFER_SIZE - w->current->length;
+		size_t n = len < space ? len : space;
+		memcpy(w->current->data + w->current->length, data, n);
+		w->current->length += n;
+		data += n;
+		len -= n;
+
+		if (w->current->length == URING_BUFFER_SIZE)
+			writer_queue_current(w);
+	}
+}
+
+long uring_writer_sync(uring_writer *w)
+{
+	if (w->current->length > 0)
+		writer_queue_current(w);
+	while (w->in_flight > 0)
+		writer_wait(w);
+	return w->error ? -1 : w->offset;
+}
+
+int uring_writer_close(uring_writer *w)
+{
+	int ret = uring_writer_sync(w) == -1 ? -1 : 0;
+	ring_exit(&w->r);
+	if (close(w->fd) == -1)
+		ret = -1;
+	free(w->memory);
+	free(w);
+	return ret;
+}
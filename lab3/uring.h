@@ -0,0 +1,63 @@
+/*
+ * File: uring.h
+ * Description:
+ * 	io_uring input and output for multi-lookup --uring, using the raw
+ *	system calls so no extra library is needed.
+ *
+ *	Input files are read URING_BUFFER_SIZE bytes at a time into buffers
+ *	registered with the kernel, with up to URING_READ_BUFFERS reads
+ *	outstanding. The reader is wrapped in a stdio FILE, so requesters
+ *	parse and ftell it exactly like a file from fopen.
+ *
+ *	Output is collected in registered buffers and each full buffer is
+ *	queued as one write at its file offset. Writes are submitted in a
+ *	batch whenever the writer runs out of free buffers or is synced, and
+ *	the calling thread reaps the completions at the same time. Either way
+ *	the kernel is entered about once per buffer instead of once per few
+ *	kilobytes.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_READ_BUFFERS 4
+#define URING_WRITE_BUFFERS 4
+
+typedef struct uring_writer_s uring_writer;
+
+/* Function to report whether the running kernel allows io_uring */
+int uring_supported();
+
+/* Function to open path for reading through io_uring
+ * The stream supports fscanf, ftell and fseek (SEEK_SET or SEEK_CUR)
+ * Returns NULL on failure
+ */
+FILE *uring_fopen(const char *path);
+
+/* Function to start a writer that appends to fd at its current offset
+ * On success the writer takes ownership of fd
+ * Returns NULL on failure
+ */
+uring_writer *uring_writer_open(int fd);
+
+/* Function to append len bytes
+ * Not thread-safe; callers must serialize writes
+ */
+void uring_writer_write(uring_writer *w, const char *data, size_t len);
+
+/* Function to write everything appended so far and wait for it to complete
+ * Not thread-safe with respect to uring_writer_write
+ * Returns the file length afterwards, or -1 if any write failed
+ */
+long uring_writer_sync(uring_writer *w);
+
+/* Function to sync the writer and close its file
+ * Returns 0 on success or -1 if any data could not be written
+ */
+int uring_writer_close(uring_writer *w);
+
+#endif
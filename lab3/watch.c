@@ -0,0 +1,338 @@
+/*
+ * File: watch.c
+ * Description:
+ * 	inotify driven spool directory resolver. The main thread turns
+ *	directory events into work items; a small pool of requester threads
+ *	reads each file from its last committed offset and feeds the shared
+ *	resolver queue.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "journal.h"
+#include "affinity.h"
+#include "multi-lookup.h"
+
+static const char INPUT_FS[] = "%1024s";
+static const char JOURNAL_NAME[] = "progress.journal";
+static const char OUTPUT_SUFFIX[] = ".results";
+
+typedef struct watched_file_s watched_file;
+
+struct watched_file_s {
+	char *name;
+	char *input_path;
+	char *output_path;
+	// open only while a requester is working through the file
+	FILE *output_fp;
+	// last committed position; only used by the requester processing this file
+	long offset;
+	long output_length;
+	// names submitted but not yet written, protected by lock
+	int outstanding;
+	pthread_mutex_t lock;
+	pthread_cond_t drained;
+	// on the work list or being processed, protected by lock_work
+	int queued;
+	// closed again while queued, so it needs another pass, protected by lock_work
+	int dirty;
+	watched_file *next;
+	watched_file *next_work;
+};
+
+static journal progress;
+static const char *spool_path;
+static const char *output_dir_path;
+
+static watched_file *all_files = NULL;
+static watched_file *work_head = NULL;
+static watched_file *work_tail = NULL;
+static pthread_mutex_t lock_work = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+
+
+static char *join_path(const char *dir, const char *name, const char *suffix)
+{
+	char *path = malloc(strlen(dir) + strlen(name) + strlen(suffix) + 2);
+	if (path)
+		sprintf(path, "%s/%s%s", dir, name, suffix);
+	return path;
+}
+
+static watched_file *create_watched_file(const char *name)
+{
+	watched_file *f = calloc(1, sizeof(watched_file));
+	if (!f)
+		return NULL;
+
+	f->name = strdup(name);
+	f->input_path = join_path(spool_path, name, "");
+	f->output_path = join_path(output_dir_path, name, OUTPUT_SUFFIX);
+	if (!f->name || !f->input_path || !f->output_path) {
+		free(f->name);
+		free(f->input_path);
+		free(f->output_path);
+		free(f);
+		return NULL;
+	}
+
+	// resume from whatever an earlier watcher committed
+	journal_find(&progress, name, &f->offset, &f->output_length);
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->drained, NULL);
+	return f;
+}
+
+// must be called with lock_work held
+static void push_work(watched_file *f)
+{
+	f->next_work = NULL;
+	if (work_tail)
+		work_tail->next_work = f;
+	else
+		work_head = f;
+	work_tail = f;
+	pthread_cond_signal(&work_available);
+}
+
+static void schedule_file(const char *name)
+{
+	pthread_mutex_lock(&lock_work);
+
+	watched_file *f = all_files;
+	while (f && strcmp(f->name, name) != 0)
+		f = f->next;
+
+	if (!f) {
+		f = create_watched_file(name);
+		if (!f) {
+			pthread_mutex_unlock(&lock_work);
+			fprintf(stderr, "Failed to allocate state for %s.\n", name);
+			return;
+		}
+		f->next = all_files;
+		all_files = f;
+	}
+
+	if (f->queued)
+		f->dirty = 1;
+	else {
+		f->queued = 1;
+		push_work(f);
+	}
+
+	pthread_mutex_unlock(&lock_work);
+}
+
+static void watch_result(lookup_job *job, const char *ip_str)
+{
+	watched_file *f = (watched_file *)job->context;
+
+	pthread_mutex_lock(&f->lock);
+	fprintf(f->output_fp, "%s,%s\n", job->hostname, ip_str);
+	if (--f->outstanding == 0)
+		pthread_cond_signal(&f->drained);
+	pthread_mutex_unlock(&f->lock);
+}
+
+// waits for every submitted name to be written, then records input offset and output length together
+static void commit_progress(watched_file *f, long offset)
+{
+	pthread_mutex_lock(&f->lock);
+	while (f->outstanding > 0)
+		pthread_cond_wait(&f->drained, &f->lock);
+	fflush(f->output_fp);
+	struct stat st;
+	long output_length = fstat(fileno(f->output_fp), &st) == 0 ? st.st_size : f->output_length;
+	pthread_mutex_unlock(&f->lock);
+
+	f->offset = offset;
+	f->output_length = output_length;
+	if (journal_record(&progress, f->name, offset, output_length) == JOURNAL_FAILURE ||
+	    journal_commit(&progress) == JOURNAL_FAILURE)
+		fprintf(stderr, "Failed to record progress for %s.\n", f->name);
+}
+
+static void process_file(watched_file *f)
+{
+	FILE *input_fp = fopen(f->input_path, "r");
+	if (!input_fp)
+		return;
+
+	struct stat st;
+	if (fstat(fileno(input_fp), &st) == -1) {
+		fclose(input_fp);
+		return;
+	}
+
+	// a file that shrank has been replaced, so its old results no longer apply
+	if (st.st_size < f->offset) {
+		f->offset = 0;
+		f->output_length = 0;
+	}
+	if (st.st_size == f->offset) {
+		fclose(input_fp);
+		return;
+	}
+
+	// anything past the committed length was written after the last commit, and will be resolved again
+	int fd = open(f->output_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd == -1 || ftruncate(fd, f->output_length) == -1 || !(f->output_fp = fdopen(fd, "a"))) {
+		fprintf(stderr, "Failed to open output file %s.\n", f->output_path);
+		if (fd != -1)
+			close(fd);
+		fclose(input_fp);
+		return;
+	}
+
+	fseek(input_fp, f->offset, SEEK_SET);
+
+	char hostname[MAX_NAME_LENGTH];
+	long names = 0;
+	while (fscanf(input_fp, INPUT_FS, hostname) > 0) {
+		lookup_job *job = create_job(hostname, watch_result, f);
+		if (!job) {
+			fprintf(stderr, "Failed to allocate job for %s.\n", hostname);
+			continue;
+		}
+
+		pthread_mutex_lock(&f->lock);
+		f->outstanding++;
+		pthread_mutex_unlock(&f->lock);
+		submit_job(job);
+
+		if (++names % WATCH_COMMIT_INTERVAL == 0)
+			commit_progress(f, ftell(input_fp));
+	}
+
+	commit_progress(f, ftell(input_fp));
+
+	fclose(f->output_fp);
+	f->output_fp = NULL;
+	fclose(input_fp);
+}
+
+static void *watch_requester_entry_point()
+{
+	affinity_pin_self();
+	while (1) {
+		pthread_mutex_lock(&lock_work);
+		while (work_head == NULL)
+			pthread_cond_wait(&work_available, &lock_work);
+		watched_file *f = work_head;
+		work_head = f->next_work;
+		if (work_head == NULL)
+			work_tail = NULL;
+		pthread_mutex_unlock(&lock_work);
+
+		process_file(f);
+
+		pthread_mutex_lock(&lock_work);
+		if (f->dirty) {
+			f->dirty = 0;
+			push_work(f);
+		}
+		else
+			f->queued = 0;
+		pthread_mutex_unlock(&lock_work);
+	}
+	return NULL;
+}
+
+static void scan_spool()
+{
+	DIR *dp = opendir(spool_path);
+	if (!dp) {
+		perror("Error scanning spool directory");
+		return;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		struct stat st;
+		char *path = join_path(spool_path, de->d_name, "");
+		if (path && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			schedule_file(de->d_name);
+		free(path);
+	}
+
+	closedir(dp);
+}
+
+int run_watch(const char *spool_dir, const char *output_dir)
+{
+	spool_path = spool_dir;
+	output_dir_path = output_dir;
+
+	if (mkdir(output_dir, 0755) == -1 && errno != EEXIST) {
+		perror("Error creating output directory");
+		return EXIT_FAILURE;
+	}
+
+	char *journal_path = join_path(output_dir, JOURNAL_NAME, "");
+	if (!journal_path || journal_open(&progress, journal_path) == JOURNAL_FAILURE) {
+		fprintf(stderr, "Failed to open progress journal in %s.\n", output_dir);
+		free(journal_path);
+		return EXIT_FAILURE;
+	}
+	free(journal_path);
+
+	// watch before scanning, so a file closed during the scan is not missed
+	int inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd == -1 || inotify_add_watch(inotify_fd, spool_dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		perror("Error watching spool directory");
+		journal_close(&progress);
+		return EXIT_FAILURE;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < WATCH_REQUESTER_THREADS; i++) {
+		pthread_t thread;
+		pthread_create(&thread, &attr, watch_requester_entry_point, NULL);
+	}
+	pthread_attr_destroy(&attr);
+
+	scan_spool();
+
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t length = read(inotify_fd, events, sizeof(events));
+		if (length == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("Error reading inotify events");
+			break;
+		}
+
+		for (char *p = events; p < events + length; ) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + event->len;
+
+			// events were dropped, so fall back to looking at everything once
+			if (event->mask & IN_Q_OVERFLOW)
+				scan_spool();
+			else if (!(event->mask & IN_ISDIR) && event->len > 0 && event->name[0] != '.')
+				schedule_file(event->name);
+		}
+	}
+
+	close(inotify_fd);
+	journal_close(&progress);
+	return EXIT_FAILURE;
+}
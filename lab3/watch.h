@@ -0,0 +1,29 @@
+/*
+ * File: watch.h
+ * Description:
+ * 	Spool directory mode. multi-lookup --watch <spool-dir> <output-dir>
+ *	resolves every file in spool-dir and then uses inotify to pick up files
+ *	as they are closed after writing or moved into the directory. Results
+ *	for spool-dir/name are appended to output-dir/name.results.
+ *
+ *	Progress is kept in output-dir/progress.journal (see journal.h), so a
+ *	file that grows is resumed from where it was last committed and a
+ *	restarted watcher only resolves work it has not finished before.
+ *	Files whose names start with '.' are ignored, so producers can write
+ *	to a hidden temporary name and rename it into place.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#define WATCH_REQUESTER_THREADS 4
+// progress is committed after this many names, and at the end of each pass over a file
+#define WATCH_COMMIT_INTERVAL 4096
+
+/* Function to watch spool_dir forever
+ * Resolver threads must already be running
+ * Only returns (with EXIT_FAILURE) if the directories or journal cannot be set up
+ */
+int run_watch(const char *spool_dir, const char *output_dir);
+
+#endif
@@ -12,8 +12,97 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "aes-crypt.h"
+#include "block-crypt.h"
+#include "crypt-pool.h"
+
+/* Convert between plaintext and the block format pa5-endfs uses (see block-crypt.h)
+ * Unlike CBC, its blocks are independent, so each chunk is split between
+ * one thread per CPU. Returns SUCCESS or FAILURE.
+ */
+static int do_block_crypt(const char* in_path, const char* out_path,
+			  int action, const char* key_str){
+
+    block_key key;
+    block_header header;
+    block_scratch scratch;
+    crypt_pool* pool = NULL;
+    char* buf = malloc(BLOCK_CHUNK_SIZE);
+    int threads = crypt_pool_default_threads();
+    int result = FAILURE;
+    int in_fd = -1;
+    int out_fd = -1;
+    off_t offset = 0;
+    ssize_t got;
+
+    if(!buf || block_key_init(&key, key_str) != 0 ||
+       block_scratch_init(&scratch, &key) != 0){
+	fprintf(stderr, "cipher setup failed\n");
+	free(buf);
+	return FAILURE;
+    }
+    /* Without workers the chunks are still done, on this thread alone */
+    if(threads > 1){
+	pool = crypt_pool_create(threads - 1, &key);
+    }
+    scratch.pool = pool;
+
+    in_fd = open(in_path, O_RDONLY);
+    out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(in_fd == -1 || out_fd == -1){
+	perror("open error");
+	goto cleanup;
+    }
+
+    if(action == 1){
+	if(block_header_init(out_fd, &header) != 0){
+	    fprintf(stderr, "header write failed\n");
+	    goto cleanup;
+	}
+	while((got = read(in_fd, buf, BLOCK_CHUNK_SIZE)) > 0){
+	    if(block_pwrite(out_fd, &header, &scratch, buf, got, offset) != got){
+		fprintf(stderr, "block write failed\n");
+		goto cleanup;
+	    }
+	    offset += got;
+	}
+    }
+    else{
+	if(block_header_read(in_fd, &header) != 0){
+	    fprintf(stderr, "input is not in block format\n");
+	    goto cleanup;
+	}
+	while((got = block_pread(in_fd, &header, &scratch, buf, BLOCK_CHUNK_SIZE, offset)) > 0){
+	    if(write(out_fd, buf, got) != got){
+		perror("write error");
+		goto cleanup;
+	    }
+	    offset += got;
+	}
+    }
+    if(got < 0){
+	fprintf(stderr, "read failed\n");
+	goto cleanup;
+    }
+    result = SUCCESS;
+
+ cleanup:
+    if(in_fd != -1){
+	close(in_fd);
+    }
+    if(out_fd != -1){
+	close(out_fd);
+    }
+    block_scratch_free(&scratch);
+    if(pool){
+	crypt_pool_destroy(pool);
+    }
+    free(buf);
+    return result;
+}
 
 int main(int argc, char **argv)
 {
@@ -25,6 +114,8 @@ int main(int argc, char **argv)
     FILE* inFile = NULL;
     FILE* outFile = NULL;
     char* key_str = NULL;
+    crypt_key key;
+    crypt_ctx ctx;
 
     /* Check General Input */
     if(argc < 3){
@@ -61,6 +152,17 @@ int main(int argc, char **argv)
 	ofarg = 4;
 	action = 0;
     }
+    /* Block Format Cases */
+    else if(!strcmp(argv[1], "-E") || !strcmp(argv[1], "-D")){
+	/* Check Args */
+	if(argc != 5){
+	    fprintf(stderr, "usage: %s %s %s\n", argv[0], argv[1],
+		    "<key phrase> <in path> <out path>");
+	    exit(EXIT_FAILURE);
+	}
+	return do_block_crypt(argv[3], argv[4], !strcmp(argv[1], "-E"), argv[2])
+	    ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     /* Pass-Through (Copy) Case */
     else if(!strcmp(argv[1], "-c")){
 	/* Check Args */
@@ -94,7 +196,19 @@ int main(int argc, char **argv)
     }
 
     /* Perform do_crpt action (encrypt, decrypt, copy) */
-    if(!do_crypt(inFile, outFile, action, key_str)){
+    if(action >= 0){
+	/* Derive the key and set up the engine once, then stream through it */
+	if(!crypt_key_init(&key, EVP_aes_256_cbc(), key_str) ||
+	   !crypt_ctx_init(&ctx, &key, action)){
+	    fprintf(stderr, "cipher setup failed\n");
+	    return EXIT_FAILURE;
+	}
+	if(!do_crypt_ctx(inFile, outFile, &ctx)){
+	    fprintf(stderr, "do_crypt failed\n");
+	}
+	crypt_ctx_cleanup(&ctx);
+    }
+    else if(!do_crypt(inFile, outFile, action, key_str)){
 	fprintf(stderr, "do_crypt failed\n");
     }
 
@@ -17,13 +17,78 @@
 
 #include "aes-crypt.h"
 
-#define BLOCKSIZE 1024
-#define FAILURE 0
-#define SUCCESS 1
+extern int crypt_key_init(crypt_key* key, const EVP_CIPHER* cipher, const char* key_str){
+    int nrounds = 5;
+    int i;
 
-extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
-    /* Local Vars */
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    /* Build Key from String */
+    i = EVP_BytesToKey(cipher, EVP_sha1(), NULL,
+		       (unsigned char*)key_str, strlen(key_str), nrounds, key->key, key->iv);
+    if (i != EVP_CIPHER_key_length(cipher)) {
+	/* Error */
+	fprintf(stderr, "Key size is %d bits - should be %d bits\n", i*8,
+		EVP_CIPHER_key_length(cipher)*8);
+	return FAILURE;
+    }
+    key->cipher = cipher;
+    return SUCCESS;
+}
+
+extern int crypt_ctx_init(crypt_ctx* ctx, const crypt_key* key, int action){
+    ctx->key = key;
+    ctx->evp = EVP_CIPHER_CTX_new();
+    if(!ctx->evp){
+	return FAILURE;
+    }
+    /* The key schedule is built here, once */
+    if(!EVP_CipherInit_ex(ctx->evp, key->cipher, NULL, key->key, key->iv, action)){
+	crypt_ctx_cleanup(ctx);
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int crypt_reset_iv(crypt_ctx* ctx, const unsigned char* iv){
+    /* A NULL key keeps the schedule, -1 keeps the direction */
+    if(!EVP_CipherInit_ex(ctx->evp, NULL, NULL, NULL, iv ? iv : ctx->key->iv, -1)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int crypt_buf(crypt_ctx* ctx, const unsigned char* in, unsigned char* out, int len,
+		     const unsigned char* iv){
+    int outlen;
 
+    if(iv && !crypt_reset_iv(ctx, iv)){
+	return -1;
+    }
+    if(!EVP_CipherUpdate(ctx->evp, out, &outlen, in, len)){
+	return -1;
+    }
+    return outlen;
+}
+
+extern int crypt_final(crypt_ctx* ctx, unsigned char* out){
+    int outlen;
+
+    if(!EVP_CipherFinal_ex(ctx->evp, out, &outlen)){
+	return -1;
+    }
+    return outlen;
+}
+
+extern void crypt_ctx_cleanup(crypt_ctx* ctx){
+    EVP_CIPHER_CTX_free(ctx->evp);
+    ctx->evp = NULL;
+}
+
+extern int do_crypt_ctx(FILE* in, FILE* out, crypt_ctx* ctx){
     /* Buffers */
     unsigned char inbuf[BLOCKSIZE];
     int inlen;
@@ -32,34 +97,10 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     int outlen;
     int writelen;
 
-    /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
-    unsigned char key[32];
-    unsigned char iv[32];
-    int nrounds = 5;
-    
-    /* tmp vars */
-    int i;
-
-    /* Setup Encryption Key and Cipher Engine if in cipher mode */
-    if(action >= 0){
-	if(!key_str){
-	    /* Error */
-	    fprintf(stderr, "Key_str must not be NULL\n");
-	    return 0;
-	}
-	/* Build Key from String */
-	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-			   (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-	if (i != 32) {
-	    /* Error */
-	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
-	    return 0;
-	}
-	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
-    }    
+    /* Start from the derived IV, as a fresh engine would */
+    if(!crypt_reset_iv(ctx, NULL)){
+	return FAILURE;
+    }
 
     /* Loop through Input File*/
     for(;;){
@@ -69,20 +110,12 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	    /* EOF -> Break Loop */
 	    break;
 	}
-	
-	/* If in cipher mode, perform cipher transform on block */
-	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
-		{
-		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
-		    return 0;
-		}
-	}
-	/* If in pass-through mode. copy block as is */
-	else{
-	    memcpy(outbuf, inbuf, inlen);
-	    outlen = inlen;
+
+	/* Perform cipher transform on block */
+	outlen = crypt_buf(ctx, inbuf, outbuf, inlen, NULL);
+	if(outlen < 0){
+	    /* Error */
+	    return FAILURE;
 	}
 
 	/* Write Block */
@@ -90,25 +123,64 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
-	    return 0;
+	    return FAILURE;
 	}
     }
-    
-    /* If in cipher mode, handle necessary padding */
+
+    /* Handle remaining cipher block + padding */
+    outlen = crypt_final(ctx, outbuf);
+    if(outlen < 0){
+	/* Error */
+	return FAILURE;
+    }
+    /* Write remainign cipher block + padding*/
+    fwrite(outbuf, sizeof(*outbuf), outlen, out);
+
+    /* Success */
+    return SUCCESS;
+}
+
+extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
+    /* Local Vars */
+
+    /* Buffers */
+    unsigned char buf[BLOCKSIZE];
+    int len;
+    int writelen;
+
+    /* Cipher vars */
+    crypt_key key;
+    crypt_ctx ctx;
+    int res;
+
+    /* If in cipher mode, set up the key and engine and run through them */
     if(action >= 0){
-	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
-	    {
-		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
-	    }
-	/* Write remainign cipher block + padding*/
-	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	if(!crypt_key_init(&key, EVP_aes_256_cbc(), key_str)){
+	    return FAILURE;
+	}
+	if(!crypt_ctx_init(&ctx, &key, action)){
+	    return FAILURE;
+	}
+	res = do_crypt_ctx(in, out, &ctx);
+	crypt_ctx_cleanup(&ctx);
+	return res;
+    }
+
+    /* If in pass-through mode, copy blocks as is */
+    for(;;){
+	len = fread(buf, sizeof(*buf), BLOCKSIZE, in);
+	if(len <= 0){
+	    /* EOF -> Break Loop */
+	    break;
+	}
+	writelen = fwrite(buf, sizeof(*buf), len, out);
+	if(writelen != len){
+	    /* Error */
+	    perror("fwrite error");
+	    return FAILURE;
+	}
     }
-    
+
     /* Success */
-    return 1;
+    return SUCCESS;
 }
@@ -39,4 +39,68 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* A key derived from a passphrase for one cipher, once, along with the IV
+ * do_crypt() would use. Derivation is the same as do_crypt()'s, so a
+ * crypt_key for EVP_aes_256_cbc() reads and writes do_crypt() files.
+ */
+typedef struct crypt_key_s {
+    const EVP_CIPHER* cipher;
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+} crypt_key;
+
+/* A cipher engine set up with a crypt_key for one direction. The key
+ * schedule is built once, so each message after that costs only an IV
+ * reset. Not safe to share between threads.
+ */
+typedef struct crypt_ctx_s {
+    EVP_CIPHER_CTX* evp;
+    const crypt_key* key;
+} crypt_ctx;
+
+/* int crypt_key_init(crypt_key* key, const EVP_CIPHER* cipher, const char* key_str)
+ * Purpose: Derive the key and IV for cipher from a passphrase
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_key_init(crypt_key* key, const EVP_CIPHER* cipher, const char* key_str);
+
+/* int crypt_ctx_init(crypt_ctx* ctx, const crypt_key* key, int action)
+ * Purpose: Set up a cipher engine with key, which must outlive it
+ * Args: int action : Cipher action (1=encrypt, 0=decrypt)
+ * Return: FAILURE on error, SUCCESS on success
+ * The engine starts at the key's derived IV, as do_crypt() does
+ */
+extern int crypt_ctx_init(crypt_ctx* ctx, const crypt_key* key, int action);
+
+/* int crypt_reset_iv(crypt_ctx* ctx, const unsigned char* iv)
+ * Purpose: Start a new message at iv, or at the key's derived IV if iv is NULL,
+ *          keeping the key schedule
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_reset_iv(crypt_ctx* ctx, const unsigned char* iv);
+
+/* int crypt_buf(crypt_ctx* ctx, const unsigned char* in, unsigned char* out, int len, const unsigned char* iv)
+ * Purpose: Cipher len bytes of in into out, starting a new message at iv first
+ *          unless iv is NULL, in which case the current message continues
+ * Return: the number of bytes written to out, or -1 on error
+ * Padded modes hold back up to a block until crypt_final(), so out should
+ * have room for len plus one cipher block
+ */
+extern int crypt_buf(crypt_ctx* ctx, const unsigned char* in, unsigned char* out, int len,
+		     const unsigned char* iv);
+
+/* int crypt_final(crypt_ctx* ctx, unsigned char* out)
+ * Purpose: Finish the current message, writing any padding block to out
+ * Return: the number of bytes written to out, or -1 on error
+ */
+extern int crypt_final(crypt_ctx* ctx, unsigned char* out);
+
+extern void crypt_ctx_cleanup(crypt_ctx* ctx);
+
+/* int do_crypt_ctx(FILE* in, FILE* out, crypt_ctx* ctx)
+ * Purpose: do_crypt() with an engine that is already set up
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int do_crypt_ctx(FILE* in, FILE* out, crypt_ctx* ctx);
+
 #endif
@@ -0,0 +1,669 @@
+/* block-cache.c
+ * Cache of decrypted blocks for pa5-endfs
+ *
+ * See block-cache.h for how it behaves.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "block-cache.h"
+
+#define NO_SLOT -1
+/* the most shards a cache is split into; each gets at least SHARD_MIN_SLOTS slots */
+#define MAX_SHARDS 16
+#define SHARD_MIN_SLOTS (2 * BLOCK_CHUNK_BLOCKS)
+
+/* a file with dirty blocks, kept so they can be written back from anywhere */
+typedef struct cache_file_s {
+	ino_t ino;
+	uint64_t tag;
+	/* a dup of the fd the first dirty block was written through */
+	int fd;
+	block_header header;
+	/* the file is forgotten when its last dirty block is written back */
+	int dirty;
+	struct cache_file_s *next;
+} cache_file;
+
+typedef struct cache_slot_s {
+	ino_t ino;
+	uint64_t tag;
+	uint64_t index;
+	/* set while the block is dirty */
+	cache_file *file;
+	size_t length;
+	/* next slot in the same bucket */
+	int next;
+	unsigned char used;
+	unsigned char referenced;
+} cache_slot;
+
+/* a dirty block, for putting a file's dirty blocks in order */
+typedef struct flush_entry_s {
+	uint64_t index;
+	int slot;
+} flush_entry;
+
+/* the blocks of one file always go to the same shard, which has its own lock, slots and CLOCK hand */
+typedef struct cache_shard_s {
+	pthread_mutex_t lock;
+	/* its chunk holds runs of blocks being read in or written back */
+	block_scratch scratch;
+	cache_slot *slots;
+	unsigned char *data;
+	int slot_count;
+	int *buckets;
+	size_t bucket_mask;
+	/* the CLOCK hand */
+	int hand;
+	cache_file *files;
+	/* slot_count entries for flush_file */
+	flush_entry *flush_order;
+	block_cache_stats stats;
+} cache_shard;
+
+struct block_cache_s {
+	block_key key;
+	int shard_count;
+	cache_shard *shards;
+};
+
+static uint64_t header_tag(const block_header *header)
+{
+	uint64_t tag;
+	memcpy(&tag, header->nonce, sizeof(tag));
+	return tag;
+}
+
+static size_t bucket_of(const cache_shard *shard, ino_t ino, uint64_t tag, uint64_t index)
+{
+	uint64_t hash = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ tag ^ index * 0xc2b2ae3d27d4eb4fULL;
+	hash ^= hash >> 29;
+	return hash & shard->bucket_mask;
+}
+
+static unsigned char *slot_data(const cache_shard *shard, int slot)
+{
+	return shard->data + (size_t)slot * BLOCK_SIZE;
+}
+
+static int lookup(const cache_shard *shard, ino_t ino, uint64_t tag, uint64_t index)
+{
+	int slot = shard->buckets[bucket_of(shard, ino, tag, index)];
+	while (slot != NO_SLOT) {
+		const cache_slot *s = &shard->slots[slot];
+		if (s->index == index && s->ino == ino && s->tag == tag)
+			return slot;
+		slot = s->next;
+	}
+	return NO_SLOT;
+}
+
+static void insert(cache_shard *shard, int slot, ino_t ino, uint64_t tag, uint64_t index)
+{
+	cache_slot *s = &shard->slots[slot];
+	size_t bucket = bucket_of(shard, ino, tag, index);
+	s->ino = ino;
+	s->tag = tag;
+	s->index = index;
+	s->file = NULL;
+	s->length = 0;
+	s->used = 1;
+	s->referenced = 1;
+	s->next = shard->buckets[bucket];
+	shard->buckets[bucket] = slot;
+}
+
+static void remove_slot(cache_shard *shard, int slot)
+{
+	cache_slot *s = &shard->slots[slot];
+	int *link = &shard->buckets[bucket_of(shard, s->ino, s->tag, s->index)];
+	while (*link != slot)
+		link = &shard->slots[*link].next;
+	*link = s->next;
+	s->used = 0;
+}
+
+static void mark_clean(cache_shard *shard, cache_slot *s)
+{
+	cache_file *file = s->file;
+	s->file = NULL;
+	if (--file->dirty > 0)
+		return;
+
+	cache_file **link = &shard->files;
+	while (*link != file)
+		link = &(*link)->next;
+	*link = file->next;
+	close(file->fd);
+	free(file);
+}
+
+static int mark_dirty(cache_shard *shard, cache_slot *s, int fd, const block_header *header)
+{
+	if (s->file)
+		return 0;
+
+	cache_file *file = shard->files;
+	while (file && (file->ino != s->ino || file->tag != s->tag))
+		file = file->next;
+	if (!file) {
+		file = malloc(sizeof(*file));
+		if (!file)
+			return -ENOMEM;
+		file->fd = dup(fd);
+		if (file->fd == -1) {
+			int res = -errno;
+			free(file);
+			return res;
+		}
+		file->ino = s->ino;
+		file->tag = s->tag;
+		file->header = *header;
+		file->dirty = 0;
+		file->next = shard->files;
+		shard->files = file;
+	}
+	file->dirty++;
+	s->file = file;
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	uint64_t x = ((const flush_entry *)a)->index;
+	uint64_t y = ((const flush_entry *)b)->index;
+	return x < y ? -1 : x > y;
+}
+
+/* writes back every dirty block of file, each run of consecutive blocks encrypted together
+ * and written with one pwrite; the file is forgotten once they are all clean
+ */
+static int flush_file(cache_shard *shard, cache_file *file)
+{
+	int count = 0;
+	for (int slot = 0; slot < shard->slot_count; slot++) {
+		if (shard->slots[slot].used && shard->slots[slot].file == file) {
+			shard->flush_order[count].index = shard->slots[slot].index;
+			shard->flush_order[count].slot = slot;
+			count++;
+		}
+	}
+	qsort(shard->flush_order, count, sizeof(flush_entry), compare_entries);
+
+	unsigned char *chunk = block_scratch_chunk(&shard->scratch);
+	if (!chunk)
+		return -ENOMEM;
+	int start = 0;
+	while (start < count) {
+		/* only the last block of a file is short, so it can only end a run */
+		uint64_t first = shard->flush_order[start].index;
+		size_t span = 0;
+		int end = start;
+		while (end < count && end - start < BLOCK_CHUNK_BLOCKS &&
+		       shard->flush_order[end].index == first + (end - start) && span % BLOCK_SIZE == 0) {
+			cache_slot *s = &shard->slots[shard->flush_order[end].slot];
+			memcpy(chunk + span, slot_data(shard, shard->flush_order[end].slot), s->length);
+			span += s->length;
+			end++;
+		}
+
+		if (block_crypt_run(&shard->scratch, &file->header, first, chunk, span, BLOCK_ENCRYPT) != 0)
+			return -EIO;
+		size_t stored = block_stored_size(span);
+		ssize_t res = pwrite(file->fd, chunk, stored, BLOCK_HEADER_SIZE + first * BLOCK_SIZE);
+		if (res == -1)
+			return -errno;
+		if ((size_t)res != stored)
+			return -EIO;
+		shard->stats.writebacks += end - start;
+		/* the last of these may free file */
+		for (int i = start; i < end; i++)
+			mark_clean(shard, &shard->slots[shard->flush_order[i].slot]);
+		start = end;
+	}
+	return 0;
+}
+
+/* returns a free slot, evicting the next one the CLOCK hand finds unreferenced */
+static int take_slot(cache_shard *shard)
+{
+	for (;;) {
+		int slot = shard->hand;
+		cache_slot *s = &shard->slots[slot];
+		shard->hand = (shard->hand + 1) % shard->slot_count;
+		if (!s->used)
+			return slot;
+		if (s->referenced) {
+			s->referenced = 0;
+			continue;
+		}
+		/* the rest of the file's dirty blocks are likely to go soon too */
+		if (s->file) {
+			int res = flush_file(shard, s->file);
+			if (res != 0)
+				return res;
+		}
+		remove_slot(shard, slot);
+		shard->stats.evictions++;
+		return slot;
+	}
+}
+
+/* returns the slot holding block index, reading and decrypting its length bytes on a miss */
+static int get_block(cache_shard *shard, int fd, const block_header *header, ino_t ino,
+		     uint64_t index, size_t length, int need_contents)
+{
+	uint64_t tag = header_tag(header);
+	int slot = lookup(shard, ino, tag, index);
+	if (slot != NO_SLOT) {
+		shard->stats.hits++;
+		shard->slots[slot].referenced = 1;
+		return slot;
+	}
+	shard->stats.misses++;
+
+	slot = take_slot(shard);
+	if (slot < 0)
+		return slot;
+	unsigned char *data = slot_data(shard, slot);
+	if (need_contents && length > 0) {
+		size_t stored = block_stored_size(length);
+		ssize_t res = pread(fd, data, stored, BLOCK_HEADER_SIZE + index * BLOCK_SIZE);
+		if (res == -1)
+			return -errno;
+		if ((size_t)res != stored ||
+		    block_crypt(&shard->scratch, header, index, data, data, length, BLOCK_DECRYPT) != 0)
+			return -EIO;
+	}
+	insert(shard, slot, ino, tag, index);
+	shard->slots[slot].length = need_contents ? length : 0;
+	return slot;
+}
+
+/* reads in the run of uncached blocks from first up to last, at most a chunk, with one pread
+ * and decrypts them together; returns the slot of block first
+ */
+static int load_run(cache_shard *shard, int fd, const block_header *header, ino_t ino,
+		    off_t plain_size, uint64_t first, uint64_t last)
+{
+	uint64_t tag = header_tag(header);
+	int slots[BLOCK_CHUNK_BLOCKS];
+	/* a run never evicts its own blocks */
+	int limit = shard->slot_count / 2 > 1 ? shard->slot_count / 2 : 1;
+	if (limit > BLOCK_CHUNK_BLOCKS)
+		limit = BLOCK_CHUNK_BLOCKS;
+	int count = 1;
+	while (count < limit && first + count <= last && lookup(shard, ino, tag, first + count) == NO_SLOT)
+		count++;
+
+	/* slots are taken before the chunk is used, since evicting may write back through it */
+	int res = 0;
+	int taken = 0;
+	for (; taken < count; taken++) {
+		slots[taken] = take_slot(shard);
+		if (slots[taken] < 0) {
+			res = slots[taken];
+			break;
+		}
+		insert(shard, slots[taken], ino, tag, first + taken);
+	}
+
+	off_t run_start = first * BLOCK_SIZE;
+	size_t span = (size_t)count * BLOCK_SIZE;
+	if (plain_size - run_start < (off_t)span)
+		span = plain_size - run_start;
+	unsigned char *chunk = block_scratch_chunk(&shard->scratch);
+	if (res == 0 && !chunk)
+		res = -ENOMEM;
+	if (res == 0) {
+		size_t stored = block_stored_size(span);
+		ssize_t got = pread(fd, chunk, stored, BLOCK_HEADER_SIZE + run_start);
+		if (got == -1)
+			res = -errno;
+		else if ((size_t)got != stored ||
+			 block_crypt_run(&shard->scratch, header, first, chunk, span, BLOCK_DECRYPT) != 0)
+			res = -EIO;
+	}
+	if (res != 0) {
+		for (int i = 0; i < taken; i++)
+			remove_slot(shard, slots[i]);
+		return res;
+	}
+
+	for (int i = 0; i < count; i++) {
+		size_t length = span - (size_t)i * BLOCK_SIZE;
+		if (length > BLOCK_SIZE)
+			length = BLOCK_SIZE;
+		memcpy(slot_data(shard, slots[i]), chunk + (size_t)i * BLOCK_SIZE, length);
+		shard->slots[slots[i]].length = length;
+	}
+	shard->stats.misses += count;
+	return slots[0];
+}
+
+/* writes into the cache from offset, which must not be past plain_size, extending the file if needed */
+static ssize_t write_range(cache_shard *shard, int fd, const block_header *header, ino_t ino,
+			   off_t plain_size, const char *buf, size_t size, off_t offset)
+{
+	off_t old_size = plain_size;
+	size_t done = 0;
+	ssize_t res = 0;
+	while (done < size) {
+		off_t position = offset + done;
+		uint64_t index = position / BLOCK_SIZE;
+		off_t block_start = index * BLOCK_SIZE;
+		size_t skip = position % BLOCK_SIZE;
+		size_t take = size - done;
+		if (take > BLOCK_SIZE - skip)
+			take = BLOCK_SIZE - skip;
+		size_t length = 0;
+		if (plain_size > block_start)
+			length = plain_size - block_start < BLOCK_SIZE ? plain_size - block_start : BLOCK_SIZE;
+
+		/* a block overwritten up to its end needs nothing from disk */
+		int slot = get_block(shard, fd, header, ino, index, length, skip > 0 || skip + take < length);
+		if (slot < 0) {
+			res = slot;
+			break;
+		}
+		cache_slot *s = &shard->slots[slot];
+		res = mark_dirty(shard, s, fd, header);
+		if (res != 0)
+			break;
+		memcpy(slot_data(shard, slot) + skip, buf + done, take);
+		if (skip + take > s->length)
+			s->length = skip + take;
+		if (block_start + (off_t)s->length > plain_size)
+			plain_size = block_start + s->length;
+		done += take;
+	}
+
+	/* blocks past the old end are dirty, so the new space on disk only has to exist */
+	if (plain_size > old_size) {
+		int ret = block_resize(fd, old_size, plain_size);
+		if (ret != 0 && done == 0)
+			return ret;
+	}
+	return done ? (ssize_t)done : res;
+}
+
+static off_t plain_size_of(int fd, ino_t *ino)
+{
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) == -1)
+		return -errno;
+	*ino = stbuf.st_ino;
+	return block_plain_size(fd, stbuf.st_size);
+}
+
+
+/* the nonce in the header is random, so its tag spreads files evenly */
+static cache_shard *shard_of(const block_cache *cache, const block_header *header)
+{
+	return &cache->shards[header_tag(header) % cache->shard_count];
+}
+
+static void shard_free(cache_shard *shard)
+{
+	block_scratch_free(&shard->scratch);
+	free(shard->flush_order);
+	free(shard->slots);
+	free(shard->data);
+	free(shard->buckets);
+}
+
+static int shard_init(cache_shard *shard, int slot_count, const block_key *key)
+{
+	size_t bucket_count = 1;
+	while (bucket_count < (size_t)slot_count)
+		bucket_count <<= 1;
+
+	shard->slots = calloc(slot_count, sizeof(*shard->slots));
+	shard->data = malloc((size_t)slot_count * BLOCK_SIZE);
+	shard->buckets = malloc(bucket_count * sizeof(*shard->buckets));
+	shard->flush_order = malloc(slot_count * sizeof(*shard->flush_order));
+	if (!shard->slots || !shard->data || !shard->buckets || !shard->flush_order ||
+	    block_scratch_init(&shard->scratch, key) != 0) {
+		shard_free(shard);
+		return -ENOMEM;
+	}
+	for (size_t i = 0; i < bucket_count; i++)
+		shard->buckets[i] = NO_SLOT;
+	shard->bucket_mask = bucket_count - 1;
+	shard->slot_count = slot_count;
+	pthread_mutex_init(&shard->lock, NULL);
+	return 0;
+}
+
+/* writes back every dirty block of shard; returns the first error */
+static int shard_flush_all(cache_shard *shard)
+{
+	int res = 0;
+	while (shard->files) {
+		cache_file *file = shard->files;
+		int ret = flush_file(shard, file);
+		if (ret == 0)
+			continue;
+		/* what cannot be written back is dropped, which also forgets the file */
+		if (res == 0)
+			res = ret;
+		for (int slot = 0; slot < shard->slot_count; slot++) {
+			if (shard->slots[slot].used && shard->slots[slot].file == file)
+				mark_clean(shard, &shard->slots[slot]);
+		}
+	}
+	return res;
+}
+
+block_cache *block_cache_create(size_t size, const block_key *key)
+{
+	int slot_count = size / BLOCK_SIZE;
+	if (slot_count < 1)
+		return NULL;
+	int shard_count = slot_count / SHARD_MIN_SLOTS;
+	if (shard_count > MAX_SHARDS)
+		shard_count = MAX_SHARDS;
+	if (shard_count < 1)
+		shard_count = 1;
+
+	block_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->shards = calloc(shard_count, sizeof(*cache->shards));
+	if (!cache->shards) {
+		free(cache);
+		return NULL;
+	}
+	cache->key = *key;
+	for (int i = 0; i < shard_count; i++) {
+		/* the first shards take the slots left over from an even split */
+		int slots = slot_count / shard_count + (i < slot_count % shard_count);
+		if (shard_init(&cache->shards[i], slots, &cache->key) != 0) {
+			while (i-- > 0) {
+				pthread_mutex_destroy(&cache->shards[i].lock);
+				shard_free(&cache->shards[i]);
+			}
+			free(cache->shards);
+			free(cache);
+			return NULL;
+		}
+	}
+	cache->shard_count = shard_count;
+	return cache;
+}
+
+void block_cache_set_pool(block_cache *cache, struct crypt_pool_s *pool)
+{
+	for (int i = 0; i < cache->shard_count; i++)
+		cache->shards[i].scratch.pool = pool;
+}
+
+int block_cache_destroy(block_cache *cache)
+{
+	int res = 0;
+	for (int i = 0; i < cache->shard_count; i++) {
+		int ret = shard_flush_all(&cache->shards[i]);
+		if (res == 0)
+			res = ret;
+		pthread_mutex_destroy(&cache->shards[i].lock);
+		shard_free(&cache->shards[i]);
+	}
+	free(cache->shards);
+	free(cache);
+	return res;
+}
+
+ssize_t block_cache_read(block_cache *cache, int fd, const block_header *header,
+			 char *buf, size_t size, off_t offset)
+{
+	cache_shard *shard = shard_of(cache, header);
+	pthread_mutex_lock(&shard->lock);
+	ino_t ino;
+	ssize_t res = 0;
+	off_t plain_size = plain_size_of(fd, &ino);
+	if (plain_size < 0)
+		res = plain_size;
+	else if (offset >= plain_size)
+		size = 0;
+	else if ((off_t)size > plain_size - offset)
+		size = plain_size - offset;
+
+	uint64_t tag = header_tag(header);
+	size_t done = 0;
+	while (res == 0 && done < size) {
+		off_t position = offset + done;
+		uint64_t index = position / BLOCK_SIZE;
+		size_t skip = position % BLOCK_SIZE;
+
+		int slot = lookup(shard, ino, tag, index);
+		if (slot != NO_SLOT) {
+			shard->stats.hits++;
+			shard->slots[slot].referenced = 1;
+		}
+		else {
+			slot = load_run(shard, fd, header, ino, plain_size, index, (offset + size - 1) / BLOCK_SIZE);
+			if (slot < 0) {
+				res = slot;
+				break;
+			}
+		}
+		size_t available = shard->slots[slot].length;
+		if (available <= skip)
+			break;
+		size_t take = available - skip < size - done ? available - skip : size - done;
+		memcpy(buf + done, slot_data(shard, slot) + skip, take);
+		done += take;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return done ? (ssize_t)done : res;
+}
+
+ssize_t block_cache_write(block_cache *cache, int fd, const block_header *header,
+			  const char *buf, size_t size, off_t offset)
+{
+	if (size == 0)
+		return 0;
+
+	cache_shard *shard = shard_of(cache, header);
+	pthread_mutex_lock(&shard->lock);
+	ino_t ino;
+	ssize_t res = 0;
+	off_t plain_size = plain_size_of(fd, &ino);
+	if (plain_size < 0)
+		res = plain_size;
+
+	/* writing past the end leaves a gap that reads back as zeros */
+	static const char zeros[BLOCK_SIZE];
+	while (res == 0 && plain_size < offset) {
+		size_t length = sizeof(zeros) - plain_size % BLOCK_SIZE;
+		if (offset - plain_size < (off_t)length)
+			length = offset - plain_size;
+		ssize_t written = write_range(shard, fd, header, ino, plain_size, zeros, length, plain_size);
+		if (written < 0)
+			res = written;
+		else if ((size_t)written != length)
+			res = -EIO;
+		else
+			plain_size += length;
+	}
+
+	if (res == 0)
+		res = write_range(shard, fd, header, ino, plain_size, buf, size, offset);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+int block_cache_truncate(block_cache *cache, int fd, const block_header *header, off_t size)
+{
+	cache_shard *shard = shard_of(cache, header);
+	pthread_mutex_lock(&shard->lock);
+	ino_t ino;
+	off_t plain_size = plain_size_of(fd, &ino);
+	if (plain_size < 0) {
+		pthread_mutex_unlock(&shard->lock);
+		return plain_size;
+	}
+
+	/* blocks from the one the old or new end is in onwards change length or go away:
+	 * ones still inside the file are written back, and all of them are dropped */
+	uint64_t tag = header_tag(header);
+	uint64_t first = (size < plain_size ? size : plain_size) / BLOCK_SIZE;
+	int res = 0;
+	cache_file *file = shard->files;
+	while (file && (file->ino != ino || file->tag != tag))
+		file = file->next;
+	if (file)
+		res = flush_file(shard, file);
+	for (int slot = 0; slot < shard->slot_count && res == 0; slot++) {
+		cache_slot *s = &shard->slots[slot];
+		if (s->used && s->ino == ino && s->tag == tag && s->index >= first)
+			remove_slot(shard, slot);
+	}
+
+	if (res == 0)
+		res = block_truncate(fd, header, &shard->scratch, size);
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+int block_cache_flush(block_cache *cache, ino_t ino)
+{
+	int res = 0;
+	/* only the inode number is known here, so every shard is checked for its dirty files */
+	for (int i = 0; i < cache->shard_count && res == 0; i++) {
+		cache_shard *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		/* clean files have no record, so closing them costs nothing */
+		cache_file *file = shard->files;
+		while (file && res == 0) {
+			cache_file *next = file->next;
+			if (file->ino == ino)
+				res = flush_file(shard, file);
+			file = next;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return res;
+}
+
+void block_cache_get_stats(block_cache *cache, block_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < cache->shard_count; i++) {
+		cache_shard *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->stats.hits;
+		stats->misses += shard->stats.misses;
+		stats->evictions += shard->stats.evictions;
+		stats->writebacks += shard->stats.writebacks;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,73 @@
+/* block-cache.h
+ * Cache of decrypted blocks for pa5-endfs
+ *
+ * Blocks of block format files (see block-crypt.h) are kept decrypted in
+ * memory, keyed by inode number and block index, up to a fixed number of
+ * bytes, and evicted in CLOCK order. A write only changes the cached
+ * plaintext and marks the block dirty; dirty blocks are encrypted and
+ * written back when they are evicted, when their file is flushed, and when
+ * the cache is destroyed, a whole file at a time so consecutive blocks go
+ * out in one write. Misses read in the run of uncached blocks a request
+ * covers with one read. The backing file is still resized, and its tail
+ * length recorded, as soon as a write extends it, so block_plain_size()
+ * is always right, and any block whose contents on disk are out of date is
+ * dirty in the cache.
+ *
+ * Files are told apart by inode number and the nonce in their header, so
+ * a reused inode number never hits the blocks of a deleted file.
+ *
+ * Large caches are split into up to 16 shards, each with its own lock,
+ * slots and CLOCK hand, and every file keeps all its blocks in the shard
+ * its nonce picks. A call holds only that shard's lock, including while
+ * it reads, writes and encrypts, so calls on the same file, or files in
+ * the same shard, run one at a time but other files carry on alongside
+ * them. Functions can be called from any FUSE thread, and return 0 or a
+ * byte count on success and a negative errno on failure.
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <sys/types.h>
+
+#include "block-crypt.h"
+
+typedef struct block_cache_stats_s {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long writebacks;
+} block_cache_stats;
+
+typedef struct block_cache_s block_cache;
+
+/* Create a cache of up to size bytes of plaintext for files encrypted with key
+ * Returns NULL if size is less than one block or memory runs out
+ */
+block_cache *block_cache_create(size_t size, const block_key *key);
+
+/* Split runs of blocks read in or written back together between pool's threads
+ * Call before the cache is used; pool must outlive the cache
+ */
+void block_cache_set_pool(block_cache *cache, struct crypt_pool_s *pool);
+
+/* Write back every dirty block and free the cache
+ * Returns 0, or the first error from writing back
+ */
+int block_cache_destroy(block_cache *cache);
+
+/* block_pread() and block_pwrite() through the cache, for the block format file fd */
+ssize_t block_cache_read(block_cache *cache, int fd, const block_header *header,
+			 char *buf, size_t size, off_t offset);
+ssize_t block_cache_write(block_cache *cache, int fd, const block_header *header,
+			  const char *buf, size_t size, off_t offset);
+
+/* block_truncate() for a file that may have blocks in the cache; fd must be writable */
+int block_cache_truncate(block_cache *cache, int fd, const block_header *header, off_t size);
+
+/* Write back the dirty blocks of inode ino, which stay cached */
+int block_cache_flush(block_cache *cache, ino_t ino);
+
+void block_cache_get_stats(block_cache *cache, block_cache_stats *stats);
+
+#endif
@@ -0,0 +1,382 @@
+/* block-crypt.c
+ * Random-access encrypted file format for pa5-endfs
+ *
+ * See block-crypt.h for the layout.
+ *
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "block-crypt.h"
+#include "crypt-pool.h"
+
+/* runs shorter than this are not worth handing to the pool */
+#define PARALLEL_MIN_BLOCKS 16
+
+int block_key_init(block_key *key, const char *key_str)
+{
+	if (crypt_key_init(&key->xts, EVP_aes_256_xts(), key_str) != SUCCESS)
+		return -EINVAL;
+	return 0;
+}
+
+int block_header_read(int fd, block_header *header)
+{
+	ssize_t res = pread(fd, header, sizeof(*header), 0);
+	if (res == -1)
+		return -errno;
+	if (res != sizeof(*header) || memcmp(header->magic, BLOCK_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != BLOCK_VERSION || header->block_size != BLOCK_SIZE)
+		return -ENODATA;
+	return 0;
+}
+
+int block_header_init(int fd, block_header *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, BLOCK_MAGIC, sizeof(header->magic));
+	header->version = BLOCK_VERSION;
+	header->block_size = BLOCK_SIZE;
+	if (RAND_bytes(header->nonce, sizeof(header->nonce)) != 1)
+		return -EIO;
+
+	ssize_t res = pwrite(fd, header, sizeof(*header), 0);
+	if (res == -1)
+		return -errno;
+	return res == sizeof(*header) ? 0 : -EIO;
+}
+
+int block_scratch_init(block_scratch *scratch, const block_key *key)
+{
+	memset(scratch, 0, sizeof(*scratch));
+	if (crypt_ctx_init(&scratch->xts[BLOCK_DECRYPT], &key->xts, BLOCK_DECRYPT) != SUCCESS ||
+	    crypt_ctx_init(&scratch->xts[BLOCK_ENCRYPT], &key->xts, BLOCK_ENCRYPT) != SUCCESS) {
+		block_scratch_free(scratch);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void block_scratch_free(block_scratch *scratch)
+{
+	crypt_ctx_cleanup(&scratch->xts[BLOCK_DECRYPT]);
+	crypt_ctx_cleanup(&scratch->xts[BLOCK_ENCRYPT]);
+	free(scratch->chunk);
+	scratch->chunk = NULL;
+}
+
+unsigned char *block_scratch_chunk(block_scratch *scratch)
+{
+	if (!scratch->chunk)
+		scratch->chunk = malloc(BLOCK_CHUNK_SIZE);
+	return scratch->chunk;
+}
+
+int block_crypt(block_scratch *scratch, const block_header *header, uint64_t index,
+		const unsigned char *in, unsigned char *out, size_t length, int action)
+{
+	if (length == 0)
+		return 0;
+
+	/* the nonce keeps files apart, the index keeps blocks within a file apart */
+	unsigned char tweak[BLOCK_NONCE_SIZE];
+	memcpy(tweak, header->nonce, sizeof(tweak));
+	for (int i = 0; i < 8; i++)
+		tweak[i] ^= (index >> (8 * i)) & 0xff;
+
+	crypt_ctx *ctx = &scratch->xts[action];
+	if (length >= BLOCK_MIN_LENGTH)
+		return crypt_buf(ctx, in, out, length, tweak) == (int)length ? 0 : -EIO;
+
+	/* a short final block is padded with zeros to one AES block */
+	unsigned char padded[BLOCK_MIN_LENGTH];
+	if (action == BLOCK_ENCRYPT) {
+		memset(padded, 0, sizeof(padded));
+		memcpy(padded, in, length);
+		return crypt_buf(ctx, padded, out, sizeof(padded), tweak) == sizeof(padded) ? 0 : -EIO;
+	}
+	if (crypt_buf(ctx, in, padded, sizeof(padded), tweak) != sizeof(padded))
+		return -EIO;
+	memcpy(out, padded, length);
+	return 0;
+}
+
+int block_crypt_run(block_scratch *scratch, const block_header *header, uint64_t first,
+		    unsigned char *data, size_t length, int action)
+{
+	if (scratch->pool && length >= PARALLEL_MIN_BLOCKS * BLOCK_SIZE)
+		return crypt_pool_run(scratch->pool, scratch, header, first, data, length, action);
+
+	for (size_t block = 0; block * BLOCK_SIZE < length; block++) {
+		size_t block_length = length - block * BLOCK_SIZE;
+		if (block_length > BLOCK_SIZE)
+			block_length = BLOCK_SIZE;
+		unsigned char *block_data = data + block * BLOCK_SIZE;
+		if (block_crypt(scratch, header, first + block, block_data, block_data, block_length, action) != 0)
+			return -EIO;
+	}
+	return 0;
+}
+
+static off_t plain_size_of(int fd)
+{
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) == -1)
+		return -errno;
+	return block_plain_size(fd, stbuf.st_size);
+}
+
+/* the tail length recorded in the header of a file of size bytes of plaintext */
+static uint32_t tail_length_of(off_t size)
+{
+	off_t tail = size % BLOCK_SIZE;
+	return tail < BLOCK_MIN_LENGTH ? tail : 0;
+}
+
+/* rewrites the header's tail_length, if it changes when the plaintext size goes from old_size to size */
+static int record_tail_length(int fd, off_t old_size, off_t size)
+{
+	uint32_t tail_length = tail_length_of(size);
+	if (tail_length == tail_length_of(old_size))
+		return 0;
+	ssize_t res = pwrite(fd, &tail_length, sizeof(tail_length), offsetof(block_header, tail_length));
+	if (res == -1)
+		return -errno;
+	return res == sizeof(tail_length) ? 0 : -EIO;
+}
+
+ssize_t block_pread(int fd, const block_header *header, block_scratch *scratch,
+		    char *buf, size_t size, off_t offset)
+{
+	unsigned char *chunk = block_scratch_chunk(scratch);
+	if (!chunk)
+		return -ENOMEM;
+	/* a padded final block cannot be told from a full one by how much pread returns */
+	off_t plain_size = plain_size_of(fd);
+	if (plain_size < 0)
+		return plain_size;
+	if (offset >= plain_size)
+		return 0;
+	if ((off_t)size > plain_size - offset)
+		size = plain_size - offset;
+
+	size_t done = 0;
+	while (done < size) {
+		off_t position = offset + done;
+		uint64_t first = position / BLOCK_SIZE;
+		off_t chunk_start = first * BLOCK_SIZE;
+		size_t skip = position % BLOCK_SIZE;
+		/* whole blocks covering the rest of the request, up to one chunk */
+		size_t wanted = skip + (size - done);
+		size_t span = (wanted + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		if (span > BLOCK_CHUNK_SIZE)
+			span = BLOCK_CHUNK_SIZE;
+		if ((off_t)span > plain_size - chunk_start)
+			span = plain_size - chunk_start;
+
+		size_t stored = block_stored_size(span);
+		ssize_t got = pread(fd, chunk, stored, BLOCK_HEADER_SIZE + chunk_start);
+		if (got == -1)
+			return done ? (ssize_t)done : -errno;
+		/* cut short since its size was read */
+		if ((size_t)got != stored)
+			break;
+
+		if (block_crypt_run(scratch, header, first, chunk, span, BLOCK_DECRYPT) != 0)
+			return -EIO;
+
+		size_t take = span - skip;
+		if (take > size - done)
+			take = size - done;
+		memcpy(buf + done, chunk + skip, take);
+		done += take;
+	}
+
+	return done;
+}
+
+/* encrypts blocks from the start of the block holding offset and writes them back in one pwrite
+ * offset must not be past plain_size; old contents are read back only for the partial blocks
+ * at either end of the write, so a write touches no block outside [offset, offset + size)
+ */
+static ssize_t write_blocks(int fd, const block_header *header, block_scratch *scratch,
+			    off_t plain_size, const char *buf, size_t size, off_t offset)
+{
+	unsigned char *chunk = block_scratch_chunk(scratch);
+	if (!chunk)
+		return -ENOMEM;
+	size_t done = 0;
+	while (done < size) {
+		off_t position = offset + done;
+		uint64_t first = position / BLOCK_SIZE;
+		off_t chunk_start = first * BLOCK_SIZE;
+		size_t skip = position % BLOCK_SIZE;
+		size_t take = size - done;
+		if (take > BLOCK_CHUNK_SIZE - skip)
+			take = BLOCK_CHUNK_SIZE - skip;
+		off_t end = position + take;
+
+		/* the last block keeps whatever it held past the end of the write */
+		off_t last_start = (end - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		off_t new_end = end;
+		if (plain_size > end)
+			new_end = plain_size < last_start + BLOCK_SIZE ? plain_size : last_start + BLOCK_SIZE;
+
+		uint64_t partial[2];
+		int partial_count = 0;
+		if (skip > 0)
+			partial[partial_count++] = first;
+		if (new_end > end && (partial_count == 0 || (uint64_t)(last_start / BLOCK_SIZE) != first))
+			partial[partial_count++] = last_start / BLOCK_SIZE;
+		for (int i = 0; i < partial_count; i++) {
+			off_t block_start = partial[i] * BLOCK_SIZE;
+			size_t length = plain_size - block_start < BLOCK_SIZE ? plain_size - block_start : BLOCK_SIZE;
+			unsigned char *data = chunk + (block_start - chunk_start);
+			size_t stored = block_stored_size(length);
+			ssize_t got = pread(fd, data, stored, BLOCK_HEADER_SIZE + block_start);
+			if (got == -1)
+				return done ? (ssize_t)done : -errno;
+			if ((size_t)got != stored ||
+			    block_crypt(scratch, header, partial[i], data, data, length, BLOCK_DECRYPT) != 0)
+				return done ? (ssize_t)done : -EIO;
+		}
+
+		memcpy(chunk + skip, buf + done, take);
+		size_t span = new_end - chunk_start;
+		if (block_crypt_run(scratch, header, first, chunk, span, BLOCK_ENCRYPT) != 0)
+			return done ? (ssize_t)done : -EIO;
+
+		/* only a block ending the file can be short, so only the last one here can be padded */
+		size_t stored = block_stored_size(span);
+		ssize_t res = pwrite(fd, chunk, stored, BLOCK_HEADER_SIZE + chunk_start);
+		if (res == -1)
+			return done ? (ssize_t)done : -errno;
+		if ((size_t)res != stored)
+			return done ? (ssize_t)done : -EIO;
+		if (new_end > plain_size) {
+			res = record_tail_length(fd, plain_size, new_end);
+			if (res != 0)
+				return done ? (ssize_t)done : res;
+			plain_size = new_end;
+		}
+		done += take;
+	}
+	return done;
+}
+
+/* appends zeros to a file of plain_size bytes until it is new_size bytes long */
+static int extend(int fd, const block_header *header, block_scratch *scratch,
+		  off_t plain_size, off_t new_size)
+{
+	static const char zeros[BLOCK_CHUNK_SIZE];
+	while (plain_size < new_size) {
+		size_t length = sizeof(zeros);
+		if (new_size - plain_size < (off_t)length)
+			length = new_size - plain_size;
+		ssize_t res = write_blocks(fd, header, scratch, plain_size, zeros, length, plain_size);
+		if (res < 0)
+			return res;
+		if ((size_t)res != length)
+			return -EIO;
+		plain_size += length;
+	}
+	return 0;
+}
+
+ssize_t block_pwrite(int fd, const block_header *header, block_scratch *scratch,
+		     const char *buf, size_t size, off_t offset)
+{
+	if (size == 0)
+		return 0;
+	off_t plain_size = plain_size_of(fd);
+	if (plain_size < 0)
+		return plain_size;
+
+	ssize_t res = 0;
+	/* writing past the end leaves a gap that reads back as zeros */
+	if (offset > plain_size)
+		res = extend(fd, header, scratch, plain_size, offset);
+	if (res == 0)
+		res = write_blocks(fd, header, scratch, offset > plain_size ? offset : plain_size,
+				   buf, size, offset);
+	return res;
+}
+
+int block_truncate(int fd, const block_header *header, block_scratch *scratch,
+		   off_t size)
+{
+	off_t plain_size = plain_size_of(fd);
+	if (plain_size < 0)
+		return plain_size;
+
+	if (size > plain_size)
+		return extend(fd, header, scratch, plain_size, size);
+
+	/* a block cut short is encrypted again at its new length */
+	size_t tail = size % BLOCK_SIZE;
+	if (size < plain_size && tail > 0) {
+		uint64_t index = size / BLOCK_SIZE;
+		off_t block_start = index * BLOCK_SIZE;
+		size_t length = plain_size - block_start < BLOCK_SIZE ? plain_size - block_start : BLOCK_SIZE;
+		unsigned char block[BLOCK_SIZE];
+		size_t stored = block_stored_size(length);
+		ssize_t res = pread(fd, block, stored, BLOCK_HEADER_SIZE + block_start);
+		if (res == -1)
+			return -errno;
+		if ((size_t)res != stored ||
+		    block_crypt(scratch, header, index, block, block, length, BLOCK_DECRYPT) != 0 ||
+		    block_crypt(scratch, header, index, block, block, tail, BLOCK_ENCRYPT) != 0)
+			return -EIO;
+		stored = block_stored_size(tail);
+		res = pwrite(fd, block, stored, BLOCK_HEADER_SIZE + block_start);
+		if (res == -1)
+			return -errno;
+		if ((size_t)res != stored)
+			return -EIO;
+	}
+	return block_resize(fd, plain_size, size);
+}
+
+off_t block_stored_size(off_t size)
+{
+	off_t tail = size % BLOCK_SIZE;
+	return tail > 0 && tail < BLOCK_MIN_LENGTH ? size - tail + BLOCK_MIN_LENGTH : size;
+}
+
+int block_resize(int fd, off_t old_size, off_t size)
+{
+	if (ftruncate(fd, BLOCK_HEADER_SIZE + block_stored_size(size)) == -1)
+		return -errno;
+	return record_tail_length(fd, old_size, size);
+}
+
+int block_size_padded(off_t backing_size)
+{
+	/* a padded final block leaves exactly BLOCK_MIN_LENGTH bytes past the last full block */
+	off_t stored = backing_size - BLOCK_HEADER_SIZE;
+	return stored > 0 && stored % BLOCK_SIZE == BLOCK_MIN_LENGTH;
+}
+
+off_t block_plain_size(int fd, off_t backing_size)
+{
+	off_t stored = backing_size - BLOCK_HEADER_SIZE;
+	if (stored <= 0)
+		return 0;
+	if (!block_size_padded(backing_size))
+		return stored;
+	uint32_t tail_length;
+	ssize_t res = pread(fd, &tail_length, sizeof(tail_length), offsetof(block_header, tail_length));
+	if (res == -1)
+		return -errno;
+	if (res != sizeof(tail_length) || tail_length >= BLOCK_MIN_LENGTH)
+		return -EIO;
+	return tail_length ? stored - BLOCK_MIN_LENGTH + tail_length : stored;
+}
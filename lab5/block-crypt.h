@@ -0,0 +1,143 @@
+/* block-crypt.h
+ * Random-access encrypted file format for pa5-endfs
+ *
+ * A file starts with a small header holding a random per-file nonce, and
+ * its contents follow in BLOCK_SIZE blocks that are encrypted
+ * independently, so any byte range can be read by decrypting only the
+ * blocks that cover it. Blocks use AES-256-XTS with a tweak made from the
+ * nonce and the block index. XTS cannot handle less than one AES block,
+ * so a final block shorter than BLOCK_MIN_LENGTH is zero-padded to
+ * BLOCK_MIN_LENGTH bytes before it is encrypted, and its real length is
+ * kept in the header's tail_length (0 when the final block is not
+ * padded). Other blocks keep their length, so the plaintext size is the
+ * backing file size less BLOCK_HEADER_SIZE, less the padding when the
+ * final block holds exactly BLOCK_MIN_LENGTH bytes on disk.
+ *
+ * Files without the header are in the original whole-file CBC format
+ * written by do_crypt() (see aes-crypt.h).
+ *
+ * Functions return 0 or a byte count on success and a negative errno on
+ * failure, so FUSE callbacks can return the result directly.
+ */
+
+#ifndef BLOCK_CRYPT_H
+#define BLOCK_CRYPT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+
+#define BLOCK_MAGIC "PA5BLK1"
+#define BLOCK_VERSION 2
+#define BLOCK_SIZE 4096
+#define BLOCK_NONCE_SIZE 16
+/* XTS needs at least one full AES block */
+#define BLOCK_MIN_LENGTH 16
+
+/* the most a block I/O call reads or writes with one system call */
+#define BLOCK_CHUNK_BLOCKS 256
+#define BLOCK_CHUNK_SIZE (BLOCK_CHUNK_BLOCKS * BLOCK_SIZE)
+
+#define BLOCK_DECRYPT 0
+#define BLOCK_ENCRYPT 1
+
+typedef struct block_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	unsigned char nonce[BLOCK_NONCE_SIZE];
+	/* rewritten whenever the file size changes; read it with block_plain_size() */
+	uint32_t tail_length;
+	uint32_t reserved;
+} block_header;
+
+#define BLOCK_HEADER_SIZE ((off_t)sizeof(block_header))
+
+/* Derived once at mount; XTS takes two AES-256 keys */
+typedef struct block_key_s {
+	crypt_key xts;
+} block_key;
+
+/* Working state for block I/O on one file, so reads and writes allocate nothing
+ * and each block only resets an IV. Not safe to share between threads
+ */
+typedef struct block_scratch_s {
+	/* indexed by BLOCK_DECRYPT and BLOCK_ENCRYPT */
+	crypt_ctx xts[2];
+	/* BLOCK_CHUNK_SIZE bytes for a run of blocks, allocated on first use */
+	unsigned char *chunk;
+	/* if set, long runs of blocks are split between its threads */
+	struct crypt_pool_s *pool;
+} block_scratch;
+
+/* Derive the key from a passphrase, the same way do_crypt() does */
+int block_key_init(block_key *key, const char *key_str);
+
+/* Read the header of the backing file fd
+ * Returns 0, or -ENODATA if the file is not in block format
+ */
+int block_header_read(int fd, block_header *header);
+
+/* Start fd, which must be empty, as a block format file with a new nonce */
+int block_header_init(int fd, block_header *header);
+
+/* Set up scratch with key, which must outlive it */
+int block_scratch_init(block_scratch *scratch, const block_key *key);
+void block_scratch_free(block_scratch *scratch);
+
+/* The chunk buffer of scratch, or NULL if it cannot be allocated */
+unsigned char *block_scratch_chunk(block_scratch *scratch);
+
+/* Encrypt or decrypt length bytes (at most BLOCK_SIZE) of block index; in and out may be the same
+ * A block shorter than BLOCK_MIN_LENGTH is padded, so encrypting it writes BLOCK_MIN_LENGTH bytes
+ * to out and decrypting it reads BLOCK_MIN_LENGTH bytes from in
+ */
+int block_crypt(block_scratch *scratch, const block_header *header, uint64_t index,
+		const unsigned char *in, unsigned char *out, size_t length, int action);
+
+/* Encrypt or decrypt length bytes of data in place as blocks first onward, of which only the last may be short
+ * A padded last block needs BLOCK_MIN_LENGTH bytes of data. Long runs go to scratch's pool, if it has one
+ */
+int block_crypt_run(block_scratch *scratch, const block_header *header, uint64_t first,
+		    unsigned char *data, size_t length, int action);
+
+/* Read and decrypt size bytes of plaintext at offset, touching only the blocks that cover them
+ * Returns the number of bytes read, which is short only at the end of the file
+ */
+ssize_t block_pread(int fd, const block_header *header, block_scratch *scratch,
+		    char *buf, size_t size, off_t offset);
+
+/* Encrypt and write size bytes of plaintext at offset, rewriting only the blocks they touch
+ * Blocks only partly covered are read back and decrypted first. A write past the end fills
+ * the gap with zeros, so appending touches only the old tail block and the new ones.
+ * Returns the number of bytes written
+ */
+ssize_t block_pwrite(int fd, const block_header *header, block_scratch *scratch,
+		     const char *buf, size_t size, off_t offset);
+
+/* Change the plaintext size of fd to size, zero-filling when it grows
+ * Only the block the new end falls in is re-encrypted
+ */
+int block_truncate(int fd, const block_header *header, block_scratch *scratch,
+		   off_t size);
+
+/* The bytes that size bytes of plaintext from the start of a block take on disk */
+off_t block_stored_size(off_t size);
+
+/* Set the backing size of fd for size bytes of plaintext and record its tail length
+ * old_size is the current plaintext size; the blocks themselves are not touched
+ */
+int block_resize(int fd, off_t old_size, off_t size);
+
+/* Whether a block format file whose backing file is backing_size bytes may end in a padded block,
+ * the only case in which its plaintext size needs the header's tail_length
+ */
+int block_size_padded(off_t backing_size);
+
+/* The plaintext size of the block format file fd, whose backing file is backing_size bytes
+ * Reads the header only when block_size_padded()
+ */
+off_t block_plain_size(int fd, off_t backing_size);
+
+#endif
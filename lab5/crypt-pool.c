@@ -0,0 +1,216 @@
+/* crypt-pool.c
+ * Worker threads that encrypt or decrypt the blocks of a large extent in parallel
+ *
+ * See crypt-pool.h for how it is used.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "crypt-pool.h"
+
+/* blocks a thread takes at a time; enough to make taking them cheap */
+#define CLAIM_BLOCKS 8
+
+typedef struct crypt_job_s {
+	const block_header *header;
+	unsigned char *data;
+	uint64_t first;
+	size_t length;
+	int action;
+	size_t block_count;
+	/* the next block nobody has taken, and the number of blocks done */
+	size_t next;
+	size_t finished;
+	int error;
+	struct crypt_job_s *next_job;
+} crypt_job;
+
+struct crypt_pool_s {
+	pthread_mutex_t lock;
+	/* signalled when a job arrives or the pool stops */
+	pthread_cond_t work;
+	/* broadcast when a job finishes */
+	pthread_cond_t done;
+	/* jobs with blocks left to take, oldest first */
+	crypt_job *jobs;
+	int stopping;
+	block_key key;
+	int worker_count;
+	pthread_t *threads;
+	block_scratch *scratches;
+};
+
+typedef struct worker_arg_s {
+	crypt_pool *pool;
+	block_scratch *scratch;
+} worker_arg;
+
+/* takes up to CLAIM_BLOCKS blocks of job; call with the lock held */
+static size_t claim(crypt_pool *pool, crypt_job *job, size_t *start)
+{
+	size_t count = job->block_count - job->next;
+	if (count > CLAIM_BLOCKS)
+		count = CLAIM_BLOCKS;
+	*start = job->next;
+	job->next += count;
+
+	/* a job with nothing left to take leaves the queue, though it may still be running */
+	if (job->next == job->block_count) {
+		crypt_job **link = &pool->jobs;
+		while (*link && *link != job)
+			link = &(*link)->next_job;
+		if (*link)
+			*link = job->next_job;
+	}
+	return count;
+}
+
+/* runs count blocks of job from start, then records them; call without the lock */
+static void run_blocks(crypt_pool *pool, block_scratch *scratch, crypt_job *job, size_t start, size_t count)
+{
+	int error = 0;
+	for (size_t block = start; block < start + count && !error; block++) {
+		size_t length = job->length - block * BLOCK_SIZE;
+		if (length > BLOCK_SIZE)
+			length = BLOCK_SIZE;
+		unsigned char *data = job->data + block * BLOCK_SIZE;
+		error = block_crypt(scratch, job->header, job->first + block, data, data, length, job->action);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (error)
+		job->error = error;
+	job->finished += count;
+	if (job->finished == job->block_count)
+		pthread_cond_broadcast(&pool->done);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker(void *arg)
+{
+	crypt_pool *pool = ((worker_arg *)arg)->pool;
+	block_scratch *scratch = ((worker_arg *)arg)->scratch;
+	free(arg);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->jobs && !pool->stopping)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->jobs)
+			break;
+		crypt_job *job = pool->jobs;
+		size_t start;
+		size_t count = claim(pool, job, &start);
+		pthread_mutex_unlock(&pool->lock);
+		run_blocks(pool, scratch, job, start, count);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+crypt_pool *crypt_pool_create(int workers, const block_key *key)
+{
+	if (workers < 1)
+		return NULL;
+	crypt_pool *pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->key = *key;
+	pool->threads = calloc(workers, sizeof(*pool->threads));
+	pool->scratches = calloc(workers, sizeof(*pool->scratches));
+	if (!pool->threads || !pool->scratches) {
+		free(pool->threads);
+		free(pool->scratches);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (int i = 0; i < workers; i++) {
+		worker_arg *arg = malloc(sizeof(*arg));
+		if (!arg || block_scratch_init(&pool->scratches[i], &pool->key) != 0) {
+			free(arg);
+			break;
+		}
+		arg->pool = pool;
+		arg->scratch = &pool->scratches[i];
+		if (pthread_create(&pool->threads[i], NULL, worker, arg) != 0) {
+			free(arg);
+			block_scratch_free(&pool->scratches[i]);
+			break;
+		}
+		pool->worker_count++;
+	}
+	if (pool->worker_count < workers) {
+		crypt_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void crypt_pool_destroy(crypt_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->worker_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+		block_scratch_free(&pool->scratches[i]);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool->scratches);
+	free(pool);
+}
+
+int crypt_pool_run(crypt_pool *pool, block_scratch *scratch, const block_header *header,
+		   uint64_t first, unsigned char *data, size_t length, int action)
+{
+	if (length == 0)
+		return 0;
+	crypt_job job = {
+		.header = header,
+		.data = data,
+		.first = first,
+		.length = length,
+		.action = action,
+		.block_count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE,
+	};
+
+	pthread_mutex_lock(&pool->lock);
+	crypt_job **link = &pool->jobs;
+	while (*link)
+		link = &(*link)->next_job;
+	*link = &job;
+	pthread_cond_broadcast(&pool->work);
+
+	/* the caller works on its own job alongside the workers, then waits for the blocks they took */
+	while (job.next < job.block_count) {
+		size_t start;
+		size_t count = claim(pool, &job, &start);
+		pthread_mutex_unlock(&pool->lock);
+		run_blocks(pool, scratch, &job, start, count);
+		pthread_mutex_lock(&pool->lock);
+	}
+	while (job.finished < job.block_count)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	return job.error ? -EIO : 0;
+}
+
+int crypt_pool_default_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
@@ -0,0 +1,40 @@
+/* crypt-pool.h
+ * Worker threads that encrypt or decrypt the blocks of a large extent in parallel
+ *
+ * Blocks of the block format (see block-crypt.h) are encrypted
+ * independently, so an extent of many blocks can be split between
+ * threads. crypt_pool_run() hands out runs of blocks to the workers and
+ * to the calling thread, which all work in place on the caller's buffer,
+ * so nothing is copied and the result is already in order. Any number of
+ * threads may call crypt_pool_run() at once.
+ */
+
+#ifndef CRYPT_POOL_H
+#define CRYPT_POOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "block-crypt.h"
+
+typedef struct crypt_pool_s crypt_pool;
+
+/* Start workers threads, each with its own cipher contexts for key
+ * Returns NULL if workers is less than 1 or a thread cannot be started
+ */
+crypt_pool *crypt_pool_create(int workers, const block_key *key);
+
+/* Stop the workers and free the pool; no call may be running */
+void crypt_pool_destroy(crypt_pool *pool);
+
+/* Encrypt or decrypt length bytes of data in place, as blocks first onward
+ * Only the last block may be short. The caller's scratch is used for the
+ * blocks the calling thread takes. Returns 0 or -EIO
+ */
+int crypt_pool_run(crypt_pool *pool, block_scratch *scratch, const block_header *header,
+		   uint64_t first, unsigned char *data, size_t length, int action);
+
+/* Number of threads to use for crypto on this machine, callers included */
+int crypt_pool_default_threads(void);
+
+#endif
@@ -0,0 +1,366 @@
+/* endfs-file.c
+ * Open files of pa5-endfs, shared by its high-level and low-level front ends
+ *
+ * See endfs-file.h for the formats a file can be in.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "endfs-file.h"
+
+#define DECRYPT 0
+#define ENCRYPT 1
+
+int endfs_mount_init(endfs_mount *mount, const char *key_str)
+{
+	mount->cache = NULL;
+	mount->pool = NULL;
+	if (block_key_init(&mount->key, key_str) != 0 ||
+	    crypt_key_init(&mount->cbc_key, EVP_aes_256_cbc(), key_str) != SUCCESS)
+		return -EINVAL;
+	return 0;
+}
+
+int endfs_flag_value(const char *value, size_t size)
+{
+	return size != 5 || memcmp(value, "false", 5) != 0;
+}
+
+int endfs_file_open_flags(int flags, int encrypted)
+{
+	flags &= ~(O_APPEND | O_CREAT | O_EXCL | O_TRUNC);
+	if (encrypted && (flags & O_ACCMODE) == O_WRONLY)
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	return flags;
+}
+
+/* wraps fd in a new file; closes fd on failure */
+static int attach(endfs_mount *mount, int fd, int format, const block_header *header, endfs_file **file)
+{
+	endfs_file *fh = malloc(sizeof(endfs_file));
+	if (!fh) {
+		close(fd);
+		return -ENOMEM;
+	}
+	int res = block_scratch_init(&fh->scratch, &mount->key);
+	if (res != 0) {
+		free(fh);
+		close(fd);
+		return res;
+	}
+	fh->scratch.pool = mount->pool;
+	fh->fd = fd;
+	fh->format = format;
+	fh->has_header = header != NULL;
+	if (header)
+		fh->header = *header;
+	pthread_mutex_init(&fh->lock, NULL);
+	*file = fh;
+	return 0;
+}
+
+int endfs_file_open(endfs_mount *mount, int fd, int flags, int encrypted, endfs_file **file)
+{
+	int res = 0;
+	if (flags & O_TRUNC) {
+		/* through the cache, which may hold dirty blocks of the file from other handles */
+		if (encrypted)
+			res = endfs_truncate(mount, fd, 0);
+		else if (ftruncate(fd, 0) == -1)
+			res = -errno;
+		if (res != 0) {
+			close(fd);
+			return res;
+		}
+	}
+	if (!encrypted)
+		return attach(mount, fd, FORMAT_PLAIN, NULL, file);
+
+	block_header header;
+	struct stat stbuf;
+	res = block_header_read(fd, &header);
+	if (res == -ENODATA && fstat(fd, &stbuf) == 0 && stbuf.st_size == 0) {
+		/* files are created in block format, but one emptied by another program has no header yet */
+		if ((flags & O_ACCMODE) == O_RDONLY)
+			return attach(mount, fd, FORMAT_BLOCK, NULL, file);
+		res = block_header_init(fd, &header);
+	}
+	if (res == -ENODATA)
+		return attach(mount, fd, FORMAT_LEGACY, NULL, file);
+	if (res != 0) {
+		close(fd);
+		return res;
+	}
+	return attach(mount, fd, FORMAT_BLOCK, &header, file);
+}
+
+int endfs_file_create(endfs_mount *mount, int fd, endfs_file **file)
+{
+	block_header header;
+	int res = block_header_init(fd, &header);
+	if (res != 0) {
+		close(fd);
+		return res;
+	}
+	return attach(mount, fd, FORMAT_BLOCK, &header, file);
+}
+
+int endfs_file_flush(endfs_mount *mount, endfs_file *file)
+{
+	if (file->format != FORMAT_BLOCK || !mount->cache)
+		return 0;
+	struct stat stbuf;
+	if (fstat(file->fd, &stbuf) == -1)
+		return -errno;
+	return block_cache_flush(mount->cache, stbuf.st_ino);
+}
+
+int endfs_file_release(endfs_mount *mount, endfs_file *file)
+{
+	/* writes stay in the cache until the file is closed */
+	int res = endfs_file_flush(mount, file);
+	close(file->fd);
+	block_scratch_free(&file->scratch);
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+	return res;
+}
+
+/* reads from a file in the whole-file format by decrypting all of it to a temporary file */
+static int legacy_read(endfs_mount *mount, endfs_file *file, char *buf, size_t size, off_t offset)
+{
+	crypt_ctx decrypt;
+	if (crypt_ctx_init(&decrypt, &mount->cbc_key, DECRYPT) != SUCCESS)
+		return -ENOMEM;
+
+	int fd = dup(file->fd);
+	FILE *fp_encrypted = fd == -1 ? NULL : fdopen(fd, "rb");
+	FILE *fp_decrypted = tmpfile();
+	int res = 0;
+	if (!fp_encrypted || !fp_decrypted)
+		res = -errno;
+
+	if (res == 0) {
+		/* the dup shares its file offset with file->fd, which the last call left at the end */
+		rewind(fp_encrypted);
+		do_crypt_ctx(fp_encrypted, fp_decrypted, &decrypt);
+		fseek(fp_decrypted, offset, SEEK_SET);
+		res = fread(buf, 1, size, fp_decrypted);
+		if ((size_t)res != size && ferror(fp_decrypted))
+			res = -EIO;
+	}
+
+	if (fp_encrypted)
+		fclose(fp_encrypted);
+	else if (fd != -1)
+		close(fd);
+	if (fp_decrypted)
+		fclose(fp_decrypted);
+	crypt_ctx_cleanup(&decrypt);
+	return res;
+}
+
+/* writes to a file in the whole-file format by decrypting, patching and encrypting all of it */
+static int legacy_write(endfs_mount *mount, endfs_file *file, const char *buf, size_t size, off_t offset)
+{
+	crypt_ctx decrypt, encrypt;
+	if (crypt_ctx_init(&decrypt, &mount->cbc_key, DECRYPT) != SUCCESS)
+		return -ENOMEM;
+	if (crypt_ctx_init(&encrypt, &mount->cbc_key, ENCRYPT) != SUCCESS) {
+		crypt_ctx_cleanup(&decrypt);
+		return -ENOMEM;
+	}
+
+	int fd = dup(file->fd);
+	FILE *fp_encrypted = fd == -1 ? NULL : fdopen(fd, "rb+");
+	FILE *fp_decrypted = tmpfile();
+	int res = 0;
+	if (!fp_encrypted || !fp_decrypted)
+		res = -errno;
+
+	if (res == 0) {
+		rewind(fp_encrypted);
+		do_crypt_ctx(fp_encrypted, fp_decrypted, &decrypt);
+
+		/* write modification of decrypted file */
+		fseek(fp_decrypted, offset, SEEK_SET);
+		res = fwrite(buf, 1, size, fp_decrypted);
+		if ((size_t)res != size)
+			res = -EIO;
+	}
+
+	if (res >= 0) {
+		/* write modified file back into original file */
+		fseek(fp_encrypted, 0, SEEK_SET);
+		fseek(fp_decrypted, 0, SEEK_SET);
+		do_crypt_ctx(fp_decrypted, fp_encrypted, &encrypt);
+	}
+
+	if (fp_encrypted)
+		fclose(fp_encrypted);
+	else if (fd != -1)
+		close(fd);
+	if (fp_decrypted)
+		fclose(fp_decrypted);
+	crypt_ctx_cleanup(&decrypt);
+	crypt_ctx_cleanup(&encrypt);
+	return res;
+}
+
+ssize_t endfs_file_read(endfs_mount *mount, endfs_file *file, char *buf, size_t size, off_t offset)
+{
+	ssize_t res;
+	if (file->format == FORMAT_PLAIN) {
+		res = pread(file->fd, buf, size, offset);
+		return res == -1 ? -errno : res;
+	}
+
+	pthread_mutex_lock(&file->lock);
+	if (file->format == FORMAT_LEGACY)
+		res = legacy_read(mount, file, buf, size, offset);
+	else {
+		/* block format files are read by decrypting only the blocks covering the request */
+		res = file->has_header ? 0 : block_header_read(file->fd, &file->header);
+		if (res == 0) {
+			file->has_header = 1;
+			if (mount->cache)
+				res = block_cache_read(mount->cache, file->fd, &file->header, buf, size, offset);
+			else
+				res = block_pread(file->fd, &file->header, &file->scratch, buf, size, offset);
+		}
+		else if (res == -ENODATA)
+			res = 0;
+	}
+	pthread_mutex_unlock(&file->lock);
+	return res;
+}
+
+ssize_t endfs_file_write(endfs_mount *mount, endfs_file *file, const char *buf, size_t size, off_t offset)
+{
+	ssize_t res;
+	if (file->format == FORMAT_PLAIN) {
+		res = pwrite(file->fd, buf, size, offset);
+		return res == -1 ? -errno : res;
+	}
+
+	pthread_mutex_lock(&file->lock);
+	if (file->format == FORMAT_LEGACY)
+		res = legacy_write(mount, file, buf, size, offset);
+	/* block format files are patched in place, block by block */
+	else if (mount->cache)
+		res = block_cache_write(mount->cache, file->fd, &file->header, buf, size, offset);
+	else
+		res = block_pwrite(file->fd, &file->header, &file->scratch, buf, size, offset);
+	pthread_mutex_unlock(&file->lock);
+	return res;
+}
+
+int endfs_file_truncate(endfs_mount *mount, endfs_file *file, off_t size)
+{
+	int res;
+	if (file->format == FORMAT_PLAIN) {
+		res = ftruncate(file->fd, size);
+		return res == -1 ? -errno : 0;
+	}
+	/* the whole-file format is only ever rewritten whole */
+	if (file->format == FORMAT_LEGACY || !file->has_header)
+		return -ENODATA;
+
+	pthread_mutex_lock(&file->lock);
+	if (mount->cache)
+		res = block_cache_truncate(mount->cache, file->fd, &file->header, size);
+	else
+		res = block_truncate(file->fd, &file->header, &file->scratch, size);
+	pthread_mutex_unlock(&file->lock);
+	return res;
+}
+
+int endfs_file_stat(endfs_file *file, struct stat *stbuf)
+{
+	if (fstat(file->fd, stbuf) == -1)
+		return -errno;
+	if (file->format == FORMAT_BLOCK) {
+		off_t size = block_plain_size(file->fd, stbuf->st_size);
+		if (size < 0)
+			return size;
+		stbuf->st_size = size;
+	}
+	return 0;
+}
+
+int endfs_file_fsync(endfs_mount *mount, endfs_file *file, int datasync)
+{
+	int res = endfs_file_flush(mount, file);
+	if (res != 0)
+		return res;
+	res = datasync ? fdatasync(file->fd) : fsync(file->fd);
+	if (res == -1)
+		return -errno;
+	return 0;
+}
+
+int endfs_truncate(endfs_mount *mount, int fd, off_t size)
+{
+	block_header header;
+	struct stat stbuf;
+	int res = block_header_read(fd, &header);
+	/* files are created in block format, but one emptied by another program has no header yet */
+	if (res == -ENODATA && fstat(fd, &stbuf) == 0 && stbuf.st_size == 0)
+		res = block_header_init(fd, &header);
+	if (res == -ENODATA) {
+		res = ftruncate(fd, size);
+		return res == -1 ? -errno : 0;
+	}
+	if (res != 0)
+		return res;
+
+	if (mount->cache)
+		return block_cache_truncate(mount->cache, fd, &header, size);
+	block_scratch scratch;
+	res = block_scratch_init(&scratch, &mount->key);
+	scratch.pool = mount->pool;
+	if (res == 0)
+		res = block_truncate(fd, &header, &scratch, size);
+	block_scratch_free(&scratch);
+	return res;
+}
+
+int endfs_format_stat(int format, struct stat *stbuf)
+{
+	/* block format files carry a header that is not part of their contents */
+	if (format != FORMAT_BLOCK || !S_ISREG(stbuf->st_mode) || stbuf->st_size < BLOCK_HEADER_SIZE)
+		return 0;
+	if (block_size_padded(stbuf->st_size))
+		return -ENODATA;
+	stbuf->st_size -= BLOCK_HEADER_SIZE;
+	return 0;
+}
+
+int endfs_plain_stat(int fd, int format, struct stat *stbuf)
+{
+	/* shorter files may be empty ones still to get a header, so they tell nothing */
+	if (!S_ISREG(stbuf->st_mode) || stbuf->st_size < BLOCK_HEADER_SIZE)
+		return format;
+	if (format == -1) {
+		block_header header;
+		int res = block_header_read(fd, &header);
+		if (res == -ENODATA)
+			return FORMAT_LEGACY;
+		if (res != 0)
+			return -1;
+		format = FORMAT_BLOCK;
+	}
+	if (format == FORMAT_BLOCK) {
+		off_t size = block_plain_size(fd, stbuf->st_size);
+		if (size >= 0)
+			stbuf->st_size = size;
+	}
+	return format;
+}
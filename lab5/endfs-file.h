@@ -0,0 +1,116 @@
+/* endfs-file.h
+ * Open files of pa5-endfs, shared by its high-level and low-level front ends
+ *
+ * A front end resolves and opens the backing file however its FUSE API
+ * wants, then wraps the fd in an endfs_file, which remembers how the
+ * contents are stored and does every read, write and truncate in that
+ * format:
+ *
+ *   FORMAT_PLAIN   not marked encrypted; passed through as is
+ *   FORMAT_BLOCK   the block format (see block-crypt.h), through the cache
+ *                  if the mount has one
+ *   FORMAT_LEGACY  marked encrypted but without a block header: the old
+ *                  whole-file CBC format, rewritten whole on every write
+ *
+ * Calls on one file are serialized by its lock where they share its
+ * scratch buffers, so any FUSE thread may use it. Functions return 0 or a
+ * byte count on success and a negative errno on failure.
+ */
+
+#ifndef ENDFS_FILE_H
+#define ENDFS_FILE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "aes-crypt.h"
+#include "block-crypt.h"
+#include "block-cache.h"
+#include "crypt-pool.h"
+
+/* marks a backing file as encrypted unless its value is "false" */
+#define XATTR_NAME "user.pa5-encfs.encrypted"
+
+#define FORMAT_PLAIN 0
+#define FORMAT_BLOCK 1
+#define FORMAT_LEGACY 2
+
+/* keys and shared state of one mount */
+typedef struct endfs_mount_s {
+	/* for block format and whole-file format files */
+	block_key key;
+	crypt_key cbc_key;
+	/* NULL when the cache is turned off */
+	block_cache *cache;
+	/* NULL when crypto runs on the calling thread only */
+	crypt_pool *pool;
+} endfs_mount;
+
+typedef struct endfs_file_s {
+	int fd;
+	int format;
+	/* for FORMAT_BLOCK; unset while a file opened read-only is still empty */
+	int has_header;
+	block_header header;
+	/* cipher context and buffers, used by one call at a time under lock */
+	block_scratch scratch;
+	pthread_mutex_t lock;
+} endfs_file;
+
+/* Derive the keys of mount from a passphrase; the cache and pool start unset */
+int endfs_mount_init(endfs_mount *mount, const char *key_str);
+
+/* Whether value, the XATTR_NAME attribute of a backing file, marks it encrypted */
+int endfs_flag_value(const char *value, size_t size);
+
+/* The flags to open the backing file with, for a file opened with flags
+ * Offsets come from the kernel, encrypted files are read to patch their blocks,
+ * and O_TRUNC is left to endfs_file_open()
+ */
+int endfs_file_open_flags(int flags, int encrypted);
+
+/* Wrap fd, opened with endfs_file_open_flags(flags), in a new file; closes fd on failure
+ * For O_TRUNC in flags the file is emptied first, through the cache if it is encrypted
+ */
+int endfs_file_open(endfs_mount *mount, int fd, int flags, int encrypted, endfs_file **file);
+
+/* Start fd, a new empty file opened read-write, in block format and wrap it
+ * The caller still marks it encrypted
+ */
+int endfs_file_create(endfs_mount *mount, int fd, endfs_file **file);
+
+/* Write back the dirty blocks the cache holds for file's inode */
+int endfs_file_flush(endfs_mount *mount, endfs_file *file);
+
+/* Write back what the cache holds for file, close it and free it */
+int endfs_file_release(endfs_mount *mount, endfs_file *file);
+
+ssize_t endfs_file_read(endfs_mount *mount, endfs_file *file, char *buf, size_t size, off_t offset);
+ssize_t endfs_file_write(endfs_mount *mount, endfs_file *file, const char *buf, size_t size, off_t offset);
+
+/* Truncate file to size plaintext bytes
+ * Returns -ENODATA if only the backing file can be truncated, through endfs_truncate()
+ */
+int endfs_file_truncate(endfs_mount *mount, endfs_file *file, off_t size);
+
+/* fstat() with the plaintext size */
+int endfs_file_stat(endfs_file *file, struct stat *stbuf);
+
+int endfs_file_fsync(endfs_mount *mount, endfs_file *file, int datasync);
+
+/* Truncate the backing file fd, opened read-write and marked encrypted, to size plaintext bytes */
+int endfs_truncate(endfs_mount *mount, int fd, off_t size);
+
+/* Set the size in stbuf, from stat() of an encrypted backing file in format, to its plaintext size
+ * Returns 0, or -ENODATA if that needs the header, which only endfs_plain_stat() reads
+ */
+int endfs_format_stat(int format, struct stat *stbuf);
+
+/* Set the size in stbuf, from stat() of the encrypted backing file fd, to its plaintext size
+ * format is FORMAT_BLOCK or FORMAT_LEGACY if known, or -1 to find it from the header
+ * Returns the format, or -1 if it is still not known
+ */
+int endfs_plain_stat(int fd, int format, struct stat *stbuf);
+
+#endif
@@ -0,0 +1,109 @@
+/* inode-flags.c
+ * Table of the encrypted flag of backing files, keyed by inode
+ *
+ * See inode-flags.h for when entries are set and forgotten.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "inode-flags.h"
+
+typedef struct flag_entry_s {
+	dev_t dev;
+	ino_t ino;
+	/* 0 or 1, or -1 for an empty entry */
+	int flag;
+	/* FORMAT_BLOCK or FORMAT_LEGACY of an encrypted file, or -1 while not known */
+	int format;
+} flag_entry;
+
+struct inode_flags_s {
+	pthread_mutex_t lock;
+	size_t count;
+	flag_entry *entries;
+};
+
+static flag_entry *entry_of(inode_flags *table, dev_t dev, ino_t ino)
+{
+	uint64_t hash = ((uint64_t)ino * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)dev;
+	return &table->entries[(hash >> 16) % table->count];
+}
+
+inode_flags *inode_flags_create(size_t count)
+{
+	if (count == 0)
+		return NULL;
+	inode_flags *table = malloc(sizeof(*table));
+	if (!table)
+		return NULL;
+	table->entries = malloc(count * sizeof(*table->entries));
+	if (!table->entries) {
+		free(table);
+		return NULL;
+	}
+	for (size_t i = 0; i < count; i++) {
+		table->entries[i].flag = -1;
+		table->entries[i].format = -1;
+	}
+	table->count = count;
+	pthread_mutex_init(&table->lock, NULL);
+	return table;
+}
+
+void inode_flags_destroy(inode_flags *table)
+{
+	pthread_mutex_destroy(&table->lock);
+	free(table->entries);
+	free(table);
+}
+
+int inode_flags_get(inode_flags *table, dev_t dev, ino_t ino)
+{
+	pthread_mutex_lock(&table->lock);
+	flag_entry *entry = entry_of(table, dev, ino);
+	int flag = entry->flag != -1 && entry->dev == dev && entry->ino == ino ? entry->flag : -1;
+	pthread_mutex_unlock(&table->lock);
+	return flag;
+}
+
+void inode_flags_set(inode_flags *table, dev_t dev, ino_t ino, int flag)
+{
+	pthread_mutex_lock(&table->lock);
+	flag_entry *entry = entry_of(table, dev, ino);
+	if (entry->flag != flag || entry->dev != dev || entry->ino != ino)
+		entry->format = -1;
+	entry->dev = dev;
+	entry->ino = ino;
+	entry->flag = flag;
+	pthread_mutex_unlock(&table->lock);
+}
+
+void inode_flags_forget(inode_flags *table, dev_t dev, ino_t ino)
+{
+	pthread_mutex_lock(&table->lock);
+	flag_entry *entry = entry_of(table, dev, ino);
+	if (entry->dev == dev && entry->ino == ino)
+		entry->flag = -1;
+	pthread_mutex_unlock(&table->lock);
+}
+
+int inode_flags_get_format(inode_flags *table, dev_t dev, ino_t ino)
+{
+	pthread_mutex_lock(&table->lock);
+	flag_entry *entry = entry_of(table, dev, ino);
+	int format = entry->flag != -1 && entry->dev == dev && entry->ino == ino ? entry->format : -1;
+	pthread_mutex_unlock(&table->lock);
+	return format;
+}
+
+void inode_flags_set_format(inode_flags *table, dev_t dev, ino_t ino, int format)
+{
+	pthread_mutex_lock(&table->lock);
+	flag_entry *entry = entry_of(table, dev, ino);
+	if (entry->flag != -1 && entry->dev == dev && entry->ino == ino)
+		entry->format = format;
+	pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,49 @@
+/* inode-flags.h
+ * Table of the encrypted flag of backing files, keyed by inode
+ *
+ * pa5-endfs works out how a file is stored from an extended attribute of
+ * its backing file (XATTR_NAME in endfs-file.h). The table remembers the
+ * answer per device and inode number, so the stat() a call already did is
+ * enough to find it again without a getxattr(). For an encrypted file it
+ * can also hold the format (FORMAT_BLOCK or FORMAT_LEGACY), once a call has
+ * read the file's header, so getattr() need not read it again. It has a
+ * fixed number of entries, each inode going in one of them, and a newer
+ * inode simply takes the place of an older one.
+ *
+ * Entries are only as fresh as the calls that change them: the mount sets
+ * them when it creates a file or changes the attribute, and forgets them
+ * when a name goes away, since the inode number may be reused. A file
+ * only changes format by being emptied, so the format is forgotten when
+ * the mount truncates an encrypted file and learned again from the next
+ * open() or getattr(). Changes made to the mirror directory behind the
+ * mount's back are not seen.
+ *
+ * Every function takes the table's lock, so they can be called from any
+ * FUSE thread.
+ */
+
+#ifndef INODE_FLAGS_H
+#define INODE_FLAGS_H
+
+#include <sys/types.h>
+
+typedef struct inode_flags_s inode_flags;
+
+/* Create a table of count entries; returns NULL if memory runs out */
+inode_flags *inode_flags_create(size_t count);
+void inode_flags_destroy(inode_flags *table);
+
+/* The flag of the inode, or -1 if the table does not know it */
+int inode_flags_get(inode_flags *table, dev_t dev, ino_t ino);
+
+/* Setting a different flag than the table holds also forgets the format */
+void inode_flags_set(inode_flags *table, dev_t dev, ino_t ino, int flag);
+void inode_flags_forget(inode_flags *table, dev_t dev, ino_t ino);
+
+/* The format of the inode, or -1 if the table does not know it */
+int inode_flags_get_format(inode_flags *table, dev_t dev, ino_t ino);
+
+/* Ignored unless the table holds the flag of the inode; -1 forgets the format */
+void inode_flags_set_format(inode_flags *table, dev_t dev, ino_t ino, int format);
+
+#endif
@@ -0,0 +1,1034 @@
+/*
+  pa5-endfs-ll: pa5-endfs on the libfuse 3 low-level API
+
+  Based on the passthrough_ll example of libfuse 3.
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+
+  gcc -Wall `pkg-config fuse3 --cflags` pa5-endfs-ll.c ... `pkg-config fuse3 --libs`
+
+  Note: Stores files the same way as pa5-endfs, and shares its open file
+        code (see endfs-file.h), but requests name inodes instead of paths.
+        Every inode the kernel knows keeps an O_PATH fd of its backing file,
+        so an operation goes straight to the *at() call on it without
+        building or resolving a path. Requests are served by a pool of
+        session threads, carry up to 1 MiB, and with the kernel's writeback
+        cache small writes reach us merged into pages. Without it, plain
+        files are passed through where libfuse and the kernel support it,
+        so their reads and writes never reach us at all.
+
+*/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "endfs-file.h"
+
+#define HANDLE(fi) ((endfs_file *) (uintptr_t) (fi)->fh)
+#define DIR_HANDLE(fi) ((endfs_dir *) (uintptr_t) (fi)->fh)
+
+// read-only attribute of every file in the mount, holding the block cache counters
+#define CACHE_STATS_XATTR "user.pa5-endfs.cache_stats"
+
+// size of the decrypted block cache in MiB, unless set with -o cache_size=
+#define DEFAULT_CACHE_SIZE 32
+// session threads kept waiting for requests, unless set with -o workers=
+#define DEFAULT_WORKERS 10
+// largest read or write request, also the readahead window
+#define MAX_TRANSFER (1 << 20)
+
+// buckets of the inode table, a power of two
+#define INODE_BUCKETS 4096
+
+// "/proc/self/fd/" and an int
+#define PROC_PATH_SIZE 32
+
+typedef struct endfs_inode_s
+{
+	// O_PATH fd of the backing file, which follows it through renames
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	// lookups the kernel has not forgotten yet; the inode goes at 0
+	uint64_t nlookup;
+	// the encrypted flag of the backing file, -1 until it is needed; under inodes_lock
+	int encrypted;
+	// FORMAT_BLOCK or FORMAT_LEGACY of an encrypted file, -1 until its header is read; under inodes_lock
+	int format;
+	// handles open on the plain file, and the passthrough backing file they share, if any; under inodes_lock
+	unsigned int plain_opens;
+	int backing_id;
+	struct endfs_inode_s *next;
+} endfs_inode;
+
+typedef struct
+{
+	endfs_mount mount;
+	// the mirror directory, which is never forgotten
+	endfs_inode root;
+	pthread_mutex_t inodes_lock;
+	endfs_inode *inodes[INODE_BUCKETS];
+	double timeout;
+	int writeback;
+	// whether the kernel agreed in init() to read and write plain files itself
+	int passthrough;
+	// threads for crypto on large extents, callers included; started in init()
+	int crypt_threads;
+} endfs_data;
+
+typedef struct
+{
+	DIR *dp;
+	// the entry read but not yet returned, and the offset after the last one returned
+	struct dirent *entry;
+	off_t offset;
+} endfs_dir;
+
+typedef struct
+{
+	unsigned long cache_size;
+	int crypt_threads;
+	int workers;
+	int writeback;
+	double timeout;
+} options;
+
+static const struct fuse_opt endfs_opts[] = {
+	{ "cache_size=%lu", offsetof(options, cache_size), 0 },
+	{ "crypt_threads=%d", offsetof(options, crypt_threads), 0 },
+	{ "workers=%d", offsetof(options, workers), 0 },
+	{ "writeback", offsetof(options, writeback), 1 },
+	{ "no_writeback", offsetof(options, writeback), 0 },
+	{ "timeout=%lf", offsetof(options, timeout), 0 },
+	FUSE_OPT_END
+};
+
+static endfs_data *get_data(fuse_req_t req)
+{
+	return fuse_req_userdata(req);
+}
+
+static endfs_inode *get_inode(fuse_req_t req, fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &get_data(req)->root;
+	return (endfs_inode *) (uintptr_t) ino;
+}
+
+// the flag only changes through setxattr() and removexattr() on the inode itself,
+// since the inode keeps its backing file from being freed and its number reused
+static void set_encrypted(endfs_data *data, endfs_inode *inode, int flag)
+{
+	pthread_mutex_lock(&data->inodes_lock);
+	if (inode->encrypted != flag)
+		inode->format = -1;
+	inode->encrypted = flag;
+	pthread_mutex_unlock(&data->inodes_lock);
+}
+
+// a file only changes format by being emptied, so truncates forget it and opens learn it again
+static void set_format(endfs_data *data, endfs_inode *inode, int format)
+{
+	pthread_mutex_lock(&data->inodes_lock);
+	inode->format = format;
+	pthread_mutex_unlock(&data->inodes_lock);
+}
+
+// calls that have no *at() form, or none that takes an O_PATH fd, go through /proc
+static void proc_path(char *buf, int fd)
+{
+	snprintf(buf, PROC_PATH_SIZE, "/proc/self/fd/%d", fd);
+}
+
+// returns 1 if the backing file of fd is marked as encrypted, 0 if not, or -errno
+static int is_encrypted(int fd)
+{
+	char procname[PROC_PATH_SIZE];
+	char val[10];
+	proc_path(procname, fd);
+	int ret = getxattr(procname, XATTR_NAME, val, sizeof(val) - 1);
+	if (ret == -1 && errno == ENODATA)
+		return 0;
+	else if (ret == -1)
+		return -errno;
+	return endfs_flag_value(val, ret);
+}
+
+// is_encrypted() for inode, asking the backing file only the first time
+static int inode_encrypted(endfs_data *data, endfs_inode *inode)
+{
+	pthread_mutex_lock(&data->inodes_lock);
+	int flag = inode->encrypted;
+	pthread_mutex_unlock(&data->inodes_lock);
+	if (flag != -1)
+		return flag;
+
+	flag = is_encrypted(inode->fd);
+	if (flag >= 0)
+		set_encrypted(data, inode, flag);
+	return flag;
+}
+
+// sets the size in stbuf, from stat() of inode, to the plaintext size for block format files;
+// once the format is known, the file is only read again when it may end in a padded block
+static void plain_size(endfs_data *data, endfs_inode *inode, struct stat *stbuf)
+{
+	if (!S_ISREG(stbuf->st_mode) || stbuf->st_size < BLOCK_HEADER_SIZE || inode_encrypted(data, inode) != 1)
+		return;
+	pthread_mutex_lock(&data->inodes_lock);
+	int format = inode->format;
+	pthread_mutex_unlock(&data->inodes_lock);
+	if (format != -1 && endfs_format_stat(format, stbuf) == 0)
+		return;
+
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, inode->fd);
+	int file_fd = open(procname, O_RDONLY);
+	if (file_fd != -1) {
+		format = endfs_plain_stat(file_fd, format, stbuf);
+		close(file_fd);
+		set_format(data, inode, format);
+	}
+}
+
+static int stat_inode(endfs_data *data, endfs_inode *inode, struct stat *stbuf)
+{
+	if (fstatat(inode->fd, "", stbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+	plain_size(data, inode, stbuf);
+	return 0;
+}
+
+static size_t inode_bucket(dev_t dev, ino_t ino)
+{
+	return (ino * 0x9e3779b97f4a7c15ULL ^ dev) & (INODE_BUCKETS - 1);
+}
+
+// looks up name in parent, adding the inode to the table or counting one more lookup of it
+static int do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
+		     struct fuse_entry_param *e)
+{
+	endfs_data *data = get_data(req);
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = data->timeout;
+	e->entry_timeout = data->timeout;
+
+	int fd = openat(get_inode(req, parent)->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+
+	pthread_mutex_lock(&data->inodes_lock);
+	endfs_inode *inode;
+	if (e->attr.st_dev == data->root.dev && e->attr.st_ino == data->root.ino)
+		inode = &data->root;
+	else {
+		size_t bucket = inode_bucket(e->attr.st_dev, e->attr.st_ino);
+		inode = data->inodes[bucket];
+		while (inode && (inode->dev != e->attr.st_dev || inode->ino != e->attr.st_ino))
+			inode = inode->next;
+		if (!inode) {
+			inode = malloc(sizeof(endfs_inode));
+			if (!inode) {
+				pthread_mutex_unlock(&data->inodes_lock);
+				close(fd);
+				return -ENOMEM;
+			}
+			inode->fd = fd;
+			fd = -1;
+			inode->dev = e->attr.st_dev;
+			inode->ino = e->attr.st_ino;
+			inode->nlookup = 0;
+			inode->encrypted = -1;
+			inode->format = -1;
+			inode->plain_opens = 0;
+			inode->backing_id = 0;
+			inode->next = data->inodes[bucket];
+			data->inodes[bucket] = inode;
+		}
+	}
+	inode->nlookup++;
+	pthread_mutex_unlock(&data->inodes_lock);
+
+	// a known inode keeps the fd it was first found with
+	if (fd != -1)
+		close(fd);
+	plain_size(data, inode, &e->attr);
+	e->ino = inode == &data->root ? FUSE_ROOT_ID : (uintptr_t) inode;
+	return 0;
+}
+
+static void forget_one(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	endfs_data *data = get_data(req);
+	endfs_inode *inode = get_inode(req, ino);
+	if (inode == &data->root)
+		return;
+
+	pthread_mutex_lock(&data->inodes_lock);
+	inode->nlookup -= nlookup;
+	if (inode->nlookup == 0) {
+		endfs_inode **link = &data->inodes[inode_bucket(inode->dev, inode->ino)];
+		while (*link != inode)
+			link = &(*link)->next;
+		*link = inode->next;
+		close(inode->fd);
+		free(inode);
+	}
+	pthread_mutex_unlock(&data->inodes_lock);
+}
+
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int res = do_lookup(req, parent, name, &e);
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+// threads do not survive going into the background, so the pool starts here
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	endfs_data *data = userdata;
+	endfs_mount *mount = &data->mount;
+
+	conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_READ |
+				       FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	if (data->writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#ifdef FUSE_CAP_PASSTHROUGH
+	// the kernel turns passthrough off when the writeback cache is on, so it is one or the other
+	else if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		data->passthrough = 1;
+	}
+#endif
+	conn->max_write = MAX_TRANSFER;
+	conn->max_readahead = MAX_TRANSFER;
+
+	if (data->crypt_threads > 1) {
+		mount->pool = crypt_pool_create(data->crypt_threads - 1, &mount->key);
+		// without it everything still works, on one thread per request
+		if (!mount->pool)
+			fprintf(stderr, "Failed to start %d crypto threads\n", data->crypt_threads - 1);
+	}
+	if (mount->cache)
+		block_cache_set_pool(mount->cache, mount->pool);
+}
+
+static void ll_destroy(void *userdata)
+{
+	endfs_mount *mount = &((endfs_data *) userdata)->mount;
+	if (mount->cache && block_cache_destroy(mount->cache) != 0)
+		fprintf(stderr, "Failed to write back some cached blocks\n");
+	mount->cache = NULL;
+	if (mount->pool)
+		crypt_pool_destroy(mount->pool);
+	mount->pool = NULL;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	reply_entry(req, parent, name);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	forget_one(req, ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++)
+		forget_one(req, forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	int res = fi ? endfs_file_stat(HANDLE(fi), &stbuf) : stat_inode(get_data(req), get_inode(req, ino), &stbuf);
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &stbuf, get_data(req)->timeout);
+}
+
+// truncates a file that is not open, or whose handle cannot do it
+static int truncate_inode(endfs_data *data, endfs_inode *inode, off_t size)
+{
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, inode->fd);
+	int encrypted = inode_encrypted(data, inode);
+	if (encrypted < 0)
+		return encrypted;
+	if (!encrypted)
+		return truncate(procname, size) == -1 ? -errno : 0;
+
+	int fd = open(procname, O_RDWR);
+	if (fd == -1)
+		return -errno;
+	int res = endfs_truncate(&data->mount, fd, size);
+	close(fd);
+	set_format(data, inode, -1);
+	return res;
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		       int valid, struct fuse_file_info *fi)
+{
+	endfs_data *data = get_data(req);
+	endfs_inode *inode = get_inode(req, ino);
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, inode->fd);
+	int res = 0;
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		res = fi ? fchmod(HANDLE(fi)->fd, attr->st_mode) : chmod(procname, attr->st_mode);
+		res = res == -1 ? -errno : 0;
+	}
+	if (res == 0 && (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+		res = fchownat(inode->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		res = res == -1 ? -errno : 0;
+	}
+	if (res == 0 && (valid & FUSE_SET_ATTR_SIZE)) {
+		res = fi ? endfs_file_truncate(&data->mount, HANDLE(fi), attr->st_size) : -ENODATA;
+		if (res == -ENODATA)
+			res = truncate_inode(data, inode, attr->st_size);
+	}
+	if (res == 0 && (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec tv[2];
+		tv[0].tv_sec = tv[1].tv_sec = 0;
+		tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+		res = fi ? futimens(HANDLE(fi)->fd, tv) : utimensat(AT_FDCWD, procname, tv, 0);
+		res = res == -1 ? -errno : 0;
+	}
+
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		ll_getattr(req, ino, fi);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char buf[PATH_MAX + 1];
+	ssize_t res = readlinkat(get_inode(req, ino)->fd, "", buf, sizeof(buf));
+	if (res == -1)
+		fuse_reply_err(req, errno);
+	else if (res == sizeof(buf))
+		fuse_reply_err(req, ENAMETOOLONG);
+	else {
+		buf[res] = '\0';
+		fuse_reply_readlink(req, buf);
+	}
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		     mode_t mode, dev_t rdev)
+{
+	if (mknodat(get_inode(req, parent)->fd, name, mode, rdev) == -1)
+		fuse_reply_err(req, errno);
+	else
+		reply_entry(req, parent, name);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	if (mkdirat(get_inode(req, parent)->fd, name, mode) == -1)
+		fuse_reply_err(req, errno);
+	else
+		reply_entry(req, parent, name);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+		       const char *name)
+{
+	if (symlinkat(link, get_inode(req, parent)->fd, name) == -1)
+		fuse_reply_err(req, errno);
+	else
+		reply_entry(req, parent, name);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
+		    const char *name)
+{
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, get_inode(req, ino)->fd);
+	if (linkat(AT_FDCWD, procname, get_inode(req, parent)->fd, name, AT_SYMLINK_FOLLOW) == -1)
+		fuse_reply_err(req, errno);
+	else
+		reply_entry(req, parent, name);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res = unlinkat(get_inode(req, parent)->fd, name, 0);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res = unlinkat(get_inode(req, parent)->fd, name, AT_REMOVEDIR);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	int res = renameat2(get_inode(req, parent)->fd, name,
+			    get_inode(req, newparent)->fd, newname, flags);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	endfs_dir *d = malloc(sizeof(endfs_dir));
+	if (!d) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int fd = openat(get_inode(req, ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+	d->dp = fd == -1 ? NULL : fdopendir(fd);
+	if (!d->dp) {
+		int err = errno;
+		if (fd != -1)
+			close(fd);
+		free(d);
+		fuse_reply_err(req, err);
+		return;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	endfs_dir *d = DIR_HANDLE(fi);
+	char *buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	size_t used = 0;
+	int err = 0;
+	for (;;) {
+		if (!d->entry) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (!d->entry) {
+				err = errno;
+				break;
+			}
+		}
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		size_t entry_size = fuse_add_direntry(req, buf + used, size - used,
+						      d->entry->d_name, &st, d->entry->d_off);
+		// an entry that does not fit is kept for the next call
+		if (entry_size > size - used)
+			break;
+		used += entry_size;
+		d->offset = d->entry->d_off;
+		d->entry = NULL;
+	}
+
+	if (err && used == 0)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	endfs_dir *d = DIR_HANDLE(fi);
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+// hands reads and writes of a plain file handle to the kernel, which then does them on a backing file
+// without coming to us; the kernel needs every handle open on an inode at the same time to share one
+// backing file, or all to do without, so the first of them decides and the others follow it
+static void passthrough_open(fuse_req_t req, endfs_inode *inode, struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	endfs_data *data = get_data(req);
+	if (!data->passthrough)
+		return;
+
+	pthread_mutex_lock(&data->inodes_lock);
+	if (inode->plain_opens++ == 0) {
+		// opened for both, so handles opened for either can share it; the kernel keeps its own reference
+		char procname[PROC_PATH_SIZE];
+		proc_path(procname, inode->fd);
+		int fd = open(procname, O_RDWR);
+		// without one the handles are served by splicing, as without passthrough
+		inode->backing_id = fd == -1 ? 0 : fuse_passthrough_open(req, fd);
+		if (inode->backing_id < 0)
+			inode->backing_id = 0;
+		if (fd != -1)
+			close(fd);
+	}
+	fi->backing_id = inode->backing_id;
+	pthread_mutex_unlock(&data->inodes_lock);
+#else
+	(void) req;
+	(void) inode;
+	(void) fi;
+#endif
+}
+
+// the backing file goes with the last plain file handle of the inode
+static void passthrough_release(fuse_req_t req, endfs_inode *inode)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	endfs_data *data = get_data(req);
+	if (!data->passthrough)
+		return;
+
+	pthread_mutex_lock(&data->inodes_lock);
+	if (--inode->plain_opens == 0 && inode->backing_id > 0) {
+		fuse_passthrough_close(req, inode->backing_id);
+		inode->backing_id = 0;
+	}
+	pthread_mutex_unlock(&data->inodes_lock);
+#else
+	(void) req;
+	(void) inode;
+#endif
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, struct fuse_file_info *fi)
+{
+	endfs_data *data = get_data(req);
+
+	// opened for reading too, since writes patch blocks in place
+	int flags = (fi->flags & ~(O_APPEND | O_ACCMODE)) | O_CREAT | O_RDWR;
+	int fd = openat(get_inode(req, parent)->fd, name, flags, mode);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	// new files are written in block format from the start
+	endfs_file *fh;
+	int res = endfs_file_create(&data->mount, fd, &fh);
+	if (res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if (fsetxattr(fh->fd, XATTR_NAME, "true", 4, 0) == -1)
+		res = -errno;
+
+	struct fuse_entry_param e;
+	if (res == 0)
+		res = do_lookup(req, parent, name, &e);
+	if (res != 0) {
+		endfs_file_release(&data->mount, fh);
+		fuse_reply_err(req, -res);
+		return;
+	}
+	endfs_inode *inode = get_inode(req, e.ino);
+	set_encrypted(data, inode, 1);
+	set_format(data, inode, FORMAT_BLOCK);
+	fi->fh = (uintptr_t) fh;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	endfs_data *data = get_data(req);
+	endfs_inode *inode = get_inode(req, ino);
+
+	int encrypted = inode_encrypted(data, inode);
+	if (encrypted < 0) {
+		fuse_reply_err(req, -encrypted);
+		return;
+	}
+
+	// the writeback cache reads pages in before writing them, even through a write-only file
+	int flags = fi->flags;
+	if (data->writeback && (flags & O_ACCMODE) == O_WRONLY)
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	flags = endfs_file_open_flags(flags, encrypted);
+
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, inode->fd);
+	int fd = open(procname, flags);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	// O_TRUNC arrives here with the kernel's atomic_o_trunc, and is done by endfs_file_open()
+	endfs_file *fh;
+	int res = endfs_file_open(&data->mount, fd, fi->flags, encrypted, &fh);
+	if (res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if (fh->format == FORMAT_PLAIN)
+		passthrough_open(req, inode, fi);
+	// opening may have given an emptied file a header; an empty one opened read-only has none yet
+	else if (fh->format == FORMAT_LEGACY || fh->has_header)
+		set_format(data, inode, fh->format);
+	fi->fh = (uintptr_t) fh;
+	fuse_reply_open(req, fi);
+}
+
+// called on every close(), while release() comes later and its errors go nowhere
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+	int res = endfs_file_flush(&get_data(req)->mount, HANDLE(fi));
+	fuse_reply_err(req, -res);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	endfs_file *fh = HANDLE(fi);
+	if (fh->format == FORMAT_PLAIN)
+		passthrough_release(req, get_inode(req, ino));
+	int res = endfs_file_release(&get_data(req)->mount, fh);
+	fuse_reply_err(req, -res);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		     struct fuse_file_info *fi)
+{
+	(void) ino;
+	int res = endfs_file_fsync(&get_data(req)->mount, HANDLE(fi), datasync);
+	fuse_reply_err(req, -res);
+}
+
+// plain files not passed through are replied to with a range of the backing fd, which FUSE splices to the kernel
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	endfs_file *fh = HANDLE(fi);
+	if (fh->format == FORMAT_PLAIN) {
+		struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+		buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf.buf[0].fd = fh->fd;
+		buf.buf[0].pos = offset;
+		fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	char *buf = malloc(size);
+	ssize_t res = buf ? endfs_file_read(&get_data(req)->mount, fh, buf, size, offset) : -ENOMEM;
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, buf, res);
+	free(buf);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	endfs_file *fh = HANDLE(fi);
+	size_t size = fuse_buf_size(in_buf);
+	ssize_t res;
+	if (fh->format == FORMAT_PLAIN) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fh->fd;
+		dst.buf[0].pos = offset;
+		res = fuse_buf_copy(&dst, in_buf, FUSE_BUF_SPLICE_NONBLOCK);
+	}
+	// encrypted files need the data in memory, where it usually is already
+	else if (in_buf->count == 1 && !(in_buf->buf[0].flags & FUSE_BUF_IS_FD))
+		res = endfs_file_write(&get_data(req)->mount, fh, in_buf->buf[0].mem, size, offset);
+	else {
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+		mem.buf[0].mem = malloc(size);
+		res = mem.buf[0].mem ? fuse_buf_copy(&mem, in_buf, 0) : -ENOMEM;
+		if (res >= 0)
+			res = endfs_file_write(&get_data(req)->mount, fh, mem.buf[0].mem, res, offset);
+		free(mem.buf[0].mem);
+	}
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+	if (fstatvfs(get_inode(req, ino)->fd, &stbuf) == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &stbuf);
+}
+
+// replies to a getxattr or listxattr call that got res bytes into value, or asked only for the size
+static void reply_xattr(fuse_req_t req, ssize_t res, const char *value, size_t size)
+{
+	if (res == -1)
+		fuse_reply_err(req, errno);
+	else if (size == 0)
+		fuse_reply_xattr(req, res);
+	else
+		fuse_reply_buf(req, value, res);
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			const char *value, size_t size, int flags)
+{
+	// the counters are computed on every read and never stored
+	if (strcmp(name, CACHE_STATS_XATTR) == 0) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	endfs_inode *inode = get_inode(req, ino);
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, inode->fd);
+	int res = setxattr(procname, name, value, size, flags);
+	if (res == 0 && strcmp(name, XATTR_NAME) == 0)
+		set_encrypted(get_data(req), inode, endfs_flag_value(value, size));
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	if (strcmp(name, CACHE_STATS_XATTR) == 0) {
+		block_cache *cache = get_data(req)->mount.cache;
+		block_cache_stats stats = { 0, 0, 0, 0 };
+		if (cache)
+			block_cache_get_stats(cache, &stats);
+		char text[128];
+		int len = snprintf(text, sizeof(text), "hits=%lu misses=%lu evictions=%lu writebacks=%lu",
+				   stats.hits, stats.misses, stats.evictions, stats.writebacks);
+		if (size > 0 && (size_t)len > size)
+			fuse_reply_err(req, ERANGE);
+		else
+			reply_xattr(req, len, text, size);
+		return;
+	}
+
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, get_inode(req, ino)->fd);
+	char *value = size ? malloc(size) : NULL;
+	if (size && !value) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	reply_xattr(req, getxattr(procname, name, value, size), value, size);
+	free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, get_inode(req, ino)->fd);
+	char *list = size ? malloc(size) : NULL;
+	if (size && !list) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	reply_xattr(req, listxattr(procname, list, size), list, size);
+	free(list);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+	if (strcmp(name, CACHE_STATS_XATTR) == 0) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	endfs_inode *inode = get_inode(req, ino);
+	char procname[PROC_PATH_SIZE];
+	proc_path(procname, inode->fd);
+	int res = removexattr(procname, name);
+	if (res == 0 && strcmp(name, XATTR_NAME) == 0)
+		set_encrypted(get_data(req), inode, 0);
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static const struct fuse_lowlevel_ops ll_oper = {
+	.init		= ll_init,
+	.destroy	= ll_destroy,
+	.lookup		= ll_lookup,
+	.forget		= ll_forget,
+	.forget_multi	= ll_forget_multi,
+	.getattr	= ll_getattr,
+	.setattr	= ll_setattr,
+	.readlink	= ll_readlink,
+	.mknod		= ll_mknod,
+	.mkdir		= ll_mkdir,
+	.symlink	= ll_symlink,
+	.link		= ll_link,
+	.unlink		= ll_unlink,
+	.rmdir		= ll_rmdir,
+	.rename		= ll_rename,
+	.opendir	= ll_opendir,
+	.readdir	= ll_readdir,
+	.releasedir	= ll_releasedir,
+	.create		= ll_create,
+	.open		= ll_open,
+	.flush		= ll_flush,
+	.release	= ll_release,
+	.fsync		= ll_fsync,
+	.read		= ll_read,
+	.write_buf	= ll_write_buf,
+	.statfs		= ll_statfs,
+	.setxattr	= ll_setxattr,
+	.getxattr	= ll_getxattr,
+	.listxattr	= ll_listxattr,
+	.removexattr	= ll_removexattr,
+};
+
+int main(int argc, char *argv[])
+{
+	umask(0);
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <key> <mirror-dir> <mount-point> [options]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// extract necessary arguments and then reconstruct argc and argv
+	const char *key_str = argv[1];
+	const char *mirror_dir = argv[2];
+	argv[2] = argv[0];
+	argc -= 2;
+
+	static endfs_data data;
+	pthread_mutex_init(&data.inodes_lock, NULL);
+	if (endfs_mount_init(&data.mount, key_str) != 0) {
+		fprintf(stderr, "Failed to derive a key from the passphrase\n");
+		return EXIT_FAILURE;
+	}
+
+	// take our own mount options out before fuse sees them
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv + 2);
+	options opts = { DEFAULT_CACHE_SIZE, crypt_pool_default_threads(), DEFAULT_WORKERS, 1, 1.0 };
+	if (fuse_opt_parse(&args, &opts, endfs_opts, NULL) == -1)
+		return EXIT_FAILURE;
+	data.crypt_threads = opts.crypt_threads;
+	data.writeback = opts.writeback;
+	data.timeout = opts.timeout;
+	if (opts.cache_size > 0) {
+		data.mount.cache = block_cache_create(opts.cache_size << 20, &data.mount.key);
+		if (!data.mount.cache) {
+			fprintf(stderr, "Failed to allocate a %lu MiB block cache\n", opts.cache_size);
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct fuse_cmdline_opts cmdline;
+	if (fuse_parse_cmdline(&args, &cmdline) != 0)
+		return EXIT_FAILURE;
+	if (cmdline.show_help || cmdline.show_version || !cmdline.mountpoint) {
+		if (cmdline.show_help)
+			fuse_cmdline_help();
+		else if (cmdline.show_version)
+			fuse_lowlevel_version();
+		else
+			fprintf(stderr, "No mount point given\n");
+		return cmdline.mountpoint ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	data.root.fd = open(mirror_dir, O_PATH);
+	struct stat stbuf;
+	if (data.root.fd == -1 || fstat(data.root.fd, &stbuf) == -1) {
+		perror("Failed to open the mirror directory");
+		return EXIT_FAILURE;
+	}
+	data.root.dev = stbuf.st_dev;
+	data.root.ino = stbuf.st_ino;
+	data.root.nlookup = 2;
+	data.root.encrypted = -1;
+	data.root.format = -1;
+	data.root.plain_opens = 0;
+	data.root.backing_id = 0;
+
+	// reads are capped by a mount option, writes by init()
+	char max_read[32];
+	snprintf(max_read, sizeof(max_read), "-omax_read=%d", MAX_TRANSFER);
+	fuse_opt_add_arg(&args, max_read);
+
+	int res = EXIT_FAILURE;
+	struct fuse_session *se = fuse_session_new(&args, &ll_oper, sizeof(ll_oper), &data);
+	if (se && fuse_set_signal_handlers(se) == 0) {
+		if (fuse_session_mount(se, cmdline.mountpoint) == 0) {
+			fuse_daemonize(cmdline.foreground);
+			if (cmdline.singlethread)
+				res = fuse_session_loop(se);
+			else {
+				struct fuse_loop_config config;
+				config.clone_fd = cmdline.clone_fd;
+				config.max_idle_threads = opts.workers;
+				res = fuse_session_loop_mt(se, &config);
+			}
+			fuse_session_unmount(se);
+		}
+		fuse_remove_signal_handlers(se);
+	}
+	if (se)
+		fuse_session_destroy(se);
+
+	free(cmdline.mountpoint);
+	fuse_opt_free_args(&args);
+	return res ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -12,17 +12,25 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: Each open file keeps its backing fd, format and crypto state in
+        fi->fh (see endfs-file.h) from open() or create() until release(), so
+        read(), write(), fgetattr(), ftruncate() and fsync() work on it
+        directly. Path-based calls like truncate() and getattr() still open
+        the backing file as needed.
+
+        Paths are resolved relative to an fd of the mirror directory, opened
+        once at mount, with the *at() calls, so no call builds a full path
+        on the heap. The few calls without an *at() form use the fd through
+        /proc/self/fd in a buffer on the stack.
+
+        Unencrypted files are read and written with read_buf() and
+        write_buf() as ranges of their backing fd, so FUSE can splice the
+        data between the backing file and /dev/fuse without copying it
+        through this process.
 
 */
 
-#define FUSE_USE_VERSION 28
+#define FUSE_USE_VERSION 29
 #define HAVE_SETXATTR
 
 #ifdef HAVE_CONFIG_H
@@ -30,11 +38,13 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
+/* For pread()/pwrite() and the *at() calls */
+#define _XOPEN_SOURCE 700
 #endif
 
 #include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,56 +52,124 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
-#include "aes-crypt.h"
+#include "endfs-file.h"
+#include "inode-flags.h"
 
-#define KEY_STR ((context*) fuse_get_context()->private_data)->key_str
-#define MIRROR_DIR ((context*) fuse_get_context()->private_data)->mirror_dir
+#define MOUNT (&((context*) fuse_get_context()->private_data)->mount)
+#define MIRROR_FD ((context*) fuse_get_context()->private_data)->mirror_fd
+#define FLAGS ((context*) fuse_get_context()->private_data)->flags
 
-#define DECRYPT 0
-#define ENCRYPT 1
-#define PASS_THROUGH -1
+#define HANDLE(fi) ((endfs_file *) (uintptr_t) (fi)->fh)
+// read-only attribute of every file in the mount, holding the block cache counters
+#define CACHE_STATS_XATTR "user.pa5-endfs.cache_stats"
 
-#define XATTR_NAME "user.pa5-encfs.encrypted"
+// size of the decrypted block cache in MiB, unless set with -o cache_size=
+#define DEFAULT_CACHE_SIZE 32
+// inodes whose encrypted flag is remembered
+#define FLAG_TABLE_SIZE 16384
 
 typedef struct 
 {
 	char *key_str;
-	char *mirror_dir;
+	// the mirror directory, which every path is relative to
+	int mirror_fd;
+	// keys derived from key_str once at mount, the cache unless -o cache_size=0,
+	// and the pool unless crypt_threads is 1 or less
+	endfs_mount mount;
+	// threads for crypto on large extents, callers included; started in init()
+	int crypt_threads;
+	// the encrypted flag of backing files getattr() and open() have seen
+	inode_flags *flags;
 } context;
 
-// the following function is from http://stackoverflow.com/questions/8465006/how-to-concatenate-2-strings-in-c
-char* concat(const char *s1, const char *s2)
+typedef struct
 {
-    char *result = malloc(strlen(s1)+strlen(s2)+1);//+1 for the zero-terminator
-    //in real code you would check for errors in malloc here
-    strcpy(result, s1);
-    strcat(result, s2);
-    return result;
+	unsigned long cache_size;
+	int crypt_threads;
+} options;
+
+static struct fuse_opt endfs_opts[] = {
+	{ "cache_size=%lu", offsetof(options, cache_size), 0 },
+	{ "crypt_threads=%d", offsetof(options, crypt_threads), 0 },
+	FUSE_OPT_END
+};
+
+// path in the mirror directory for the *at() calls on MIRROR_FD; fuse paths all start with '/'
+static const char *relative(const char *path)
+{
+	return path[1] ? path + 1 : ".";
+}
+
+// path of the backing file through /proc, for calls that have no *at() form
+static int proc_path(char *buf, const char *path)
+{
+	int len = snprintf(buf, PATH_MAX, "/proc/self/fd/%d%s", MIRROR_FD, path);
+	return len >= PATH_MAX ? -ENAMETOOLONG : 0;
+}
+
+// returns 1 if the backing file is marked as encrypted, 0 if not, or -errno
+// given stbuf, the file's stat(), the answer comes from and goes into the flag table
+static int is_encrypted(const char *path, const struct stat *stbuf)
+{
+	int flag = stbuf ? inode_flags_get(FLAGS, stbuf->st_dev, stbuf->st_ino) : -1;
+	if (flag != -1)
+		return flag;
+
+	char full_path[PATH_MAX];
+	int ret = proc_path(full_path, path);
+	if (ret != 0)
+		return ret;
+	char val[10];
+	ret = getxattr(full_path, XATTR_NAME, val, sizeof(val) - 1);
+	if (ret == -1 && errno == ENODATA)
+		flag = 0;
+	else if (ret == -1)
+		return -errno;
+	else
+		flag = endfs_flag_value(val, ret);
+
+	if (stbuf)
+		inode_flags_set(FLAGS, stbuf->st_dev, stbuf->st_ino, flag);
+	return flag;
 }
 
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = lstat(full_path, stbuf);
+	res = fstatat(MIRROR_FD, relative(path), stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
+	// block format files carry a header that is not part of their contents; once the format
+	// is known, the file is only read again when it may end in a padded block
+	if (S_ISREG(stbuf->st_mode) && stbuf->st_size >= BLOCK_HEADER_SIZE && is_encrypted(path, stbuf) == 1) {
+		int format = inode_flags_get_format(FLAGS, stbuf->st_dev, stbuf->st_ino);
+		if (format == -1 || endfs_format_stat(format, stbuf) == -ENODATA) {
+			int fd = openat(MIRROR_FD, relative(path), O_RDONLY);
+			if (fd >= 0) {
+				format = endfs_plain_stat(fd, format, stbuf);
+				close(fd);
+				inode_flags_set_format(FLAGS, stbuf->st_dev, stbuf->st_ino, format);
+			}
+		}
+	}
+
 	return 0;
 }
 
 static int xmp_access(const char *path, int mask)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = access(full_path, mask);
+	res = faccessat(MIRROR_FD, relative(path), mask, 0);
 	if (res == -1)
 		return -errno;
 
@@ -101,9 +179,8 @@ static int xmp_access(const char *path, int mask)
 static int xmp_readlink(const char *path, char *buf, size_t size)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = readlink(full_path, buf, size - 1);
+	res = readlinkat(MIRROR_FD, relative(path), buf, size - 1);
 	if (res == -1)
 		return -errno;
 
@@ -117,14 +194,19 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
 	DIR *dp;
 	struct dirent *de;
-	char *full_path = concat(MIRROR_DIR, path);
 
 	(void) offset;
 	(void) fi;
 
-	dp = opendir(full_path);
-	if (dp == NULL)
+	int fd = openat(MIRROR_FD, relative(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
 		return -errno;
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
 
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
@@ -142,30 +224,32 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	/* On Linux this could just be 'mknod(full_path, mode, rdev)' but this
+	/* On Linux this could just be 'mknodat(MIRROR_FD, path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
-		res = open(full_path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = openat(MIRROR_FD, relative(path), O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(full_path, mode);
+		res = mkfifoat(MIRROR_FD, relative(path), mode);
 	else
-		res = mknod(full_path, mode, rdev);
+		res = mknodat(MIRROR_FD, relative(path), mode, rdev);
 	if (res == -1)
 		return -errno;
 
+	// the new file may have the inode number of one removed behind our back
+	struct stat stbuf;
+	if (S_ISREG(mode) && fstatat(MIRROR_FD, relative(path), &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+		inode_flags_set(FLAGS, stbuf.st_dev, stbuf.st_ino, 0);
 	return 0;
 }
 
 static int xmp_mkdir(const char *path, mode_t mode)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = mkdir(full_path, mode);
+	res = mkdirat(MIRROR_FD, relative(path), mode);
 	if (res == -1)
 		return -errno;
 
@@ -175,11 +259,15 @@ static int xmp_mkdir(const char *path, mode_t mode)
 static int xmp_unlink(const char *path)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = unlink(full_path);
+	// the table only knows regular files, which are removed by unlink
+	struct stat stbuf;
+	int known = fstatat(MIRROR_FD, relative(path), &stbuf, AT_SYMLINK_NOFOLLOW) == 0 && stbuf.st_nlink == 1;
+	res = unlinkat(MIRROR_FD, relative(path), 0);
 	if (res == -1)
 		return -errno;
+	if (known)
+		inode_flags_forget(FLAGS, stbuf.st_dev, stbuf.st_ino);
 
 	return 0;
 }
@@ -187,9 +275,8 @@ static int xmp_unlink(const char *path)
 static int xmp_rmdir(const char *path)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = rmdir(full_path);
+	res = unlinkat(MIRROR_FD, relative(path), AT_REMOVEDIR);
 	if (res == -1)
 		return -errno;
 
@@ -199,10 +286,9 @@ static int xmp_rmdir(const char *path)
 static int xmp_symlink(const char *from, const char *to)
 {
 	int res;
-	char *full_from = concat(MIRROR_DIR, from);
-	char *full_to = concat(MIRROR_DIR, to);
 
-	res = symlink(full_from, full_to);
+	// from is the link's contents, stored as given
+	res = symlinkat(from, MIRROR_FD, relative(to));
 	if (res == -1)
 		return -errno;
 
@@ -212,12 +298,15 @@ static int xmp_symlink(const char *from, const char *to)
 static int xmp_rename(const char *from, const char *to)
 {
 	int res;
-	char *full_from = concat(MIRROR_DIR, from);
-	char *full_to = concat(MIRROR_DIR, to);
 
-	res = rename(full_from, full_to);
+	// a file renamed over loses its name, like an unlinked one
+	struct stat stbuf;
+	int replaced = fstatat(MIRROR_FD, relative(to), &stbuf, AT_SYMLINK_NOFOLLOW) == 0 && stbuf.st_nlink == 1;
+	res = renameat(MIRROR_FD, relative(from), MIRROR_FD, relative(to));
 	if (res == -1)
 		return -errno;
+	if (replaced)
+		inode_flags_forget(FLAGS, stbuf.st_dev, stbuf.st_ino);
 
 	return 0;
 }
@@ -225,10 +314,8 @@ static int xmp_rename(const char *from, const char *to)
 static int xmp_link(const char *from, const char *to)
 {
 	int res;
-	char *full_from = concat(MIRROR_DIR, from);
-	char *full_to = concat(MIRROR_DIR, to);
 
-	res = link(full_from, full_to);
+	res = linkat(MIRROR_FD, relative(from), MIRROR_FD, relative(to), 0);
 	if (res == -1)
 		return -errno;
 
@@ -238,9 +325,8 @@ static int xmp_link(const char *from, const char *to)
 static int xmp_chmod(const char *path, mode_t mode)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = chmod(full_path, mode);
+	res = fchmodat(MIRROR_FD, relative(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
@@ -250,9 +336,8 @@ static int xmp_chmod(const char *path, mode_t mode)
 static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
-	res = lchown(full_path, uid, gid);
+	res = fchownat(MIRROR_FD, relative(path), uid, gid, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -262,8 +347,25 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 static int xmp_truncate(const char *path, off_t size)
 {
 	int res;
-	char *full_path = concat(MIRROR_DIR, path);
 
+	int encrypted = is_encrypted(path, NULL);
+	if (encrypted == 1) {
+		int fd = openat(MIRROR_FD, relative(path), O_RDWR);
+		if (fd == -1)
+			return -errno;
+		res = endfs_truncate(MOUNT, fd, size);
+		// an emptied file is given a header, whatever its format was
+		struct stat stbuf;
+		if (fstat(fd, &stbuf) == 0)
+			inode_flags_set_format(FLAGS, stbuf.st_dev, stbuf.st_ino, -1);
+		close(fd);
+		return res;
+	}
+
+	char full_path[PATH_MAX];
+	res = proc_path(full_path, path);
+	if (res != 0)
+		return res;
 	res = truncate(full_path, size);
 	if (res == -1)
 		return -errno;
@@ -274,15 +376,8 @@ static int xmp_truncate(const char *path, off_t size)
 static int xmp_utimens(const char *path, const struct timespec ts[2])
 {
 	int res;
-	struct timeval tv[2];
-	char *full_path = concat(MIRROR_DIR, path);
 
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
-	res = utimes(full_path, tv);
+	res = utimensat(MIRROR_FD, relative(path), ts, 0);
 	if (res == -1)
 		return -errno;
 
@@ -291,204 +386,266 @@ static int xmp_utimens(const char *path, const struct timespec ts[2])
 
 static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
-	char *full_path = concat(MIRROR_DIR, path);
-
-	int fd = open(full_path, fi->flags);
+	// the flag is found from the inode of the opened file, and only a write-only
+	// open of an encrypted file, which needs to read too, has to be done again
+	int flags = endfs_file_open_flags(fi->flags, 0);
+	int fd = openat(MIRROR_FD, relative(path), flags);
 	if (fd == -1)
 		return -errno;
+	struct stat stbuf;
+	int encrypted = fstat(fd, &stbuf) == -1 ? -errno : is_encrypted(path, &stbuf);
+	if (encrypted == 1 && endfs_file_open_flags(fi->flags, 1) != flags) {
+		close(fd);
+		flags = endfs_file_open_flags(fi->flags, 1);
+		fd = openat(MIRROR_FD, relative(path), flags);
+		if (fd == -1)
+			encrypted = -errno;
+	}
+	if (encrypted < 0) {
+		if (fd != -1)
+			close(fd);
+		return encrypted;
+	}
 
-	fi->fh = fd;
-
-	free(full_path);
+	endfs_file *fh;
+	int res = endfs_file_open(MOUNT, fd, fi->flags, encrypted, &fh);
+	if (res != 0)
+		return res;
+	// opening may have given an emptied file a header; an empty one opened read-only has none yet
+	if (encrypted && (fh->format == FORMAT_LEGACY || fh->has_header))
+		inode_flags_set_format(FLAGS, stbuf.st_dev, stbuf.st_ino, fh->format);
+	fi->fh = (uintptr_t) fh;
 	return 0;
 }
 
 static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi)
 {
-    (void) fi;
-
-    char *full_path = concat(MIRROR_DIR, path);
-    char *decrypted_path = concat(full_path, ".decrypted");
-
-    int operation = DECRYPT;
-
-    // read xattr; perform a pass-through if file not encrypted
-    char val[10];
-    int ret = getxattr(full_path, XATTR_NAME, &val, sizeof(val));
-    if (ret == -1 && errno == ENODATA)
-    	operation = PASS_THROUGH;
-    else if (ret == -1)
-    	return -errno;
-
-    if (strcmp(val, "false") == 0)
-    	operation = PASS_THROUGH;
-
-    if (operation == DECRYPT)
-    	printf("\n\n\nReading encrypted file\n\n\n");
-    else
-    	printf("\n\n\nReading non-encrypted file\n\n\n");
-
-    // write decrypted file to temp file
-    FILE *fp_encrypted = fopen(full_path, "rb");
-    FILE *fp_decrypted = fopen(decrypted_path, "w+");
-    if (!fp_encrypted || !fp_decrypted)
-        return -errno;
-
-    do_crypt(fp_encrypted, fp_decrypted, operation, KEY_STR);
-
-    // read from decrypted file
-    fseek(fp_decrypted, offset, SEEK_SET);
-    unsigned int res = fread(buf, 1, size, fp_decrypted);
-    if (res != size && !feof(fp_decrypted))
-        res = -errno;
-
-    // close file handles
-    fclose(fp_encrypted);
-    fclose(fp_decrypted);
-
-    // delete temporary file
-    remove(decrypted_path);
-
-    // free memory
-    free(full_path);
-    free(decrypted_path);
-
-    return res;
+    (void) path;
+    return endfs_file_read(MOUNT, HANDLE(fi), buf, size, offset);
 }
 
 static int xmp_write(const char *path, const char *buf, size_t size,
              off_t offset, struct fuse_file_info *fi)
 {
-    (void) fi;
-
-    char *full_path = concat(MIRROR_DIR, path);
-    char *decrypted_path = concat(full_path, ".decrypted");
-
-    int first_operation = DECRYPT;
-    int second_operation = ENCRYPT;
-
-    // read xattr; perform a pass-through if file not encrypted
-    char val[10];
-    int ret = getxattr(full_path, XATTR_NAME, val, sizeof(val));
-    if (ret == -1 && errno == ENODATA) {
-    	first_operation = PASS_THROUGH;
-    	second_operation = PASS_THROUGH;
-    }
-    else if (ret == -1)
-    	return -errno;
-
-    if (strcmp(val, "false") == 0) {
-    	first_operation = PASS_THROUGH;
-    	second_operation = PASS_THROUGH;
-    }
-
-    // write decrypted file to temp file
-    FILE *fp_encrypted = fopen(full_path, "rb+");
-    FILE *fp_decrypted = fopen(decrypted_path, "w+");
-    if (!fp_encrypted || !fp_decrypted)
-        return -errno;
-
-    do_crypt(fp_encrypted, fp_decrypted, first_operation, KEY_STR);
+    (void) path;
+    return endfs_file_write(MOUNT, HANDLE(fi), buf, size, offset);
+}
 
-    // write modification of decrypted file
-    fseek(fp_decrypted, offset, SEEK_SET);
-    unsigned int res = fwrite(buf, 1, size, fp_decrypted);
-    if (res != size && !feof(fp_decrypted))
-        res = -errno;
+// plain files are handed back as a range of the backing fd for FUSE to splice into the reply;
+// anything else is decrypted into a buffer, which FUSE frees
+static int xmp_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	endfs_file *fh = HANDLE(fi);
+	struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+	if (!src)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+
+	if (fh->format == FORMAT_PLAIN) {
+		src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[0].fd = fh->fd;
+		src->buf[0].pos = offset;
+		*bufp = src;
+		return 0;
+	}
 
-    // write modified file back into original file
-    fseek(fp_encrypted, 0, SEEK_SET);
-    fseek(fp_decrypted, 0, SEEK_SET);
-    do_crypt(fp_decrypted, fp_encrypted, second_operation, KEY_STR);
+	src->buf[0].mem = malloc(size);
+	int res = src->buf[0].mem ? xmp_read(path, src->buf[0].mem, size, offset, fi) : -ENOMEM;
+	if (res < 0) {
+		free(src->buf[0].mem);
+		free(src);
+		return res;
+	}
+	src->buf[0].size = res;
+	*bufp = src;
+	return 0;
+}
 
-    // close file handles
-    fclose(fp_encrypted);
-    fclose(fp_decrypted);
+// plain files get the request copied straight into the backing fd, spliced if it arrived in a pipe
+static int xmp_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			 struct fuse_file_info *fi)
+{
+	endfs_file *fh = HANDLE(fi);
+	size_t size = fuse_buf_size(buf);
+	if (fh->format == FORMAT_PLAIN) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fh->fd;
+		dst.buf[0].pos = offset;
+		return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	}
 
-    // delete temporary file
-    remove(decrypted_path);
+	// encrypted files need the data in memory, where it usually is already
+	if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return xmp_write(path, buf->buf[0].mem, size, offset, fi);
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	mem.buf[0].mem = malloc(size);
+	if (!mem.buf[0].mem)
+		return -ENOMEM;
+	ssize_t res = fuse_buf_copy(&mem, buf, 0);
+	if (res >= 0)
+		res = xmp_write(path, mem.buf[0].mem, res, offset, fi);
+	free(mem.buf[0].mem);
+	return res;
+}
 
-    // free memory
-    free(full_path);
-    free(decrypted_path);
+static int xmp_fgetattr(const char *path, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	(void) path;
+	return endfs_file_stat(HANDLE(fi), stbuf);
+}
 
-    return res;
+static int xmp_ftruncate(const char *path, off_t size,
+			 struct fuse_file_info *fi)
+{
+	int res = endfs_file_truncate(MOUNT, HANDLE(fi), size);
+	if (res == -ENODATA)
+		return xmp_truncate(path, size);
+	return res;
 }
 
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
-	char *full_path = concat(MIRROR_DIR, path);
+	char full_path[PATH_MAX];
+	int res = proc_path(full_path, path);
+	if (res != 0)
+		return res;
 
-	int res = statvfs(full_path, stbuf);
+	res = statvfs(full_path, stbuf);
 	if (res == -1)
 		return -errno;
 
-	free(full_path);
 	return 0;
 }
 
 static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
-    (void) fi;
-
-    int res;
-    char *full_path = concat(MIRROR_DIR, path);
-
-    res = creat(full_path, mode);
-    if(res == -1)
-		return -errno;
+    // opened for reading too, since writes patch blocks in place
+    int flags = (fi->flags & ~(O_APPEND | O_ACCMODE)) | O_CREAT | O_RDWR;
+    int fd = openat(MIRROR_FD, relative(path), flags, mode);
+    if (fd == -1)
+    	return -errno;
 
-    close(res);
+    // new files are written in block format from the start
+    endfs_file *fh;
+    int ret = endfs_file_create(MOUNT, fd, &fh);
+    if (ret != 0)
+    	return ret;
 
     // designate file as encrypted
     char *val = "true";
-    int ret = setxattr(full_path, XATTR_NAME, val, sizeof(int), 0);
-    if (ret == -1)
-    	return -errno;
+    ret = fsetxattr(fh->fd, XATTR_NAME, val, sizeof(int), 0);
+    struct stat stbuf;
+    if (ret == -1 || fstat(fh->fd, &stbuf) == -1) {
+    	ret = -errno;
+    	endfs_file_release(MOUNT, fh);
+    	return ret;
+    }
+    inode_flags_set(FLAGS, stbuf.st_dev, stbuf.st_ino, 1);
+    inode_flags_set_format(FLAGS, stbuf.st_dev, stbuf.st_ino, FORMAT_BLOCK);
 
-    free(full_path);
+    fi->fh = (uintptr_t) fh;
     return 0;
 }
 
-static int xmp_release(const char *path, struct fuse_file_info *fi)
+// called on every close(), while release() comes later and its errors go nowhere
+static int xmp_flush(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	(void) path;
+	return endfs_file_flush(MOUNT, HANDLE(fi));
+}
 
+static int xmp_release(const char *path, struct fuse_file_info *fi)
+{
 	(void) path;
-	(void) fi;
-	return 0;
+	return endfs_file_release(MOUNT, HANDLE(fi));
 }
 
 static int xmp_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
-
 	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+	return endfs_file_fsync(MOUNT, HANDLE(fi), isdatasync);
+}
+
+// threads do not survive fuse_main() going into the background, so the pool starts here
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	// let plain file data move between the backing files and /dev/fuse by splicing where the kernel can
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	context *my_context = fuse_get_context()->private_data;
+	endfs_mount *mount = &my_context->mount;
+	if (my_context->crypt_threads > 1) {
+		mount->pool = crypt_pool_create(my_context->crypt_threads - 1, &mount->key);
+		// without it everything still works, on one thread per request
+		if (!mount->pool)
+			fprintf(stderr, "Failed to start %d crypto threads\n", my_context->crypt_threads - 1);
+	}
+	if (mount->cache)
+		block_cache_set_pool(mount->cache, mount->pool);
+	return my_context;
+}
+
+static void xmp_destroy(void *private_data)
+{
+	endfs_mount *mount = &((context *) private_data)->mount;
+	if (mount->cache && block_cache_destroy(mount->cache) != 0)
+		fprintf(stderr, "Failed to write back some cached blocks\n");
+	mount->cache = NULL;
+	if (mount->pool)
+		crypt_pool_destroy(mount->pool);
+	mount->pool = NULL;
 }
 
 #ifdef HAVE_SETXATTR
 static int xmp_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
-	char *full_path = concat(MIRROR_DIR, path);
-	int res = lsetxattr(full_path, name, value, size, flags);
+	// the counters are computed on every read and never stored
+	if (strcmp(name, CACHE_STATS_XATTR) == 0)
+		return -EPERM;
+
+	char full_path[PATH_MAX];
+	int res = proc_path(full_path, path);
+	if (res != 0)
+		return res;
+	res = lsetxattr(full_path, name, value, size, flags);
 	if (res == -1)
 		return -errno;
+
+	struct stat stbuf;
+	if (strcmp(name, XATTR_NAME) == 0 && fstatat(MIRROR_FD, relative(path), &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+		inode_flags_set(FLAGS, stbuf.st_dev, stbuf.st_ino, endfs_flag_value(value, size));
 	return 0;
 }
 
 static int xmp_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
-	char *full_path = concat(MIRROR_DIR, path);
-	int res = lgetxattr(full_path, name, value, size);
+	if (strcmp(name, CACHE_STATS_XATTR) == 0) {
+		block_cache_stats stats = { 0, 0, 0, 0 };
+		if (MOUNT->cache)
+			block_cache_get_stats(MOUNT->cache, &stats);
+		char text[128];
+		int len = snprintf(text, sizeof(text), "hits=%lu misses=%lu evictions=%lu writebacks=%lu",
+				   stats.hits, stats.misses, stats.evictions, stats.writebacks);
+		if (size == 0)
+			return len;
+		if ((size_t)len > size)
+			return -ERANGE;
+		memcpy(value, text, len);
+		return len;
+	}
+
+	char full_path[PATH_MAX];
+	int res = proc_path(full_path, path);
+	if (res != 0)
+		return res;
+	res = lgetxattr(full_path, name, value, size);
 	if (res == -1)
 		return -errno;
 	return res;
@@ -496,8 +653,11 @@ static int xmp_getxattr(const char *path, const char *name, char *value,
 
 static int xmp_listxattr(const char *path, char *list, size_t size)
 {
-	char *full_path = concat(MIRROR_DIR, path);
-	int res = llistxattr(full_path, list, size);
+	char full_path[PATH_MAX];
+	int res = proc_path(full_path, path);
+	if (res != 0)
+		return res;
+	res = llistxattr(full_path, list, size);
 	if (res == -1)
 		return -errno;
 	return res;
@@ -505,10 +665,20 @@ static int xmp_listxattr(const char *path, char *list, size_t size)
 
 static int xmp_removexattr(const char *path, const char *name)
 {
-	char *full_path = concat(MIRROR_DIR, path);
-	int res = lremovexattr(full_path, name);
+	if (strcmp(name, CACHE_STATS_XATTR) == 0)
+		return -EPERM;
+
+	char full_path[PATH_MAX];
+	int res = proc_path(full_path, path);
+	if (res != 0)
+		return res;
+	res = lremovexattr(full_path, name);
 	if (res == -1)
 		return -errno;
+
+	struct stat stbuf;
+	if (strcmp(name, XATTR_NAME) == 0 && fstatat(MIRROR_FD, relative(path), &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+		inode_flags_set(FLAGS, stbuf.st_dev, stbuf.st_ino, 0);
 	return 0;
 }
 #endif /* HAVE_SETXATTR */
@@ -528,14 +698,21 @@ static struct fuse_operations xmp_oper = {
 	.chmod		= xmp_chmod,
 	.chown		= xmp_chown,
 	.truncate	= xmp_truncate,
+	.ftruncate	= xmp_ftruncate,
+	.fgetattr	= xmp_fgetattr,
 	.utimens	= xmp_utimens,
 	.open		= xmp_open,
 	.read		= xmp_read,
 	.write		= xmp_write,
+	.read_buf	= xmp_read_buf,
+	.write_buf	= xmp_write_buf,
 	.statfs		= xmp_statfs,
 	.create     = xmp_create,
+	.flush		= xmp_flush,
 	.release	= xmp_release,
 	.fsync		= xmp_fsync,
+	.init		= xmp_init,
+	.destroy	= xmp_destroy,
 #ifdef HAVE_SETXATTR
 	.setxattr	= xmp_setxattr,
 	.getxattr	= xmp_getxattr,
@@ -549,15 +726,45 @@ int main(int argc, char *argv[])
 	umask(0);
 
 	// extract necessary arguments and then reconstruct argc and argv
-	char *key_str = concat(argv[1], "");
-	char *mirror_dir = concat(argv[2], "");
+	char *key_str = argv[1];
+	// opened before fuse_main() changes directory, so a relative mirror path works too
+	int mirror_fd = open(argv[2], O_RDONLY | O_DIRECTORY);
+	if (mirror_fd == -1) {
+		perror("Failed to open the mirror directory");
+		return EXIT_FAILURE;
+	}
 	argv[2] = argv[0];
 	argc -= 2;
 
 	// construct context struct from these arguments
 	context *my_context = malloc(sizeof(context));
 	my_context->key_str = key_str;
-	my_context->mirror_dir = mirror_dir;
+	my_context->mirror_fd = mirror_fd;
+	if (endfs_mount_init(&my_context->mount, key_str) != 0) {
+		fprintf(stderr, "Failed to derive a key from the passphrase\n");
+		return EXIT_FAILURE;
+	}
 
-	return fuse_main(argc, argv + 2, &xmp_oper, my_context);
+	// take our own mount options out before fuse sees them
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv + 2);
+	options opts = { DEFAULT_CACHE_SIZE, crypt_pool_default_threads() };
+	if (fuse_opt_parse(&args, &opts, endfs_opts, NULL) == -1)
+		return EXIT_FAILURE;
+	my_context->crypt_threads = opts.crypt_threads;
+	my_context->flags = inode_flags_create(FLAG_TABLE_SIZE);
+	if (!my_context->flags) {
+		fprintf(stderr, "Failed to allocate the flag table\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.cache_size > 0) {
+		my_context->mount.cache = block_cache_create(opts.cache_size << 20, &my_context->mount.key);
+		if (!my_context->mount.cache) {
+			fprintf(stderr, "Failed to allocate a %lu MiB block cache\n", opts.cache_size);
+			return EXIT_FAILURE;
+		}
+	}
+
+	int res = fuse_main(args.argc, args.argv, &xmp_oper, my_context);
+	fuse_opt_free_args(&args);
+	return res;
 }